@@ -0,0 +1,575 @@
+/*
+ * bench.c
+ *
+ * Micro and macro benchmarks
+ *
+ * Every benchmark is warmed up, then timed over a number of repetitions.
+ * Each repetition runs the benchmark enough times to take at least
+ * BENCH_MIN_TIME, so short operations aren't swamped by timer overhead.
+ * The table printed at the end gives the median and spread of the time
+ * per operation, along with the rate and GFLOP/s at the median, and the
+ * same results can be written out as JSON to compare runs against a baseline.
+ */
+
+#include "inc/matrix.h"
+#include "inc/layer.h"
+#include "inc/net.h"
+#include "inc/dist.h"
+#include "inc/active.h"
+#include "inc/csv.h"
+#include "inc/train.h"
+#include "inc/gemm.h"
+#include "inc/quant.h"
+#include "inc/half.h"
+#include "inc/eval.h"
+#include "inc/mem.h"
+#include "inc/timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Defines */
+// Shortest time a single repetition is allowed to take, in seconds
+#define BENCH_MIN_TIME 0.02
+
+// Defaults for the number of warmup and timed repetitions
+#define BENCH_WARMUP 2
+#define BENCH_REPS 15
+
+// Most benchmarks held in one run
+#define BENCH_MAX 64
+
+// Synthetic MNIST style dataset
+#define BENCH_ROWS 6000
+#define BENCH_ISIZE 784
+#define BENCH_OSIZE 10
+#define BENCH_HIDDEN 30
+
+// Reduced precision check, a small linear layer fed zero-centred samples
+#define BENCH_CHECK_ISIZE 64
+#define BENCH_CHECK_OSIZE 8
+#define BENCH_CHECK_SAMPLES 256
+#define BENCH_CHECK_TOL 0.05	// Largest error allowed, relative to the largest output
+
+/* Types and structs */
+// Benchmark body, runs the operation iters times
+typedef void (*bench_f)(void *arg, int iters);
+
+// Timings of a single benchmark
+typedef struct bench_result {
+	char name[64];
+	char *unit;			// What the rate counts, per second
+	int reps;			// Timed repetitions
+	int iters;			// Operations per repetition
+	
+	// Seconds per operation
+	double min;
+	double p10;
+	double median;
+	double p90;
+	double max;
+	
+	double rate;		// Units per second at the median
+	double gflops;		// At the median, 0 if not meaningful
+} bench_result_t;
+
+// Settings and results of a run
+typedef struct bench {
+	int warmup;			// Untimed repetitions
+	int reps;			// Timed repetitions
+	char *filter;		// Only run benchmarks whose name contains this, NULL for all
+	
+	bench_result_t results[BENCH_MAX];
+	int count;
+} bench_t;
+
+// Arguments for the matrix benchmarks
+typedef struct bench_mat {
+	void (*mul)(matrix_t *a, matrix_t *b, matrix_t *c);
+	matrix_t *a, *b, *c;
+} bench_mat_t;
+
+// Arguments for the network benchmarks
+typedef struct bench_net {
+	network_t *net;
+	layer_t *layer;
+	trainer_t *trainer;
+	eval_t *eval;
+	batch_t *set;
+	matrix_t *in;
+	matrix_t *out;
+	char *path;
+} bench_net_t;
+
+/*
+ * Compares two times for qsort
+ */
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	
+	return (x > y) - (x < y);
+}
+
+/*
+ * Times a benchmark and records its results
+ *
+ * b = Pointer to bench struct
+ * name = Name of the benchmark
+ * unit = What work counts, for the rate
+ * work = Units of work per operation
+ * flops = Floating point operations per operation, 0 if not meaningful
+ * func = Benchmark body
+ * arg = Argument for the body
+ */
+static void bench_run(bench_t *b, char *name, char *unit, double work, double flops, bench_f func, void *arg)
+{
+	bench_result_t *r;
+	double *times, t;
+	long long start;
+	int i, iters;
+	
+	if (b->filter && !strstr(name, b->filter)) return;
+	if (b->count == BENCH_MAX) return;
+	
+	// Find out how many operations make up a long enough repetition
+	start = timer_now();
+	func(arg, 1);
+	t = (timer_now() - start) * 1e-9;
+	iters = t < BENCH_MIN_TIME ? (int) (BENCH_MIN_TIME / (t > 1e-9 ? t : 1e-9)) + 1 : 1;
+	
+	for (i = 0; i < b->warmup; i++)
+		func(arg, iters);
+	
+	times = (double *) mem_alloc(sizeof(double) * b->reps);
+	for (i = 0; i < b->reps; i++) {
+		start = timer_now();
+		func(arg, iters);
+		times[i] = (timer_now() - start) * 1e-9 / iters;
+	}
+	qsort(times, b->reps, sizeof(double), bench_cmp);
+	
+	r = &b->results[b->count++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->unit = unit;
+	r->reps = b->reps;
+	r->iters = iters;
+	r->min = times[0];
+	r->p10 = times[(b->reps - 1) / 10];
+	r->median = times[(b->reps - 1) / 2];
+	r->p90 = times[(b->reps - 1) * 9 / 10];
+	r->max = times[b->reps - 1];
+	r->rate = work / r->median;
+	r->gflops = flops / r->median * 1e-9;
+	mem_free(times);
+	
+	printf("%-36s %10.3f %10.3f %10.3f %14.1f %-10s", r->name, r->median * 1e3, r->p10 * 1e3, r->p90 * 1e3,
+		r->rate, r->unit);
+	if (flops > 0) printf(" %8.2f\n", r->gflops);
+	else printf(" %8s\n", "-");
+	fflush(stdout);
+}
+
+/*
+ * Matrix product benchmark
+ */
+static void bench_mat_mul(void *arg, int iters)
+{
+	bench_mat_t *m = (bench_mat_t *) arg;
+	
+	while (iters--)
+		m->mul(m->a, m->b, m->c);
+}
+
+/*
+ * Single layer benchmark
+ */
+static void bench_layer_execute(void *arg, int iters)
+{
+	bench_net_t *n = (bench_net_t *) arg;
+	
+	while (iters--)
+		layer_execute(n->layer, n->in);
+}
+
+/*
+ * Whole network benchmark
+ */
+static void bench_net_execute(void *arg, int iters)
+{
+	bench_net_t *n = (bench_net_t *) arg;
+	
+	while (iters--)
+		net_execute_batch(n->net, n->in);
+}
+
+/*
+ * Training benchmark, one mini-batch per operation
+ */
+static void bench_train_step(void *arg, int iters)
+{
+	bench_net_t *n = (bench_net_t *) arg;
+	
+	while (iters--)
+		train_step_block(n->trainer, n->in, n->out, 0.01);
+}
+
+/*
+ * Evaluation benchmark, the whole set per operation
+ */
+static void bench_train_correct(void *arg, int iters)
+{
+	bench_net_t *n = (bench_net_t *) arg;
+	
+	while (iters--)
+		train_correct(n->net, n->set);
+}
+
+/*
+ * Threaded evaluation benchmark, every metric over the whole set per operation
+ */
+static void bench_eval(void *arg, int iters)
+{
+	bench_net_t *n = (bench_net_t *) arg;
+	
+	while (iters--)
+		eval_run(n->eval, n->set);
+}
+
+/*
+ * Compares int8 inference against fp32 on zero-centred inputs, where the
+ * zero point of every sample lands in the middle of the quantized range
+ *
+ * Returns 0 if the outputs agree, -1 if not
+ */
+static int bench_quant_check()
+{
+	network_t *net;
+	matrix_t *in, *res, *ref;
+	float err, max, *r, *d;
+	int x, y;
+	
+	net = net_new(BENCH_CHECK_ISIZE);
+	net_add_layer(net, BENCH_CHECK_OSIZE, ACTIVE_LINEAR, &dist_he_init);
+	
+	in = matrix_new(BENCH_CHECK_SAMPLES, BENCH_CHECK_ISIZE);
+	for (y = 0; y < in->height; y++)
+		dist_gauss_fill(dist_rng(), in->data + y * in->stride, in->width, 1.0F);
+	
+	// Keep the fp32 outputs, the network reuses its result buffer
+	res = net_execute_batch(net, in);
+	ref = matrix_new(res->width, res->height);
+	for (y = 0; y < res->height; y++)
+		memcpy(ref->data + y * ref->stride, res->data + y * res->stride, sizeof(float) * res->width);
+	
+	net_quantize(net);
+	res = net_execute_batch(net, in);
+	
+	err = 0;
+	max = 0;
+	for (y = 0; y < ref->height; y++) {
+		r = res->data + y * res->stride;
+		d = ref->data + y * ref->stride;
+		for (x = 0; x < ref->width; x++) {
+			err = fabsf(r[x] - d[x]) > err ? fabsf(r[x] - d[x]) : err;
+			max = fabsf(d[x]) > max ? fabsf(d[x]) : max;
+		}
+	}
+	
+	printf("int8 vs fp32 on zero-centred inputs: max error %f, largest output %f\n", err, max);
+	
+	matrix_free(in);
+	matrix_free(ref);
+	net_free(net);
+	
+	return err > BENCH_CHECK_TOL * max ? -1 : 0;
+}
+
+/*
+ * Points stdout at /dev/null and back, so the loader's progress messages
+ * don't end up in the results table
+ *
+ * quiet = Nonzero to silence stdout, zero to restore it
+ */
+static void bench_quiet(int quiet)
+{
+	static int saved = -1;
+	int fd;
+	
+	fflush(stdout);
+	if (quiet && saved < 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd < 0) return;
+		saved = dup(STDOUT_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	} else if (!quiet && saved >= 0) {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+		saved = -1;
+	}
+}
+
+/*
+ * Loading benchmark, the whole file per operation
+ */
+static void bench_csv_load(void *arg, int iters)
+{
+	bench_net_t *n = (bench_net_t *) arg;
+	batch_t *set;
+	
+	bench_quiet(1);
+	while (iters--) {
+		set = csv_load(n->path, 256, 1, BENCH_ISIZE, BENCH_OSIZE, CSV_U8);
+		if (set) csv_batch_free_all(set);
+	}
+	bench_quiet(0);
+}
+
+/*
+ * Writes out a synthetic MNIST style csv file
+ * About a fifth of the pixels are lit, like the real thing
+ *
+ * path = Path of the file to create
+ * rows = Number of rows
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int bench_write_csv(char *path, int rows)
+{
+	FILE *f;
+	unsigned long long x;
+	int i, j;
+	
+	f = fopen(path, "w");
+	if (!f) return -1;
+	
+	x = 0x9E3779B97F4A7C15ULL;
+	for (i = 0; i < rows; i++) {
+		fprintf(f, "%d", i % BENCH_OSIZE);
+		for (j = 0; j < BENCH_ISIZE; j++) {
+			x ^= x >> 12;
+			x ^= x << 25;
+			x ^= x >> 27;
+			fprintf(f, ",%d", (x >> 40) % 5 ? 0 : (int) ((x >> 32) & 0xFF));
+		}
+		fputc('\n', f);
+	}
+	
+	return fclose(f) ? -1 : 0;
+}
+
+/*
+ * Adds a matrix product benchmark of an m x k by k x n product
+ *
+ * b = Pointer to bench struct
+ * name = Name of the benchmark
+ * mul = Product routine
+ * ta = A is given transposed (k x m)
+ * tb = B is given transposed (n x k)
+ * m, n, k = Shape of the product
+ */
+static void bench_mat(bench_t *b, char *name, void (*mul)(matrix_t *a, matrix_t *b, matrix_t *c), int ta, int tb, int m, int n, int k)
+{
+	bench_mat_t arg;
+	char full[64];
+	int i;
+	
+	arg.mul = mul;
+	arg.a = ta ? matrix_new(m, k) : matrix_new(k, m);
+	arg.b = tb ? matrix_new(k, n) : matrix_new(n, k);
+	arg.c = matrix_new(n, m);
+	for (i = 0; i < arg.a->height; i++)
+		dist_he_init(arg.a->data + i * arg.a->stride, arg.a->width, k);
+	for (i = 0; i < arg.b->height; i++)
+		dist_he_init(arg.b->data + i * arg.b->stride, arg.b->width, k);
+	
+	snprintf(full, sizeof(full), "%s %dx%dx%d", name, m, n, k);
+	bench_run(b, full, "products", 1, 2.0 * m * n * k, bench_mat_mul, &arg);
+	
+	matrix_free(arg.a);
+	matrix_free(arg.b);
+	matrix_free(arg.c);
+}
+
+/*
+ * Writes the results out as JSON
+ *
+ * b = Pointer to bench struct
+ * path = Path of the file to create
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int bench_json(bench_t *b, char *path)
+{
+	FILE *f;
+	bench_result_t *r;
+	int i;
+	
+	f = fopen(path, "w");
+	if (!f) {
+		printf("Failed to create file %s!\n", path);
+		return -1;
+	}
+	
+	fprintf(f, "{\n");
+	fprintf(f, "  \"kernels\": {\"gemm\": \"%s\", \"quant\": \"%s\", \"half\": \"%s\"},\n", gemm_name(), quant_name(), half_name());
+	fprintf(f, "  \"threads\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(f, "  \"results\": [\n");
+	for (i = 0; i < b->count; i++) {
+		r = &b->results[i];
+		fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"reps\": %d, \"iters\": %d, "
+			"\"min_s\": %.9g, \"p10_s\": %.9g, \"median_s\": %.9g, \"p90_s\": %.9g, \"max_s\": %.9g, "
+			"\"rate\": %.6g, \"gflops\": %.6g}%s\n",
+			r->name, r->unit, r->reps, r->iters, r->min, r->p10, r->median, r->p90, r->max,
+			r->rate, r->gflops, i + 1 < b->count ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	
+	return fclose(f) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	bench_t b;
+	bench_net_t n;
+	network_t *net;
+	optim_t opt;
+	struct stat st;
+	char path[] = "/tmp/punyml_bench_XXXXXX";
+	char *json;
+	double params, fwd;
+	int i, fd, threads;
+	
+	memset(&b, 0, sizeof(b));
+	b.warmup = BENCH_WARMUP;
+	b.reps = BENCH_REPS;
+	json = NULL;
+	
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			json = argv[++i];
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			b.reps = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+			b.warmup = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+			b.filter = argv[++i];
+		} else {
+			printf("Usage: %s [-j results.json] [-r reps] [-w warmup] [-f filter]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (b.reps < 1) b.reps = 1;
+	if (b.warmup < 0) b.warmup = 0;
+	
+	dist_init();
+	gemm_init();
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	printf("Using %s matrix kernels, %d threads, %d reps\n\n", gemm_name(), threads, b.reps);
+	printf("%-36s %10s %10s %10s %14s %-10s %8s\n", "benchmark", "median ms", "p10 ms", "p90 ms", "rate", "unit", "GFLOP/s");
+	
+	// Products at the shapes the example network trains and evaluates with
+	bench_mat(&b, "matrix_mul", matrix_mul, 0, 0, BENCH_HIDDEN, 10, BENCH_ISIZE);
+	bench_mat(&b, "matrix_mul", matrix_mul, 0, 0, BENCH_HIDDEN, 256, BENCH_ISIZE);
+	bench_mat(&b, "matrix_mul", matrix_mul, 0, 0, BENCH_OSIZE, 256, BENCH_HIDDEN);
+	bench_mat(&b, "matrix_mul_tn", matrix_mul_tn, 1, 0, BENCH_ISIZE, 10, BENCH_HIDDEN);
+	bench_mat(&b, "matrix_mul_nt", matrix_mul_nt, 0, 1, BENCH_HIDDEN, BENCH_ISIZE, 10);
+	bench_mat(&b, "matrix_mul", matrix_mul, 0, 0, 512, 512, 512);
+	
+	// Dataset, which doubles as the csv loading benchmark
+	fd = mkstemp(path);
+	if (fd < 0 || bench_write_csv(path, BENCH_ROWS) || stat(path, &st)) {
+		printf("Failed to write benchmark data!\n");
+		return 1;
+	}
+	close(fd);
+	
+	n.path = path;
+	bench_quiet(1);
+	n.set = csv_load(path, 256, 1, BENCH_ISIZE, BENCH_OSIZE, CSV_U8);
+	bench_quiet(0);
+	if (!n.set) return 1;
+	
+	net = net_new(BENCH_ISIZE);
+	net_add_layer(net, BENCH_HIDDEN, ACTIVE_RELU, &dist_he_init);
+	net_add_layer(net, BENCH_OSIZE, ACTIVE_SOFTMAX, &dist_he_init);
+	n.net = net;
+	n.layer = net->layer_head;
+	params = (double) BENCH_ISIZE * BENCH_HIDDEN + (double) BENCH_HIDDEN * BENCH_OSIZE;
+	fwd = 2 * params;
+	
+	// Single layer and whole network, one sample and a full evaluation block
+	n.in = matrix_new(1, BENCH_ISIZE);
+	n.out = matrix_new(1, BENCH_OSIZE);
+	csv_gather(n.set, 0, n.in->width, n.in, n.out);
+	bench_run(&b, "layer_execute 784->30 x1", "samples", 1, 2.0 * BENCH_ISIZE * BENCH_HIDDEN, bench_layer_execute, &n);
+	bench_run(&b, "net_execute x1", "samples", 1, fwd, bench_net_execute, &n);
+	matrix_free(n.in);
+	matrix_free(n.out);
+	
+	n.in = matrix_new(256, BENCH_ISIZE);
+	n.out = matrix_new(256, BENCH_OSIZE);
+	csv_gather(n.set, 0, n.in->width, n.in, n.out);
+	bench_run(&b, "layer_execute 784->30 x256", "samples", 256, 256 * 2.0 * BENCH_ISIZE * BENCH_HIDDEN, bench_layer_execute, &n);
+	bench_run(&b, "net_execute x256", "samples", 256, 256 * fwd, bench_net_execute, &n);
+	matrix_free(n.in);
+	matrix_free(n.out);
+	
+	// Training the way main does, forward and backward are about three forwards
+	n.in = matrix_new(10, BENCH_ISIZE);
+	n.out = matrix_new(10, BENCH_OSIZE);
+	csv_gather(n.set, 0, n.in->width, n.in, n.out);
+	n.trainer = train_new(net, 10, threads);
+	bench_run(&b, "train_step batch=10", "samples", 10, 10 * 3 * fwd, bench_train_step, &n);
+	
+	// Adam reads and writes two more copies of the weights every step
+	optim_default(&opt, OPTIM_ADAM);
+	train_optim(n.trainer, &opt);
+	bench_run(&b, "train_step adam batch=10", "samples", 10, 10 * 3 * fwd, bench_train_step, &n);
+	train_free(n.trainer);
+	matrix_free(n.in);
+	matrix_free(n.out);
+	
+	bench_run(&b, "train_correct", "samples", n.set->count, n.set->count * fwd, bench_train_correct, &n);
+	n.eval = eval_new(net, threads, EVAL_ALL, 3);
+	bench_run(&b, "eval all metrics", "samples", n.set->count, n.set->count * fwd, bench_eval, &n);
+	eval_free(n.eval);
+	bench_run(&b, "csv_load", "MB", st.st_size / 1e6, 0, bench_csv_load, &n);
+	
+	// Reduced precision inference last, the network can't be trained after
+	n.in = matrix_new(1, BENCH_ISIZE);
+	n.out = matrix_new(1, BENCH_OSIZE);
+	csv_gather(n.set, 0, n.in->width, n.in, n.out);
+	net_half(net, HALF_F16);
+	bench_run(&b, "net_execute f16 x1", "samples", 1, fwd, bench_net_execute, &n);
+	bench_run(&b, "train_correct f16", "samples", n.set->count, n.set->count * fwd, bench_train_correct, &n);
+	net_half(net, HALF_BF16);
+	bench_run(&b, "net_execute bf16 x1", "samples", 1, fwd, bench_net_execute, &n);
+	net_quantize(net);
+	bench_run(&b, "net_execute int8 x1", "samples", 1, fwd, bench_net_execute, &n);
+	bench_run(&b, "train_correct int8", "samples", n.set->count, n.set->count * fwd, bench_train_correct, &n);
+	matrix_free(n.in);
+	matrix_free(n.out);
+	
+	net_free(net);
+	csv_batch_free_all(n.set);
+	unlink(path);
+	
+	// Results are only worth comparing if the reduced precision is right
+	printf("\n");
+	if (bench_quant_check()) {
+		printf("Quantized outputs don't match fp32!\n");
+		return 1;
+	}
+	
+	if (json && !bench_json(&b, json))
+		printf("\nWrote results to %s\n", json);
+	
+	return 0;
+}
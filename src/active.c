@@ -6,6 +6,79 @@
 
 #include "inc/active.h"
 
+#include <math.h>
+#include <stddef.h>
+
+/* Defines */
+// Array kernels are compiled for every supported vector width,
+// the loader picks the widest one the CPU can run
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ACTIVE_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define ACTIVE_CLONES
+#endif
+
+/*
+ * Branch free exp approximation which the compiler can vectorize,
+ * relative error is within a couple ulp over the clamped range
+ *
+ * x = Function input
+ *
+ * Returns e^x
+ */
+static inline float active_exp(float x)
+{
+	union { float f; int i; } s;
+	float n, r, p;
+	
+	// Keep the result inside the normal float range
+	x = (x < -87.0F ? -87.0F : x);
+	x = (x > 88.0F ? 88.0F : x);
+	
+	// Split into x = n * ln2 + r, rounding n with the magic number trick
+	n = (x * 1.44269504F + 12582912.0F) - 12582912.0F;
+	r = x - n * 0.693359375F;
+	r = r + n * 2.12194440e-4F;
+	
+	// Polynomial for e^r over [-ln2 / 2, ln2 / 2]
+	p = 1.9875691500e-4F;
+	p = p * r + 1.3981999507e-3F;
+	p = p * r + 8.3334519073e-3F;
+	p = p * r + 4.1665795894e-2F;
+	p = p * r + 1.6666665459e-1F;
+	p = p * r + 5.0000001201e-1F;
+	p = p * r * r + r + 1.0F;
+	
+	// Scale by 2^n
+	s.i = ((int) n + 127) << 23;
+	
+	return p * s.f;
+}
+
+/*
+ * Linear activation function
+ *
+ * in = Function input
+ *
+ * Returns the input
+ */
+float active_linear(float in)
+{
+	return in;
+}
+
+/*
+ * Linear derivative function
+ *
+ * in = Function input
+ *
+ * Returns linear derivative
+ */
+float active_linear_der(float in)
+{
+	return 1;
+}
+
 /*
  * ReLU activation function
  *
@@ -28,4 +101,260 @@ float active_relu(float in)
 float active_relu_der(float in)
 {
 	return (in > 0 ? 1 : 0);
-}
\ No newline at end of file
+}
+
+/*
+ * Leaky ReLU activation function
+ *
+ * in = Function input
+ *
+ * Returns leaky ReLU output
+ */
+float active_lrelu(float in)
+{
+	return (in > 0 ? in : in * ACTIVE_LRELU_SLOPE);
+}
+
+/*
+ * Leaky ReLU derivative function
+ *
+ * in = Function input
+ *
+ * Returns leaky ReLU derivative
+ */
+float active_lrelu_der(float in)
+{
+	return (in > 0 ? 1 : ACTIVE_LRELU_SLOPE);
+}
+
+/*
+ * Sigmoid activation function
+ *
+ * in = Function input
+ *
+ * Returns sigmoid output
+ */
+float active_sigmoid(float in)
+{
+	return 1 / (1 + expf(-in));
+}
+
+/*
+ * Sigmoid derivative function
+ *
+ * in = Function input
+ *
+ * Returns sigmoid derivative
+ */
+float active_sigmoid_der(float in)
+{
+	float s = active_sigmoid(in);
+	
+	return s * (1 - s);
+}
+
+/*
+ * Tanh activation function
+ *
+ * in = Function input
+ *
+ * Returns tanh output
+ */
+float active_tanh(float in)
+{
+	return tanhf(in);
+}
+
+/*
+ * Tanh derivative function
+ *
+ * in = Function input
+ *
+ * Returns tanh derivative
+ */
+float active_tanh_der(float in)
+{
+	float t = tanhf(in);
+	
+	return 1 - t * t;
+}
+
+/*
+ * Array kernels
+ *
+ * Forward kernels compute out[i] = f(in[i]), in and out may be the same
+ * Derivative kernels compute delta[i] *= f'(z[i])
+ */
+ACTIVE_CLONES
+static void active_linear_v(float *in, float *out, int n)
+{
+	int i;
+	
+	if (in == out) return;
+	
+	for (i = 0; i < n; i++)
+		out[i] = in[i];
+}
+
+static void active_linear_der_v(float *z, float *delta, int n)
+{
+	// Derivative is one, delta passes through untouched
+}
+
+ACTIVE_CLONES
+static void active_relu_v(float *in, float *out, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		out[i] = (in[i] > 0 ? in[i] : 0);
+}
+
+ACTIVE_CLONES
+static void active_relu_der_v(float *z, float *delta, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		delta[i] *= (z[i] > 0 ? 1.0F : 0.0F);
+}
+
+ACTIVE_CLONES
+static void active_lrelu_v(float *in, float *out, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		out[i] = in[i] * (in[i] > 0 ? 1.0F : ACTIVE_LRELU_SLOPE);
+}
+
+ACTIVE_CLONES
+static void active_lrelu_der_v(float *z, float *delta, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		delta[i] *= (z[i] > 0 ? 1.0F : ACTIVE_LRELU_SLOPE);
+}
+
+ACTIVE_CLONES
+static void active_sigmoid_v(float *in, float *out, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		out[i] = 1 / (1 + active_exp(-in[i]));
+}
+
+ACTIVE_CLONES
+static void active_sigmoid_der_v(float *z, float *delta, int n)
+{
+	int i;
+	float s;
+	
+	for (i = 0; i < n; i++) {
+		s = 1 / (1 + active_exp(-z[i]));
+		delta[i] *= s * (1 - s);
+	}
+}
+
+ACTIVE_CLONES
+static void active_tanh_v(float *in, float *out, int n)
+{
+	int i;
+	
+	// tanh(x) = 1 - 2 / (e^2x + 1)
+	for (i = 0; i < n; i++)
+		out[i] = 1 - 2 / (active_exp(2 * in[i]) + 1);
+}
+
+ACTIVE_CLONES
+static void active_tanh_der_v(float *z, float *delta, int n)
+{
+	int i;
+	float t;
+	
+	for (i = 0; i < n; i++) {
+		t = 1 - 2 / (active_exp(2 * z[i]) + 1);
+		delta[i] *= 1 - t * t;
+	}
+}
+
+/*
+ * Softmax over the rows of every column of a block, in place
+ * Columns are samples, so each pass runs down the rows with the samples
+ * side by side, which is the direction that vectorizes. The largest value
+ * of each sample is taken out before exp, so nothing overflows
+ *
+ * x = Block of values (rows x n)
+ * ld = Distance between rows, in floats
+ * rows = Number of rows (outputs)
+ * n = Number of columns (samples)
+ */
+ACTIVE_CLONES
+void active_softmax(float *x, int ld, int rows, int n)
+{
+	float max[ACTIVE_BLOCK], sum[ACTIVE_BLOCK], *r;
+	int i, j, k, w;
+	
+	for (k = 0; k < n; k += ACTIVE_BLOCK) {
+		w = n - k < ACTIVE_BLOCK ? n - k : ACTIVE_BLOCK;
+		
+		// Largest value of each sample
+		for (j = 0; j < w; j++) {
+			max[j] = x[k + j];
+			sum[j] = 0;
+		}
+		for (i = 1; i < rows; i++) {
+			r = x + i * ld + k;
+			for (j = 0; j < w; j++)
+				max[j] = (r[j] > max[j] ? r[j] : max[j]);
+		}
+		
+		// Exponents and their sum
+		for (i = 0; i < rows; i++) {
+			r = x + i * ld + k;
+			for (j = 0; j < w; j++) {
+				r[j] = active_exp(r[j] - max[j]);
+				sum[j] += r[j];
+			}
+		}
+		
+		// Normalize, the sum is at least one
+		for (j = 0; j < w; j++)
+			sum[j] = 1 / sum[j];
+		for (i = 0; i < rows; i++) {
+			r = x + i * ld + k;
+			for (j = 0; j < w; j++)
+				r[j] *= sum[j];
+		}
+	}
+}
+
+// Registry of every activation function, indexed by ID
+static active_t active_table[ACTIVE_COUNT] = {
+	{ ACTIVE_LINEAR, "linear", active_linear, active_linear_der, active_linear_v, active_linear_der_v },
+	{ ACTIVE_RELU, "relu", active_relu, active_relu_der, active_relu_v, active_relu_der_v },
+	{ ACTIVE_LRELU, "lrelu", active_lrelu, active_lrelu_der, active_lrelu_v, active_lrelu_der_v },
+	{ ACTIVE_SIGMOID, "sigmoid", active_sigmoid, active_sigmoid_der, active_sigmoid_v, active_sigmoid_der_v },
+	{ ACTIVE_TANH, "tanh", active_tanh, active_tanh_der, active_tanh_v, active_tanh_der_v },
+	
+	// Softmax needs the whole column, so layers run it after the linear kernel.
+	// With cross-entropy the output delta is already p - y, nothing to multiply
+	{ ACTIVE_SOFTMAX, "softmax", active_linear, active_linear_der, active_linear_v, active_linear_der_v }
+};
+
+/*
+ * Looks up an activation function by ID
+ *
+ * id = Activation function ID (ACTIVE_*)
+ *
+ * Returns registry entry, NULL if the ID is unknown
+ */
+active_t *active_get(int id)
+{
+	if (id < 0 || id >= ACTIVE_COUNT)
+		return NULL;
+	
+	return &active_table[id];
+}
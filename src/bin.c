@@ -0,0 +1,210 @@
+/*
+ * bin.c
+ *
+ * Compact binary dataset files
+ *
+ * Datasets are converted once from csv, after that they are mapped
+ * straight into memory. Float inputs are used in place, so loading
+ * only has to set up the sample structs, and the pages are shared
+ * through the page cache between runs.
+ */
+
+#include "inc/bin.h"
+#include "inc/mem.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Writes a batch out to a binary dataset file
+ * Every sample in the batch must have the same input and output size
+ *
+ * batch = Batch to write
+ * path = Path of the file to create
+ * dtype = Type to store inputs as, BIN_F32 or BIN_U8
+ * max = Maximum integer size the inputs were scaled by (usually 256),
+ *       only used for BIN_U8 when the batch holds float inputs
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int bin_save(batch_t *batch, char *path, int dtype, int max)
+{
+	FILE *f;
+	bin_header_t h;
+	sample_t *s;
+	unsigned char *rec, *u8;
+	float *fp, v;
+	int i, y;
+	
+	if (!batch || !batch->count) {
+		printf("Nothing to write!\n");
+		return -1;
+	}
+	
+	// Fill out the header, sizes come from the first sample
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BIN_MAGIC, 4);
+	h.version = BIN_VERSION;
+	h.isize = batch->samples[0]->input->height;
+	h.osize = batch->samples[0]->output->height;
+	h.count = batch->count;
+	h.dtype = dtype;
+	h.scale = 1.0F;
+	if (dtype == BIN_U8)
+		h.scale = batch->samples[0]->raw ? batch->scale : 1.0F / max;
+	
+	// Records are padded so the outputs of the next one stay aligned
+	h.record = h.osize * sizeof(float) + h.isize * (dtype == BIN_U8 ? 1 : sizeof(float));
+	h.record = (h.record + sizeof(float) - 1) / sizeof(float) * sizeof(float);
+	
+	f = fopen(path, "wb");
+	if (!f) {
+		printf("Failed to create file %s!\n", path);
+		return -1;
+	}
+	
+	fwrite(&h, sizeof(h), 1, f);
+	
+	rec = (unsigned char *) mem_alloc(h.record);
+	for (i = 0; i < batch->count; i++) {
+		s = batch->samples[i];
+		memset(rec, 0, h.record);
+		
+		// Outputs are always floats
+		fp = (float *) rec;
+		for (y = 0; y < h.osize; y++)
+			fp[y] = s->output->data[y * s->output->stride];
+		
+		u8 = rec + h.osize * sizeof(float);
+		fp = (float *) u8;
+		if (s->raw && dtype == BIN_U8) {
+			memcpy(u8, s->raw, h.isize);
+		} else if (s->raw) {
+			for (y = 0; y < h.isize; y++)
+				fp[y] = s->raw[y] * batch->scale;
+		} else if (dtype == BIN_U8) {
+			// Go back to the integer the csv held
+			for (y = 0; y < h.isize; y++) {
+				v = rintf(s->input->data[y * s->input->stride] * max);
+				u8[y] = (v < 0 ? 0 : (v > 255 ? 255 : v));
+			}
+		} else {
+			for (y = 0; y < h.isize; y++)
+				fp[y] = s->input->data[y * s->input->stride];
+		}
+		
+		fwrite(rec, h.record, 1, f);
+	}
+	mem_free(rec);
+	
+	if (fclose(f)) {
+		printf("Failed to write file %s!\n", path);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Checks that a header describes a valid dataset file
+ *
+ * h = Pointer to header
+ * size = Size of the whole file in bytes
+ *
+ * Returns 0 if the file is valid, -1 if not
+ */
+int bin_check(bin_header_t *h, size_t size)
+{
+	size_t need;
+	
+	if (size < sizeof(bin_header_t) || memcmp(h->magic, BIN_MAGIC, 4) || h->version != BIN_VERSION)
+		return -1;
+	
+	if (h->isize <= 0 || h->osize <= 0 || h->count < 0 || (h->dtype != BIN_F32 && h->dtype != BIN_U8))
+		return -1;
+	
+	// Records must hold everything and keep the outputs aligned,
+	// negative sizes would turn into huge ones in the checks below
+	if (h->record <= 0)
+		return -1;
+	need = h->osize * sizeof(float) + h->isize * (h->dtype == BIN_U8 ? 1 : sizeof(float));
+	if (h->record % sizeof(float) || (size_t) h->record < need)
+		return -1;
+	
+	// Divide rather than multiply, so a huge count can't wrap around
+	return ((size_t) h->count > (size - sizeof(bin_header_t)) / h->record) ? -1 : 0;
+}
+
+/*
+ * Maps a binary dataset file into memory
+ * Samples are views into the mapping, nothing is copied,
+ * uint8 inputs stay packed and are normalized when gathered
+ * Free the batch with csv_batch_free_all()
+ *
+ * path = Path of a file written by bin_save()
+ *
+ * Returns batch of samples, NULL on failure
+ */
+batch_t *bin_load(char *path)
+{
+	int fd;
+	struct stat st;
+	bin_header_t *h;
+	unsigned char *map, *rec;
+	batch_t *batch;
+	
+	printf("Mapping file %s\n", path);
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Failed to open file!\n");
+		return NULL;
+	}
+	
+	if (fstat(fd, &st) || st.st_size < sizeof(bin_header_t)) {
+		printf("File too small to be a dataset!\n");
+		close(fd);
+		return NULL;
+	}
+	
+	// The mapping keeps the file around, so the descriptor can go
+	map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Failed to map file!\n");
+		return NULL;
+	}
+	
+	// Sanity check the header before trusting any of it
+	h = (bin_header_t *) map;
+	if (bin_check(h, st.st_size)) {
+		printf("Not a valid dataset file!\n");
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	
+	// Start reading ahead, training will touch every page
+	madvise(map, st.st_size, MADV_WILLNEED);
+	
+	rec = map + sizeof(bin_header_t);
+	if (h->dtype == BIN_U8) {
+		// Packed inputs stay packed, they are normalized when gathered
+		batch = csv_batch_pack(h->count, h->isize, h->osize, rec + h->osize * sizeof(float), h->record,
+			(float *) rec, h->record / sizeof(float), h->scale);
+	} else {
+		// Float inputs are used right where they are
+		batch = csv_batch_view(h->count, h->isize, h->osize, (float *) (rec + h->osize * sizeof(float)), h->record / sizeof(float),
+			(float *) rec, h->record / sizeof(float));
+	}
+	
+	batch->map = map;
+	batch->map_size = st.st_size;
+	
+	printf("Mapped %d records (%s inputs)\n", h->count, h->dtype == BIN_U8 ? "uint8" : "float");
+	return batch;
+}
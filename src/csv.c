@@ -5,137 +5,350 @@
  */
 
 #include "inc/csv.h"
+#include "inc/mem.h"
+#include "inc/pool.h"
+#include "inc/dist.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Defines */
+// Rows copied per pass when gathering samples into a block
+#define CSV_GATHER_BAND 32
+
+// Smallest chunk of a file worth giving its own thread, in bytes
+#define CSV_CHUNK_MIN (256 * 1024)
+
+/* Types and structs */
+// Newline aligned piece of a csv file, parsed by one thread
+typedef struct csv_chunk {
+	char *start;
+	char *end;
+	
+	int records;		// Records in the chunk
+	int first;			// Index of the first record in the chunk
+	
+	int error;			// CSV_ERR_* for the first bad record, 0 if none
+	int bad;			// Index of the bad record
+} csv_chunk_t;
+
+// Everything the parse threads share
+typedef struct csv_job {
+	csv_chunk_t *chunks;	// One per thread
+	
+	float *in;			// Inputs of every sample, back to back
+	unsigned char *raw;	// Or packed inputs of every sample
+	float *out;			// Outputs of every sample, back to back
+	
+	int max;			// Maximum integer size
+	char single;		// Singleton label mode
+	int isize;
+	int osize;
+} csv_job_t;
+
+// Everything needed to describe one view sample, kept together in the slab
+typedef struct csv_slot {
+	sample_t sample;
+	matrix_t input;
+	matrix_t output;
+} csv_slot_t;
+
+/*
+ * Finds the next newline in a run of characters
+ *
+ * p = Start of run
+ * end = End of run
+ *
+ * Returns pointer to the newline, or end if there is none
+ */
+static inline char *csv_eol(char *p, char *end)
+{
+	char *eol;
+	
+	eol = (char *) memchr(p, '\n', end - p);
+	return eol ? eol : end;
+}
+
+/*
+ * Scans an integer cell out of a record
+ * Leading spaces and a sign are allowed, anything else after the
+ * digits (a carriage return, a fraction) is skipped, like atoi()
+ *
+ * pp = Pointer to the cell, moved past the comma at the end of it
+ * eol = End of the record
+ *
+ * Returns value of cell, 0 if it is empty
+ */
+static inline int csv_scan(char **pp, char *eol)
+{
+	char *p;
+	unsigned int d;
+	int v, neg;
+	
+	p = *pp;
+	v = neg = 0;
+	
+	while (p < eol && *p == ' ') p++;
+	if (p < eol && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	
+	// One compare per digit, the subtraction wraps for anything below '0'
+	while (p < eol && (d = (unsigned char) *p - '0') < 10) {
+		v = v * 10 + d;
+		p++;
+	}
+	
+	while (p < eol && *p != ',') p++;
+	*pp = p + 1;
+	
+	return neg ? -v : v;
+}
+
+/*
+ * Counts the records in a chunk of the file, run on every pool thread
+ * Empty lines are not records
+ *
+ * arg = Pointer to csv job struct
+ * id = Thread number, used as the chunk number
+ * count = Number of threads
+ */
+static void csv_job_count(void *arg, int id, int count)
+{
+	csv_chunk_t *c;
+	char *p, *eol;
+	
+	c = &((csv_job_t *) arg)->chunks[id];
+	c->records = 0;
+	
+	for (p = c->start; p < c->end; p = eol + 1) {
+		eol = csv_eol(p, c->end);
+		if (eol > p) c->records++;
+	}
+}
+
+/*
+ * Parses a single record into sample storage
+ *
+ * p = Start of the record
+ * eol = End of the record, the newline or the end of the file
+ * in = Where the inputs go (isize floats), if raw is NULL
+ * raw = Where the inputs go packed (isize bytes), NULL for floats
+ * out = Where the outputs go (osize floats)
+ * max = Maximum integer size (usually 256)
+ * single = Singleton label mode
+ * isize = Input size
+ * osize = Output size
+ *
+ * Returns 0 on success, CSV_ERR_* if the record has the wrong number of columns
+ */
+int csv_parse(char *p, char *eol, float *in, unsigned char *raw, float *out, int max, char single, int isize, int osize)
+{
+	int col, cols, cell, k;
+	float scale;
+	
+	cols = isize + (single ? 1 : osize);
+	scale = 1.0F / max;
+	
+	// Every cell, including an empty one after a trailing comma
+	for (col = 0; p <= eol; col++) {
+		cell = csv_scan(&p, eol);
+		
+		if (col >= cols) return CSV_ERR_MANY;
+		
+		if (single) {
+			if (col) {
+				// Cell in input matrix
+				if (raw)
+					raw[col-1] = (cell < 0 ? 0 : (cell > 255 ? 255 : cell));
+				else
+					in[col-1] = cell * scale;
+			} else {
+				// Cell in output matrix
+				for (k = 0; k < osize; k++)
+					out[k] = (k == cell) ? 1.0 : 0.0;
+			}
+		} else {
+			if (col < osize) {
+				// Cell in output matrix
+				out[col] = cell * scale;
+			} else {
+				// Cell in input matrix
+				if (raw)
+					raw[col-osize] = (cell < 0 ? 0 : (cell > 255 ? 255 : cell));
+				else
+					in[col-osize] = cell * scale;
+			}
+		}
+	}
+	
+	// Line break sanity checking
+	return (col != cols) ? CSV_ERR_FEW : 0;
+}
+
+/*
+ * Parses the records in a chunk of the file straight into the batch storage,
+ * run on every pool thread
+ * Stops at the first bad record, which is noted in the chunk
+ *
+ * arg = Pointer to csv job struct
+ * id = Thread number, used as the chunk number
+ * count = Number of threads
+ */
+static void csv_job_parse(void *arg, int id, int count)
+{
+	csv_job_t *job;
+	csv_chunk_t *c;
+	char *p, *eol;
+	int row;
+	
+	job = (csv_job_t *) arg;
+	c = &job->chunks[id];
+	row = c->first;
+	
+	for (p = c->start; p < c->end; p = eol + 1) {
+		eol = csv_eol(p, c->end);
+		if (eol == p) continue;
+		
+		c->error = csv_parse(p, eol, job->in + (size_t) row * job->isize, job->raw ? job->raw + (size_t) row * job->isize : NULL,
+			job->out + (size_t) row * job->osize, job->max, job->single, job->isize, job->osize);
+		if (c->error) {
+			c->bad = row;
+			return;
+		}
+		
+		row++;
+	}
+}
 
 /*
  * Loads a batch of training data from a csv file into memory
+ * The file is mapped and split into newline aligned chunks, which are
+ * counted and then parsed on every core. Values go straight into one
+ * block of storage that the samples are views of.
  *
  * path = Path a csv file
  * max = Maximum integer size (usually 256)
  * single = Singleton label mode
  * isize = Input size
  * osize = Output side
+ * type = How to store inputs, CSV_F32 or CSV_U8 (cells clamped to 0-255)
  */
-batch_t *csv_load(char *path, int max, char single, int isize, int osize)
+batch_t *csv_load(char *path, int max, char single, int isize, int osize, int type)
 {
-	FILE *f;
+	int fd, i, threads, records;
+	struct stat st;
+	char *map, *p, *end;
+	csv_chunk_t *c;
+	csv_job_t job;
+	pool_t *pool;
 	batch_t *batch;
-	char buf[512], tmp[32], reading;
-	int i, o, k, row, col, len, cell, records;
+	size_t size;
 	
 	printf("Reading from file %s\n", path);
 	
-	f = fopen(path, "rb");
+	fd = open(path, O_RDONLY);
 	
-	if (f) {
+	if (fd >= 0 && !fstat(fd, &st)) {
 		printf("File successfully opened, indexing...\n");
 	} else {
 		printf("Failed to open file!\n");
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	
+	// Map the whole file, chunks are parsed in place
+	size = st.st_size;
+	map = size ? (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Failed to map file!\n");
 		return NULL;
 	}
+	if (size) madvise(map, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+	
+	// Small files aren't worth waking up threads for
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > size / CSV_CHUNK_MIN + 1) threads = size / CSV_CHUNK_MIN + 1;
+	if (threads < 1) threads = 1;
+	
+	pool = pool_new(threads);
+	
+	job.chunks = (csv_chunk_t *) mem_alloc(sizeof(csv_chunk_t) * threads);
+	job.max = max;
+	job.single = single;
+	job.isize = isize;
+	job.osize = osize;
+	
+	// Split the file evenly, then push each split past the next newline
+	p = map;
+	end = map + size;
+	for (i = 0; i < threads; i++) {
+		c = &job.chunks[i];
+		c->start = p;
+		p = (i == threads - 1) ? end : map + size / threads * (i + 1);
+		if (p < c->start) p = c->start;
+		if (p < end) p = csv_eol(p, end);
+		if (p < end) p++;
+		c->end = p;
+		c->error = 0;
+	}
 	
 	// Time to count records
+	pool_run(pool, csv_job_count, &job);
+	
+	// Each chunk starts where the last one ended
 	records = 0;
-	reading = 0;
-	// Read file in blocks for extra speedy
-	// Not sure if this actually helps things outside of V6 UNIX, but whateves
-	while ((len = fread(buf, 1, 512, f))) {
-		// Iterate through read characters
-		for (i = 0; i < len; i++) {
-			if (buf[i] != '\n') {
-				if (!reading) {
-					reading = 1;
-					records++;
-				}
-			} else {
-				// Indicate start of new line
-				reading = 0;
-			}
-		}
+	for (i = 0; i < threads; i++) {
+		job.chunks[i].first = records;
+		records += job.chunks[i].records;
 	}
 	
 	printf("Indexed %d records to read\n", records);
 	
+	// One block of values, outputs for every sample then inputs for every sample
+	size = sizeof(float) * osize * (size_t) records;
+	size += (type == CSV_U8 ? 1 : sizeof(float)) * isize * (size_t) records;
+	size = (size + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+	job.out = (float *) mem_align(MATRIX_ALIGN, size ? size : MATRIX_ALIGN);
+	job.in = job.out + (size_t) osize * records;
+	job.raw = (type == CSV_U8) ? (unsigned char *) job.in : NULL;
+	
 	// Create datastructure
-	batch = (batch_t *) malloc(sizeof(batch_t));
-	batch->samples = (sample_t **) malloc(sizeof(sample_t *) * records);
-	for (i = 0; i < records; i++) {
-		batch->samples[i] = csv_sample_new(isize, osize);
-	}
-	batch->count = records;
+	if (job.raw)
+		batch = csv_batch_pack(records, isize, osize, job.raw, isize, job.out, osize, 1.0F / max);
+	else
+		batch = csv_batch_view(records, isize, osize, job.in, isize, job.out, osize);
+	batch->store = job.out;
 	
 	// Now we actually load in the records
-	rewind(f);
-	o = col = row = 0;
-	while ((len = fread(buf, 1, 512, f))) {
-		// When we have read enough records, break
-		
-		
-		// Iterate through read characters
-		for (i = 0; i < len; i++) {
-			if (row >= records) break;
-			
-			if (buf[i] == ',' || buf[i] == '\n') {
-				// Zero terminate
-				tmp[o] = '\0';
-				
-				// Get value of cell
-				cell = atoi(tmp);
-				if (!o) cell = 0;
-				
-				if (col >= isize + (single ? 1 : osize)) {
-					printf("Too many collumns for record %d!\n", row);
-					return NULL;
-				}
-				
-				batch->samples[row]->serial = row;
-				
-				if (single) {
-					if (col) {
-						// Cell in input matrix
-						batch->samples[row]->input->values[col-1][0] = ((float) cell) / ((float) max);
-					} else {
-						// Cell in output matrix
-						for (k = 0; k < batch->samples[row]->output->height; k++) {
-							batch->samples[row]->output->values[k][0] = (k == cell) ? 1.0 : 0.0;
-						}
-					}
-				} else {
-					if (col < osize) {
-						// Cell in output matrix
-						batch->samples[row]->output->values[col][0] = ((float) cell) / ((float) max);
-					} else {
-						// Cell in input matrix
-						batch->samples[row]->input->values[col-osize][0] = ((float) cell) / ((float) max);
-					}
-				}
-				
-				// Next collumn
-				col++;
-				
-				// Line break sanity checking
-				if (buf[i] == '\n') {
-					if (col != isize + (single ? 1 : osize)) {
-						printf("Not enough collumns for record %d!\n", row);
-						return NULL;
-					}
-					row++;
-					col = 0;
-				}
-				
-				o = 0;
-				
-			} else {
-				if (o < 31) tmp[o++] = buf[i];
-			}
-		}
-	}
+	pool_run(pool, csv_job_parse, &job);
 	
 	// All done
-	fclose(f);
+	pool_free(pool);
+	if (map) munmap(map, st.st_size);
 	
+	// Report the first bad record in the file
+	for (i = 0; i < threads; i++) {
+		c = &job.chunks[i];
+		if (!c->error) continue;
+		
+		if (c->error == CSV_ERR_MANY)
+			printf("Too many collumns for record %d!\n", c->bad);
+		else
+			printf("Not enough collumns for record %d!\n", c->bad);
+		
+		mem_free(job.chunks);
+		csv_batch_free_all(batch);
+		return NULL;
+	}
+	mem_free(job.chunks);
 	
 	printf("Samples successfully read from file\n");
 	return (batch_t *) batch;
@@ -151,19 +364,189 @@ batch_t *csv_load(char *path, int max, char single, int isize, int osize)
 batch_t *csv_subset(batch_t *source, int count)
 {
 	batch_t *new;
-	int i;
 	
 	// Create datastructure
-	new = (batch_t *) malloc(sizeof(batch_t));
-	new->samples = (sample_t **) malloc(sizeof(sample_t *) * count);
+	new = csv_batch_new(count);
 
 	// Select random samples from source
-	for (i = 0; i < count; i++)
-		new->samples[i] = source->samples[rand() % source->count];
+	csv_resample(source, new);
+	
+	return new;
+}
+
+/*
+ * Refills an existing subset with new random samples from the source struct
+ * No memory is allocated, so this can be called every training step
+ *
+ * source = Source batch struct
+ * dest = Subset batch struct, from csv_subset()
+ */
+void csv_resample(batch_t *source, batch_t *dest)
+{
+	int i;
+	
+	dest->scale = source->scale;
+	for (i = 0; i < dest->count; i++)
+		dest->samples[i] = source->samples[dist_below(dist_rng(), source->count)];
+}
+
+/*
+ * Gathers a run of samples from a batch into blocks, one sample per column
+ * The blocks are resized to fit the number of samples
+ *
+ * batch = Source batch struct
+ * start = Index of first sample
+ * count = Number of samples to gather
+ * in = Input block (isize x count), or NULL to skip inputs
+ * out = Output block (osize x count), or NULL to skip outputs
+ */
+void csv_gather(batch_t *batch, int start, int count, matrix_t *in, matrix_t *out)
+{
+	int i, y, y0, h, ss;
+	sample_t **samples;
+	matrix_t *src;
+	float *sp, *dst;
+	unsigned char *rp;
+	
+	samples = batch->samples + start;
+	
+	/*
+	 * Columns are copied in bands of rows, so the part of the block
+	 * being written to stays in cache while every sample is visited
+	 */
+	if (in) {
+		matrix_resize(in, count);
+		for (y0 = 0; y0 < in->height; y0 += CSV_GATHER_BAND) {
+			h = in->height - y0 < CSV_GATHER_BAND ? in->height - y0 : CSV_GATHER_BAND;
+			for (i = 0; i < count; i++) {
+				dst = in->data + y0 * in->stride + i;
+				
+				// Packed inputs are normalized on the way in
+				if (samples[i]->raw) {
+					rp = samples[i]->raw + y0;
+					for (y = 0; y < h; y++)
+						dst[y * in->stride] = rp[y] * batch->scale;
+					continue;
+				}
+				
+				src = samples[i]->input;
+				ss = src->stride;
+				sp = src->data + y0 * ss;
+				for (y = 0; y < h; y++)
+					dst[y * in->stride] = sp[y * ss];
+			}
+		}
+	}
+	
+	// Outputs are small, so just do them column by column
+	if (out) {
+		matrix_resize(out, count);
+		for (i = 0; i < count; i++) {
+			src = samples[i]->output;
+			for (y = 0; y < out->height; y++)
+				out->data[y * out->stride + i] = src->data[y * src->stride];
+		}
+	}
+}
 
-	// Set the count
+/*
+ * Creates a new batch struct with room for a number of sample pointers
+ * The samples themselves are left for the caller to fill in
+ *
+ * count = Number of samples
+ *
+ * Returns newly created batch struct
+ */
+batch_t *csv_batch_new(int count)
+{
+	batch_t *new;
+	
+	new = (batch_t *) mem_alloc(sizeof(batch_t));
+	new->samples = (sample_t **) mem_alloc(sizeof(sample_t *) * (count ? count : 1));
 	new->count = count;
+	new->scale = 1.0F;
+	
+	// Samples own their memory until a loader says otherwise
+	new->slab = NULL;
+	new->store = NULL;
+	new->map = NULL;
+	new->map_size = 0;
+	
+	return new;
+}
+
+/*
+ * Creates a new batch struct whose samples are views into shared storage
+ * Sample i gets inputs at in + i * istride and outputs at out + i * ostride,
+ * the storage itself is left for the caller to note in the batch
+ *
+ * count = Number of samples
+ * isize = Input size
+ * osize = Output size
+ * in = Inputs of first sample
+ * istride = Distance between inputs of each sample, in floats
+ * out = Outputs of first sample
+ * ostride = Distance between outputs of each sample, in floats
+ *
+ * Returns newly created batch struct
+ */
+batch_t *csv_batch_view(int count, int isize, int osize, float *in, size_t istride, float *out, size_t ostride)
+{
+	batch_t *new;
+	csv_slot_t *slots;
+	int i;
+	
+	new = csv_batch_new(count);
+	
+	// Every struct the samples need comes out of one block
+	slots = (csv_slot_t *) mem_alloc(sizeof(csv_slot_t) * (count ? count : 1));
+	new->slab = slots;
+	
+	for (i = 0; i < count; i++) {
+		matrix_view(&slots[i].input, in + istride * i, 1, isize, 1);
+		matrix_view(&slots[i].output, out + ostride * i, 1, osize, 1);
+		
+		slots[i].sample.input = &slots[i].input;
+		slots[i].sample.output = &slots[i].output;
+		slots[i].sample.raw = NULL;
+		slots[i].sample.serial = i;
+		new->samples[i] = &slots[i].sample;
+	}
+	
+	return new;
+}
 
+/*
+ * Creates a new batch struct whose samples have packed uint8 inputs in
+ * shared storage, only the outputs are float views
+ * Sample i gets inputs at in + i * istride and outputs at out + i * ostride,
+ * the storage itself is left for the caller to note in the batch
+ *
+ * count = Number of samples
+ * isize = Input size
+ * osize = Output size
+ * in = Packed inputs of first sample
+ * istride = Distance between inputs of each sample, in bytes
+ * out = Outputs of first sample
+ * ostride = Distance between outputs of each sample, in floats
+ * scale = Multiplier that normalizes the inputs
+ *
+ * Returns newly created batch struct
+ */
+batch_t *csv_batch_pack(int count, int isize, int osize, unsigned char *in, size_t istride, float *out, size_t ostride, float scale)
+{
+	batch_t *new;
+	csv_slot_t *slots;
+	int i;
+	
+	new = csv_batch_view(count, isize, osize, NULL, 0, out, ostride);
+	new->scale = scale;
+	
+	// The input matricies only carry the size
+	slots = (csv_slot_t *) new->slab;
+	for (i = 0; i < count; i++)
+		slots[i].sample.raw = in + istride * i;
+	
 	return new;
 }
 
@@ -180,11 +563,12 @@ sample_t *csv_sample_new(int isize, int osize)
 	sample_t *new;
 	
 	// Allocate memory for struct
-	new = (sample_t *) malloc(sizeof(sample_t));
+	new = (sample_t *) mem_alloc(sizeof(sample_t));
 	
 	// Create submatricies
 	new->input = matrix_new(1, isize);
 	new->output = matrix_new(1, osize);
+	new->raw = NULL;
 	
 	return new;
 }
@@ -200,7 +584,7 @@ void csv_sample_free(sample_t *sample) {
 	matrix_free(sample->output);
 	
 	// Free struct
-	free(sample);
+	mem_free(sample);
 }
 
 
@@ -211,8 +595,8 @@ void csv_sample_free(sample_t *sample) {
  */
 void csv_batch_free(batch_t *batch) {
 	// Free struct
-	free(batch->samples);
-	free(batch);
+	mem_free(batch->samples);
+	mem_free(batch);
 }
 
 /*
@@ -223,9 +607,16 @@ void csv_batch_free(batch_t *batch) {
 void csv_batch_free_all(batch_t *batch) {
 	int i;
 	
-	// Free all samples
-	for (i = 0; i < batch->count; i++)
-		csv_sample_free(batch->samples[i]);
+	if (batch->slab) {
+		// Samples were set up in one block over shared storage
+		mem_free(batch->slab);
+		if (batch->store) mem_free(batch->store);
+		if (batch->map) munmap(batch->map, batch->map_size);
+	} else {
+		// Free all samples
+		for (i = 0; i < batch->count; i++)
+			csv_sample_free(batch->samples[i]);
+	}
 	
 	// Free batch
 	csv_batch_free(batch);
@@ -2,6 +2,10 @@
  * dist.c
  *
  * Statistical distribution generation + random numbers
+ *
+ * Random numbers come from xoshiro256**, with every thread drawing from its
+ * own stream of one seeded sequence, so nothing is shared between threads
+ * and a given seed always produces the same numbers on the same thread.
  */
 
 #include "inc/dist.h"
@@ -10,41 +14,330 @@
 #include <stdlib.h>
 #include <time.h>
 
+/* Defines */
+// Gaussian kernels are compiled for every supported vector width,
+// the loader picks the widest one the CPU can run
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DIST_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define DIST_CLONES
+#endif
+
+/* Globals */
+// Seed every stream comes from
+static unsigned long long dist_seed_val = 0;
+
+// Streams handed out since the last seed, and a count of seeds so threads
+// can tell their stream is out of date
+static int dist_streams = 0;
+static int dist_gen = 1;
+
+// Generator of the current thread, and the seed it came from
+static __thread dist_rng_t dist_tls;
+static __thread int dist_tls_gen = 0;
+
+/*
+ * Seeds the generators from the clock
+ */
 void dist_init()
 {
-	srand(time(NULL));
+	dist_seed(time(NULL));
+}
+
+/*
+ * Seeds the generators
+ * Every thread picks up a new stream the next time it draws a number,
+ * the calling thread gets the first one
+ *
+ * seed = Seed value
+ */
+void dist_seed(unsigned long long seed)
+{
+	dist_seed_val = seed;
+	__atomic_store_n(&dist_streams, 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dist_gen, 1, __ATOMIC_RELEASE);
+	
+	dist_rng();
+}
+
+/*
+ * Rotates a 64 bit value left
+ */
+static inline unsigned long long dist_rotl(unsigned long long x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * Seeds a generator, each stream starts 2^128 numbers after the last so
+ * they never overlap
+ *
+ * r = Generator to seed
+ * seed = Seed value
+ * stream = Stream number
+ */
+void dist_rng_seed(dist_rng_t *r, unsigned long long seed, int stream)
+{
+	static const unsigned long long jump[4] = {
+		0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+	};
+	unsigned long long t[4], z;
+	int i, j, b;
+	
+	// Spread the seed over the whole state with splitmix64
+	for (i = 0; i < 4; i++) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		r->s[i] = z ^ (z >> 31);
+	}
+	
+	// Jump ahead once per stream
+	for (j = 0; j < stream; j++) {
+		t[0] = t[1] = t[2] = t[3] = 0;
+		for (i = 0; i < 4; i++) {
+			for (b = 0; b < 64; b++) {
+				if (jump[i] & (1ULL << b)) {
+					t[0] ^= r->s[0];
+					t[1] ^= r->s[1];
+					t[2] ^= r->s[2];
+					t[3] ^= r->s[3];
+				}
+				dist_next(r);
+			}
+		}
+		r->s[0] = t[0];
+		r->s[1] = t[1];
+		r->s[2] = t[2];
+		r->s[3] = t[3];
+	}
+}
+
+/*
+ * Gets the calling thread's generator, seeding it with the next stream if
+ * it hasn't drawn anything since the last seed
+ *
+ * Returns pointer to generator, only valid on this thread
+ */
+dist_rng_t *dist_rng()
+{
+	int gen;
+	
+	gen = __atomic_load_n(&dist_gen, __ATOMIC_ACQUIRE);
+	if (dist_tls_gen != gen) {
+		dist_rng_seed(&dist_tls, dist_seed_val, __atomic_fetch_add(&dist_streams, 1, __ATOMIC_RELAXED));
+		dist_tls_gen = gen;
+	}
+	
+	return &dist_tls;
+}
+
+/*
+ * Draws the next 64 random bits
+ *
+ * r = Generator
+ *
+ * Returns random value
+ */
+unsigned long long dist_next(dist_rng_t *r)
+{
+	unsigned long long *s, x, t;
+	
+	s = r->s;
+	x = dist_rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 17;
+	
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = dist_rotl(s[3], 45);
+	
+	return x;
+}
+
+/*
+ * Picks an unbiased random number below a bound
+ * Scales 32 random bits by the bound, redrawing the few that would be biased
+ *
+ * r = Generator
+ * n = Bound, at least 1
+ *
+ * Returns random number from 0 to n - 1
+ */
+int dist_below(dist_rng_t *r, int n)
+{
+	unsigned long long m;
+	unsigned int t;
+	
+	m = (dist_next(r) >> 32) * (unsigned int) n;
+	if ((unsigned int) m < (unsigned int) n) {
+		t = -(unsigned int) n % (unsigned int) n;
+		while ((unsigned int) m < t)
+			m = (dist_next(r) >> 32) * (unsigned int) n;
+	}
+	
+	return (int) (m >> 32);
+}
+
+/*
+ * Returns a random float from 0.0 up to but not including 1.0
+ *
+ * r = Generator
+ */
+float dist_uniform(dist_rng_t *r)
+{
+	return (dist_next(r) >> 40) * (1.0F / 16777216.0F);
+}
+
+/*
+ * Branch free natural log approximation which the compiler can vectorize,
+ * good to about an ulp for normal positive inputs
+ *
+ * x = Function input
+ *
+ * Returns ln(x)
+ */
+static inline float dist_log(float x)
+{
+	union { float f; int i; } u;
+	float e, m, z, p;
+	
+	// Split into x = m * 2^e with m in [sqrt(1/2), sqrt(2))
+	u.f = x;
+	e = (float) (((u.i >> 23) & 0xff) - 126);
+	u.i = (u.i & 0x807fffff) | 0x3f000000;
+	m = u.f;
+	e = (m < 0.707106781F ? e - 1 : e);
+	m = (m < 0.707106781F ? m + m - 1 : m - 1);
+	
+	// Polynomial for ln(1 + m)
+	z = m * m;
+	p = 7.0376836292e-2F;
+	p = p * m - 1.1514610310e-1F;
+	p = p * m + 1.1676998740e-1F;
+	p = p * m - 1.2420140846e-1F;
+	p = p * m + 1.4249322787e-1F;
+	p = p * m - 1.6668057665e-1F;
+	p = p * m + 2.0000714765e-1F;
+	p = p * m - 2.4999993993e-1F;
+	p = p * m + 3.3333331174e-1F;
+	p = p * m * z - e * 2.12194440e-4F - 0.5F * z;
+	
+	// Add back e * ln2, split in two for precision
+	return m + p + e * 0.693359375F;
+}
+
+/*
+ * Turns random bits into gaussian pairs with the Box-Muller transform
+ * The angle's quadrant comes from the top bits and the rest stays within
+ * [-pi/4, pi/4], where short polynomials cover sin and cos, so the whole
+ * loop is branch free and vectorizes
+ *
+ * hi = Random bits for the radius
+ * lo = Random bits for the angle
+ * a = First value of every pair
+ * b = Second value of every pair
+ * n = Number of pairs
+ * scale = Standard deviation
+ */
+DIST_CLONES
+static void dist_box_muller(unsigned int *hi, unsigned int *lo, float *a, float *b, int n, float scale)
+{
+	float u, r, x, z, s, c, t;
+	int i, q;
+	
+	for (i = 0; i < n; i++) {
+		// Radius from a uniform in (0, 1], so the log is finite
+		u = ((hi[i] >> 8) + 1) * (1.0F / 16777216.0F);
+		r = sqrtf(-2.0F * dist_log(u)) * scale;
+		
+		// Angle of x + q * pi/2
+		q = lo[i] >> 30;
+		x = (((lo[i] >> 8) & 0x3fffff) * (1.0F / 4194304.0F) - 0.5F) * 1.5707963268F;
+		z = x * x;
+		s = ((-1.9515295891e-4F * z + 8.3321608736e-3F) * z - 1.6666654611e-1F) * z * x + x;
+		c = ((2.443315711809948e-5F * z - 1.388731625493765e-3F) * z + 4.166664568298827e-2F) * z * z - 0.5F * z + 1.0F;
+		
+		// Odd quadrants swap sin and cos, then the signs follow the quadrant
+		t = (q & 1 ? s : c);
+		s = (q & 1 ? c : s);
+		c = t;
+		c = ((q + 1) & 2 ? -c : c);
+		s = (q & 2 ? -s : s);
+		
+		a[i] = r * c;
+		b[i] = r * s;
+	}
+}
+
+/*
+ * Fills an array with gaussian values
+ * Random bits are drawn a block at a time, then turned into gaussians
+ * by the vector kernel
+ *
+ * r = Generator
+ * a = Pointer to array
+ * cnt = Number of values to generate
+ * scale = Standard deviation
+ */
+void dist_gauss_fill(dist_rng_t *r, float *a, int cnt, float scale)
+{
+	unsigned int hi[DIST_BLOCK], lo[DIST_BLOCK];
+	float tmp[2 * DIST_BLOCK];
+	unsigned long long x;
+	int i, n;
+	
+	while (cnt > 0) {
+		n = (cnt + 1) / 2;
+		n = n < DIST_BLOCK ? n : DIST_BLOCK;
+		
+		for (i = 0; i < n; i++) {
+			x = dist_next(r);
+			hi[i] = x >> 32;
+			lo[i] = x;
+		}
+		
+		// A short last block goes through scratch so nothing is written past the end
+		if (2 * n > cnt) {
+			dist_box_muller(hi, lo, tmp, tmp + n, n, scale);
+			for (i = 0; i < cnt; i++)
+				a[i] = tmp[i];
+			return;
+		}
+		
+		dist_box_muller(hi, lo, a, a + n, n, scale);
+		a += 2 * n;
+		cnt -= 2 * n;
+	}
 }
 
 /*
  * Returns a random float ranging from 0.0 to 1.0
+ * Drawn from the calling thread's generator
  */
 float dist_randf()
 {
-	return ((float) rand()) / RAND_MAX;
+	return dist_uniform(dist_rng());
 }
 
 /*
  * Generates a random gaussian pair
- *
- * Method borrowed from numpy
+ * Drawn from the calling thread's generator
  *
  * Return a f_pair_t with generated values
  */
 f_pair_t dist_gauss()
 {
-	double x1, x2, r, f;
+	float v[2];
 	f_pair_t p;
 	
-	do {
-		x1 = 2.0F * dist_randf() - 1.0;
-		x2 = 2.0F * dist_randf() - 1.0;
-		r = (x1 * x1) + (x2 * x2);
-	} while (r >= 1.00 || r == 0.0);
-	
-	f = sqrt(-2.0 * log(r) / r);
+	dist_gauss_fill(dist_rng(), v, 2, 1.0F);
 	
-	p.f1 = f * x1;
-	p.f2 = f * x2;
+	p.f1 = v[0];
+	p.f2 = v[1];
 	
 	return p;
 }
@@ -58,24 +351,5 @@ f_pair_t dist_gauss()
  */
 void dist_he_init(float *a, int cnt, int in)
 {
-	
-	f_pair_t p;
-	int i;
-	float f, s;
-	
-	// Scale value
-	s = sqrt(2.0 / in);
-	
-	for (i = 0; i < cnt; i++) {
-		// Get gaussian value
-		if (i%2 == 0) {
-			p = dist_gauss();
-			f = p.f1;
-		} else {
-			f = p.f2;
-		}
-		
-		// Place in array and increment
-		*a++ = f * s;
-	}
-}
\ No newline at end of file
+	dist_gauss_fill(dist_rng(), a, cnt, sqrt(2.0 / in));
+}
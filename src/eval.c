@@ -0,0 +1,322 @@
+/*
+ * eval.c
+ *
+ * Dataset evaluation
+ *
+ * Every metric is collected from the same forward pass. Blocks of samples
+ * are dealt out to the threads round robin, each thread keeps its own
+ * partial results, and they are summed in thread order at the end so the
+ * results only depend on the number of threads.
+ */
+
+#include "inc/eval.h"
+#include "inc/train.h"
+#include "inc/mem.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Creates a new evaluator for a network
+ * Buffers are sized up front, so evaluation passes never allocate
+ *
+ * net = Neural network struct
+ * threads = Number of threads to split each pass between
+ * metrics = EVAL_* metrics to collect
+ * k = Outputs that count for EVAL_TOPK
+ *
+ * Returns pointer to new evaluator struct
+ */
+eval_t *eval_new(network_t *net, int threads, int metrics, int k)
+{
+	eval_t *new;
+	eval_worker_t *w;
+	int i;
+	
+	if (threads < 1) threads = 1;
+	if (k < 1) k = 1;
+	
+	new = (eval_t *) mem_alloc(sizeof(eval_t));
+	new->net = net;
+	new->threads = threads;
+	new->metrics = metrics;
+	new->k = k;
+	new->cur = NULL;
+	
+	new->confusion = NULL;
+	if (metrics & EVAL_CONFUSION)
+		new->confusion = (long *) mem_alloc(sizeof(long) * net->osize * net->osize);
+	
+	new->workers = (eval_worker_t *) mem_alloc(sizeof(eval_worker_t) * threads);
+	for (i = 0; i < threads; i++) {
+		w = &new->workers[i];
+		w->ctx = net_ctx_new(net, EVAL_BATCH);
+		w->in = matrix_new(EVAL_BATCH, net->isize);
+		w->out = matrix_new(EVAL_BATCH, net->osize);
+		
+		w->confusion = NULL;
+		if (metrics & EVAL_CONFUSION)
+			w->confusion = (long *) mem_alloc(sizeof(long) * net->osize * net->osize);
+	}
+	
+	// A single thread runs passes itself, without a pool
+	new->pool = threads > 1 ? pool_new(threads) : NULL;
+	
+	eval_reset(new);
+	return new;
+}
+
+/*
+ * Clears the results of an evaluator
+ *
+ * e = Pointer to evaluator struct
+ */
+void eval_reset(eval_t *e)
+{
+	e->count = 0;
+	e->cost = 0;
+	e->correct = 0;
+	e->topk = 0;
+	
+	if (e->confusion)
+		memset(e->confusion, 0, sizeof(long) * e->net->osize * e->net->osize);
+}
+
+/*
+ * Collects the metrics of one block of results
+ * Each pass runs down the rows with the samples side by side
+ *
+ * e = Pointer to evaluator struct
+ * w = Worker to add the results to
+ * res = Network output (osize x samples)
+ * out = Desired output (osize x samples)
+ */
+static void eval_block(eval_t *e, eval_worker_t *w, matrix_t *res, matrix_t *out)
+{
+	int pred[EVAL_BATCH], want[EVAL_BATCH], above[EVAL_BATCH];
+	float best[EVAL_BATCH], hot[EVAL_BATCH], top[EVAL_BATCH];
+	float *r, *d;
+	int x, y, n, osize;
+	
+	n = res->width;
+	osize = res->height;
+	
+	if (e->metrics & EVAL_COST) {
+		if (e->net->layer_tail->act->id == ACTIVE_SOFTMAX)
+			w->cost += train_cost_ce(res, out);
+		else
+			w->cost += train_cost(res, out);
+	}
+	
+	if (!(e->metrics & (EVAL_CORRECT | EVAL_TOPK | EVAL_CONFUSION))) return;
+	
+	// Largest output, and which output is hot, of every sample
+	for (x = 0; x < n; x++) {
+		best[x] = res->data[x];
+		pred[x] = 0;
+		top[x] = out->data[x];
+		want[x] = 0;
+	}
+	for (y = 1; y < osize; y++) {
+		r = res->data + y * res->stride;
+		d = out->data + y * out->stride;
+		for (x = 0; x < n; x++) {
+			pred[x] = (r[x] > best[x] ? y : pred[x]);
+			best[x] = (r[x] > best[x] ? r[x] : best[x]);
+			want[x] = (d[x] > top[x] ? y : want[x]);
+			top[x] = (d[x] > top[x] ? d[x] : top[x]);
+		}
+	}
+	
+	// Count the outputs that beat the hot one
+	if (e->metrics & EVAL_TOPK) {
+		for (x = 0; x < n; x++) {
+			hot[x] = res->data[want[x] * res->stride + x];
+			above[x] = 0;
+		}
+		for (y = 0; y < osize; y++) {
+			r = res->data + y * res->stride;
+			for (x = 0; x < n; x++)
+				above[x] += (r[x] > hot[x]);
+		}
+		for (x = 0; x < n; x++)
+			w->topk += (above[x] < e->k);
+	}
+	
+	for (x = 0; x < n; x++) {
+		// The prediction has to land on a hot output
+		if (e->metrics & EVAL_CORRECT)
+			w->correct += (out->data[pred[x] * out->stride + x] > 0.99);
+		
+		if (e->metrics & EVAL_CONFUSION)
+			w->confusion[want[x] * osize + pred[x]]++;
+	}
+}
+
+/*
+ * Evaluation job, each thread runs every count-th block of the batch
+ *
+ * arg = Pointer to evaluator struct
+ * id = Thread number
+ * count = Number of threads
+ */
+static void eval_job(void *arg, int id, int count)
+{
+	eval_t *e;
+	eval_worker_t *w;
+	matrix_t *res;
+	int i, n;
+	
+	e = (eval_t *) arg;
+	w = &e->workers[id];
+	
+	w->cost = 0;
+	w->correct = 0;
+	w->topk = 0;
+	if (w->confusion)
+		memset(w->confusion, 0, sizeof(long) * e->net->osize * e->net->osize);
+	
+	for (i = id * EVAL_BATCH; i < e->cur->count; i += count * EVAL_BATCH) {
+		n = e->cur->count - i < EVAL_BATCH ? e->cur->count - i : EVAL_BATCH;
+		
+		csv_gather(e->cur, i, n, w->in, w->out);
+		res = net_run(w->ctx, w->in);
+		if (!res) return;
+		
+		eval_block(e, w, res, w->out);
+	}
+}
+
+/*
+ * Evaluates a batch, adding to the results so far
+ *
+ * e = Pointer to evaluator struct
+ * batch = Batch of samples
+ */
+void eval_add(eval_t *e, batch_t *batch)
+{
+	eval_worker_t *w;
+	int i, j;
+	
+	if (batch->count <= 0 || !e->net->layer_tail) return;
+	
+	e->cur = batch;
+	if (e->pool)
+		pool_run(e->pool, eval_job, e);
+	else
+		eval_job(e, 0, 1);
+	e->cur = NULL;
+	
+	// Sum in thread order, so the results don't depend on timing
+	for (i = 0; i < e->threads; i++) {
+		w = &e->workers[i];
+		e->cost += w->cost;
+		e->correct += w->correct;
+		e->topk += w->topk;
+		
+		if (e->confusion)
+			for (j = 0; j < e->net->osize * e->net->osize; j++)
+				e->confusion[j] += w->confusion[j];
+	}
+	
+	e->count += batch->count;
+}
+
+/*
+ * Evaluates a batch on its own
+ *
+ * e = Pointer to evaluator struct
+ * batch = Batch of samples
+ */
+void eval_run(eval_t *e, batch_t *batch)
+{
+	eval_reset(e);
+	eval_add(e, batch);
+}
+
+/*
+ * Evaluates every sample of a stream
+ * The stream is rewound first, and is left at the end
+ *
+ * e = Pointer to evaluator struct
+ * s = Stream of samples
+ */
+void eval_stream(eval_t *e, stream_t *s)
+{
+	batch_t *w;
+	
+	eval_reset(e);
+	stream_rewind(s);
+	while ((w = stream_next(s)))
+		eval_add(e, w);
+}
+
+/*
+ * Returns the mean cost of the samples evaluated
+ *
+ * e = Pointer to evaluator struct
+ */
+float eval_cost(eval_t *e)
+{
+	return e->count ? e->cost / e->count : 0;
+}
+
+/*
+ * Prints the collected metrics
+ *
+ * e = Pointer to evaluator struct
+ */
+void eval_print(eval_t *e)
+{
+	int i, j, osize;
+	
+	if (!e->count) return;
+	
+	if (e->metrics & EVAL_COST)
+		printf("Cost: %f\n", eval_cost(e));
+	if (e->metrics & EVAL_CORRECT)
+		printf("Accuracy: %ld/%ld (%.2f%%)\n", e->correct, e->count, 100.0 * e->correct / e->count);
+	if (e->metrics & EVAL_TOPK)
+		printf("Top-%d accuracy: %ld/%ld (%.2f%%)\n", e->k, e->topk, e->count, 100.0 * e->topk / e->count);
+	
+	if (!e->confusion) return;
+	
+	// Desired outputs down the side, predictions across the top
+	osize = e->net->osize;
+	printf("Confusion matrix (rows desired, columns predicted)\n");
+	printf("     ");
+	for (j = 0; j < osize; j++)
+		printf(" %6d", j);
+	printf("\n");
+	for (i = 0; i < osize; i++) {
+		printf("%4d:", i);
+		for (j = 0; j < osize; j++)
+			printf(" %6ld", e->confusion[i * osize + j]);
+		printf("\n");
+	}
+}
+
+/*
+ * Frees an evaluator and all of its buffers
+ * The network is not freed
+ *
+ * e = Pointer to evaluator struct
+ */
+void eval_free(eval_t *e)
+{
+	int i;
+	
+	if (e->pool) pool_free(e->pool);
+	
+	for (i = 0; i < e->threads; i++) {
+		net_ctx_free(e->workers[i].ctx);
+		matrix_free(e->workers[i].in);
+		matrix_free(e->workers[i].out);
+		mem_free(e->workers[i].confusion);
+	}
+	mem_free(e->workers);
+	mem_free(e->confusion);
+	
+	// Free struct
+	mem_free(e);
+}
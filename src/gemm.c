@@ -0,0 +1,804 @@
+/*
+ * gemm.c
+ *
+ * Cache blocked matrix multiply engine
+ *
+ * Operands are split into blocks that fit in cache, which are then packed
+ * into panels and handed off to a register tiled micro-kernel. Each
+ * instruction set gets its own micro-kernel and matrix-vector kernel, the
+ * best one is picked from CPUID the first time the engine is used.
+ */
+
+#include "inc/gemm.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86
+#endif
+
+/* Defines */
+// Block sizes, MC must be a multiple of every MR and NC of every NR
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 512
+
+// Largest register tile of any kernel
+#define GEMM_MR_MAX 12
+#define GEMM_NR_MAX 16
+
+/* Types and structs */
+// Micro-kernel, computes an MR x NR tile of C from packed panels
+typedef void (*gemm_ukr_t)(int kc, float *ap, float *bp, float *c, int ldc, int acc);
+
+// Matrix-vector kernel, computes y = A * x
+typedef void (*gemm_gemv_t)(int m, int k, float *a, int lda, float *x, float *y, int incy);
+
+// Transposed matrix-vector kernel, computes y = A^T * x
+typedef void (*gemm_gemvt_t)(int m, int k, float *a, int lda, float *x, float *y);
+
+// Kernel set for an instruction set
+typedef struct gemm_kern {
+	char *name;
+
+	int mr;				// Rows per register tile
+	int nr;				// Columns per register tile
+
+	gemm_ukr_t ukr;
+	gemm_gemv_t gemv;
+	gemm_gemvt_t gemvt;
+
+	int (*supported)();	// Returns true if the CPU can run the kernels
+} gemm_kern_t;
+
+/* Globals */
+// Packing buffers, one set per thread
+static __thread float gemm_apack[GEMM_MC * GEMM_KC] __attribute__((aligned(64)));
+static __thread float gemm_bpack[GEMM_KC * GEMM_NC] __attribute__((aligned(64)));
+
+// Currently selected kernel set
+static gemm_kern_t *gemm_kern = NULL;
+
+/*
+ * Portable micro-kernel, works on a 4x8 tile
+ *
+ * kc = Depth of panels
+ * ap = Packed panel of A
+ * bp = Packed panel of B
+ * c = Pointer to top left of C tile
+ * ldc = Row stride of C
+ * acc = Add to C instead of overwriting it
+ */
+static void gemm_ukr_c(int kc, float *ap, float *bp, float *c, int ldc, int acc)
+{
+	float t[4][8];
+	int i, j, p;
+	
+	memset(t, 0, sizeof(t));
+	
+	for (p = 0; p < kc; p++) {
+		for (i = 0; i < 4; i++)
+			for (j = 0; j < 8; j++)
+				t[i][j] += ap[i] * bp[j];
+		ap += 4;
+		bp += 8;
+	}
+	
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 8; j++)
+			c[j] = acc ? c[j] + t[i][j] : t[i][j];
+		c += ldc;
+	}
+}
+
+/*
+ * Portable matrix-vector kernel
+ *
+ * m = Rows of A
+ * k = Columns of A
+ * a = Pointer to A
+ * lda = Row stride of A
+ * x = Pointer to x, must be contiguous
+ * y = Pointer to y
+ * incy = Distance between elements of y
+ */
+static void gemm_gemv_c(int m, int k, float *a, int lda, float *x, float *y, int incy)
+{
+	int i, p;
+	float s0, s1, s2, s3;
+	
+	for (i = 0; i < m; i++) {
+		// Split up the sum so the adds do not wait on each other
+		s0 = s1 = s2 = s3 = 0;
+		for (p = 0; p + 4 <= k; p += 4) {
+			s0 += a[p] * x[p];
+			s1 += a[p+1] * x[p+1];
+			s2 += a[p+2] * x[p+2];
+			s3 += a[p+3] * x[p+3];
+		}
+		for (; p < k; p++)
+			s0 += a[p] * x[p];
+		
+		y[i * incy] = (s0 + s1) + (s2 + s3);
+		a += lda;
+	}
+}
+
+/*
+ * Transposed matrix-vector loop, shared by every kernel set
+ * Each row of A is scaled and added onto y, which vectorizes cleanly
+ * for whatever instruction set the caller was built for
+ *
+ * m = Columns of A and length of y
+ * k = Rows of A and length of x
+ * a = Pointer to A
+ * lda = Row stride of A
+ * x = Pointer to x, must be contiguous
+ * y = Pointer to y, must be contiguous
+ */
+static inline __attribute__((always_inline)) void gemm_gemvt_body(int m, int k, float *a, int lda, float *x, float *y)
+{
+	int i, p;
+	float f;
+	
+	for (i = 0; i < m; i++)
+		y[i] = 0;
+	
+	for (p = 0; p < k; p++) {
+		f = x[p];
+		for (i = 0; i < m; i++)
+			y[i] += f * a[i];
+		a += lda;
+	}
+}
+
+/*
+ * Portable transposed matrix-vector kernel
+ */
+static void gemm_gemvt_c(int m, int k, float *a, int lda, float *x, float *y)
+{
+	gemm_gemvt_body(m, k, a, lda, x, y);
+}
+
+/*
+ * Portable kernels run anywhere
+ */
+static int gemm_supported_c()
+{
+	return 1;
+}
+
+#ifdef GEMM_X86
+
+/*
+ * Sums up all of the lanes in an AVX register
+ *
+ * v = Register to sum
+ *
+ * Returns sum of lanes
+ */
+__attribute__((target("avx2,fma")))
+static inline float gemm_hsum_avx2(__m256 v)
+{
+	__m128 s;
+	
+	s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	
+	return _mm_cvtss_f32(s);
+}
+
+/*
+ * AVX2 + FMA micro-kernel, works on a 6x16 tile
+ * 12 accumulators, 2 B loads and a broadcast keep 15 of the 16 registers busy
+ *
+ * kc = Depth of panels
+ * ap = Packed panel of A
+ * bp = Packed panel of B
+ * c = Pointer to top left of C tile
+ * ldc = Row stride of C
+ * acc = Add to C instead of overwriting it
+ */
+__attribute__((target("avx2,fma")))
+static void gemm_ukr_avx2(int kc, float *ap, float *bp, float *c, int ldc, int acc)
+{
+	__m256 c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51;
+	__m256 b0, b1, a;
+	int p;
+	
+	c00 = c01 = c10 = c11 = c20 = c21 = _mm256_setzero_ps();
+	c30 = c31 = c40 = c41 = c50 = c51 = _mm256_setzero_ps();
+	
+	for (p = 0; p < kc; p++) {
+		b0 = _mm256_load_ps(bp);
+		b1 = _mm256_load_ps(bp + 8);
+		
+		a = _mm256_broadcast_ss(ap);
+		c00 = _mm256_fmadd_ps(a, b0, c00);
+		c01 = _mm256_fmadd_ps(a, b1, c01);
+		a = _mm256_broadcast_ss(ap + 1);
+		c10 = _mm256_fmadd_ps(a, b0, c10);
+		c11 = _mm256_fmadd_ps(a, b1, c11);
+		a = _mm256_broadcast_ss(ap + 2);
+		c20 = _mm256_fmadd_ps(a, b0, c20);
+		c21 = _mm256_fmadd_ps(a, b1, c21);
+		a = _mm256_broadcast_ss(ap + 3);
+		c30 = _mm256_fmadd_ps(a, b0, c30);
+		c31 = _mm256_fmadd_ps(a, b1, c31);
+		a = _mm256_broadcast_ss(ap + 4);
+		c40 = _mm256_fmadd_ps(a, b0, c40);
+		c41 = _mm256_fmadd_ps(a, b1, c41);
+		a = _mm256_broadcast_ss(ap + 5);
+		c50 = _mm256_fmadd_ps(a, b0, c50);
+		c51 = _mm256_fmadd_ps(a, b1, c51);
+		
+		ap += 6;
+		bp += 16;
+	}
+	
+	if (acc) {
+		c00 = _mm256_add_ps(c00, _mm256_loadu_ps(c));
+		c01 = _mm256_add_ps(c01, _mm256_loadu_ps(c + 8));
+		c10 = _mm256_add_ps(c10, _mm256_loadu_ps(c + ldc));
+		c11 = _mm256_add_ps(c11, _mm256_loadu_ps(c + ldc + 8));
+		c20 = _mm256_add_ps(c20, _mm256_loadu_ps(c + 2*ldc));
+		c21 = _mm256_add_ps(c21, _mm256_loadu_ps(c + 2*ldc + 8));
+		c30 = _mm256_add_ps(c30, _mm256_loadu_ps(c + 3*ldc));
+		c31 = _mm256_add_ps(c31, _mm256_loadu_ps(c + 3*ldc + 8));
+		c40 = _mm256_add_ps(c40, _mm256_loadu_ps(c + 4*ldc));
+		c41 = _mm256_add_ps(c41, _mm256_loadu_ps(c + 4*ldc + 8));
+		c50 = _mm256_add_ps(c50, _mm256_loadu_ps(c + 5*ldc));
+		c51 = _mm256_add_ps(c51, _mm256_loadu_ps(c + 5*ldc + 8));
+	}
+	
+	_mm256_storeu_ps(c, c00);
+	_mm256_storeu_ps(c + 8, c01);
+	_mm256_storeu_ps(c + ldc, c10);
+	_mm256_storeu_ps(c + ldc + 8, c11);
+	_mm256_storeu_ps(c + 2*ldc, c20);
+	_mm256_storeu_ps(c + 2*ldc + 8, c21);
+	_mm256_storeu_ps(c + 3*ldc, c30);
+	_mm256_storeu_ps(c + 3*ldc + 8, c31);
+	_mm256_storeu_ps(c + 4*ldc, c40);
+	_mm256_storeu_ps(c + 4*ldc + 8, c41);
+	_mm256_storeu_ps(c + 5*ldc, c50);
+	_mm256_storeu_ps(c + 5*ldc + 8, c51);
+}
+
+/*
+ * AVX2 + FMA matrix-vector kernel
+ * Four rows are done at once so every load of x is used four times
+ *
+ * m = Rows of A
+ * k = Columns of A
+ * a = Pointer to A
+ * lda = Row stride of A
+ * x = Pointer to x, must be contiguous
+ * y = Pointer to y
+ * incy = Distance between elements of y
+ */
+__attribute__((target("avx2,fma")))
+static void gemm_gemv_avx2(int m, int k, float *a, int lda, float *x, float *y, int incy)
+{
+	__m256 s0, s1, s2, s3, v;
+	float *a0, *a1, *a2, *a3, t0, t1, t2, t3;
+	int i, p;
+	
+	for (i = 0; i + 4 <= m; i += 4) {
+		a0 = a + i * lda;
+		a1 = a0 + lda;
+		a2 = a1 + lda;
+		a3 = a2 + lda;
+		
+		s0 = s1 = s2 = s3 = _mm256_setzero_ps();
+		for (p = 0; p + 8 <= k; p += 8) {
+			v = _mm256_loadu_ps(x + p);
+			s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + p), v, s0);
+			s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + p), v, s1);
+			s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + p), v, s2);
+			s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + p), v, s3);
+		}
+		
+		t0 = gemm_hsum_avx2(s0);
+		t1 = gemm_hsum_avx2(s1);
+		t2 = gemm_hsum_avx2(s2);
+		t3 = gemm_hsum_avx2(s3);
+		for (; p < k; p++) {
+			t0 += a0[p] * x[p];
+			t1 += a1[p] * x[p];
+			t2 += a2[p] * x[p];
+			t3 += a3[p] * x[p];
+		}
+		
+		y[i * incy] = t0;
+		y[(i+1) * incy] = t1;
+		y[(i+2) * incy] = t2;
+		y[(i+3) * incy] = t3;
+	}
+	
+	// Leftover rows
+	for (; i < m; i++) {
+		a0 = a + i * lda;
+		
+		s0 = _mm256_setzero_ps();
+		for (p = 0; p + 8 <= k; p += 8)
+			s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + p), _mm256_loadu_ps(x + p), s0);
+		
+		t0 = gemm_hsum_avx2(s0);
+		for (; p < k; p++)
+			t0 += a0[p] * x[p];
+		
+		y[i * incy] = t0;
+	}
+}
+
+/*
+ * AVX2 + FMA transposed matrix-vector kernel
+ */
+__attribute__((target("avx2,fma")))
+static void gemm_gemvt_avx2(int m, int k, float *a, int lda, float *x, float *y)
+{
+	gemm_gemvt_body(m, k, a, lda, x, y);
+}
+
+/*
+ * AVX2 kernels need both AVX2 and FMA
+ */
+static int gemm_supported_avx2()
+{
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+/*
+ * AVX-512 micro-kernel, works on a 12x16 tile
+ * B rows are only 16 wide so thin mini-batch products waste as little as possible
+ *
+ * kc = Depth of panels
+ * ap = Packed panel of A
+ * bp = Packed panel of B
+ * c = Pointer to top left of C tile
+ * ldc = Row stride of C
+ * acc = Add to C instead of overwriting it
+ */
+__attribute__((target("avx512f")))
+static void gemm_ukr_avx512(int kc, float *ap, float *bp, float *c, int ldc, int acc)
+{
+	__m512 c0, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11;
+	__m512 b;
+	int p;
+	
+	c0 = c1 = c2 = c3 = c4 = c5 = _mm512_setzero_ps();
+	c6 = c7 = c8 = c9 = c10 = c11 = _mm512_setzero_ps();
+	
+	for (p = 0; p < kc; p++) {
+		b = _mm512_load_ps(bp);
+		
+		c0 = _mm512_fmadd_ps(_mm512_set1_ps(ap[0]), b, c0);
+		c1 = _mm512_fmadd_ps(_mm512_set1_ps(ap[1]), b, c1);
+		c2 = _mm512_fmadd_ps(_mm512_set1_ps(ap[2]), b, c2);
+		c3 = _mm512_fmadd_ps(_mm512_set1_ps(ap[3]), b, c3);
+		c4 = _mm512_fmadd_ps(_mm512_set1_ps(ap[4]), b, c4);
+		c5 = _mm512_fmadd_ps(_mm512_set1_ps(ap[5]), b, c5);
+		c6 = _mm512_fmadd_ps(_mm512_set1_ps(ap[6]), b, c6);
+		c7 = _mm512_fmadd_ps(_mm512_set1_ps(ap[7]), b, c7);
+		c8 = _mm512_fmadd_ps(_mm512_set1_ps(ap[8]), b, c8);
+		c9 = _mm512_fmadd_ps(_mm512_set1_ps(ap[9]), b, c9);
+		c10 = _mm512_fmadd_ps(_mm512_set1_ps(ap[10]), b, c10);
+		c11 = _mm512_fmadd_ps(_mm512_set1_ps(ap[11]), b, c11);
+		
+		ap += 12;
+		bp += 16;
+	}
+	
+	if (acc) {
+		c0 = _mm512_add_ps(c0, _mm512_loadu_ps(c));
+		c1 = _mm512_add_ps(c1, _mm512_loadu_ps(c + ldc));
+		c2 = _mm512_add_ps(c2, _mm512_loadu_ps(c + 2*ldc));
+		c3 = _mm512_add_ps(c3, _mm512_loadu_ps(c + 3*ldc));
+		c4 = _mm512_add_ps(c4, _mm512_loadu_ps(c + 4*ldc));
+		c5 = _mm512_add_ps(c5, _mm512_loadu_ps(c + 5*ldc));
+		c6 = _mm512_add_ps(c6, _mm512_loadu_ps(c + 6*ldc));
+		c7 = _mm512_add_ps(c7, _mm512_loadu_ps(c + 7*ldc));
+		c8 = _mm512_add_ps(c8, _mm512_loadu_ps(c + 8*ldc));
+		c9 = _mm512_add_ps(c9, _mm512_loadu_ps(c + 9*ldc));
+		c10 = _mm512_add_ps(c10, _mm512_loadu_ps(c + 10*ldc));
+		c11 = _mm512_add_ps(c11, _mm512_loadu_ps(c + 11*ldc));
+	}
+	
+	_mm512_storeu_ps(c, c0);
+	_mm512_storeu_ps(c + ldc, c1);
+	_mm512_storeu_ps(c + 2*ldc, c2);
+	_mm512_storeu_ps(c + 3*ldc, c3);
+	_mm512_storeu_ps(c + 4*ldc, c4);
+	_mm512_storeu_ps(c + 5*ldc, c5);
+	_mm512_storeu_ps(c + 6*ldc, c6);
+	_mm512_storeu_ps(c + 7*ldc, c7);
+	_mm512_storeu_ps(c + 8*ldc, c8);
+	_mm512_storeu_ps(c + 9*ldc, c9);
+	_mm512_storeu_ps(c + 10*ldc, c10);
+	_mm512_storeu_ps(c + 11*ldc, c11);
+}
+
+/*
+ * AVX-512 matrix-vector kernel
+ * Four rows are done at once, and the tail is handled with masked loads
+ *
+ * m = Rows of A
+ * k = Columns of A
+ * a = Pointer to A
+ * lda = Row stride of A
+ * x = Pointer to x, must be contiguous
+ * y = Pointer to y
+ * incy = Distance between elements of y
+ */
+__attribute__((target("avx512f")))
+static void gemm_gemv_avx512(int m, int k, float *a, int lda, float *x, float *y, int incy)
+{
+	__m512 s0, s1, s2, s3, v;
+	__mmask16 tail;
+	float *a0, *a1, *a2, *a3;
+	int i, p, r;
+	
+	// Mask for the leftover columns
+	tail = (__mmask16) ((1 << (k % 16)) - 1);
+	
+	for (i = 0; i < m; i += 4) {
+		// Rows past the end just repeat the last one
+		r = m - i;
+		a0 = a + i * lda;
+		a1 = r > 1 ? a0 + lda : a0;
+		a2 = r > 2 ? a0 + 2*lda : a0;
+		a3 = r > 3 ? a0 + 3*lda : a0;
+		
+		s0 = s1 = s2 = s3 = _mm512_setzero_ps();
+		for (p = 0; p + 16 <= k; p += 16) {
+			v = _mm512_loadu_ps(x + p);
+			s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a0 + p), v, s0);
+			s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a1 + p), v, s1);
+			s2 = _mm512_fmadd_ps(_mm512_loadu_ps(a2 + p), v, s2);
+			s3 = _mm512_fmadd_ps(_mm512_loadu_ps(a3 + p), v, s3);
+		}
+		if (tail) {
+			v = _mm512_maskz_loadu_ps(tail, x + p);
+			s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a0 + p), v, s0);
+			s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a1 + p), v, s1);
+			s2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a2 + p), v, s2);
+			s3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a3 + p), v, s3);
+		}
+		
+		y[i * incy] = _mm512_reduce_add_ps(s0);
+		if (r > 1) y[(i+1) * incy] = _mm512_reduce_add_ps(s1);
+		if (r > 2) y[(i+2) * incy] = _mm512_reduce_add_ps(s2);
+		if (r > 3) y[(i+3) * incy] = _mm512_reduce_add_ps(s3);
+	}
+}
+
+/*
+ * AVX-512 transposed matrix-vector kernel
+ */
+__attribute__((target("avx512f")))
+static void gemm_gemvt_avx512(int m, int k, float *a, int lda, float *x, float *y)
+{
+	gemm_gemvt_body(m, k, a, lda, x, y);
+}
+
+/*
+ * AVX-512 kernels only need the foundation instructions
+ */
+static int gemm_supported_avx512()
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+#endif
+
+/*
+ * Kernel sets, in order of preference
+ */
+static gemm_kern_t gemm_kerns[] = {
+#ifdef GEMM_X86
+	{"avx512", 12, 16, gemm_ukr_avx512, gemm_gemv_avx512, gemm_gemvt_avx512, gemm_supported_avx512},
+	{"avx2", 6, 16, gemm_ukr_avx2, gemm_gemv_avx2, gemm_gemvt_avx2, gemm_supported_avx2},
+#endif
+	{"scalar", 4, 8, gemm_ukr_c, gemm_gemv_c, gemm_gemvt_c, gemm_supported_c}
+};
+
+#define GEMM_KERNS (sizeof(gemm_kerns) / sizeof(gemm_kern_t))
+
+/*
+ * Picks the best kernel set that the CPU supports
+ * Called automatically on first use, but can be called at startup instead
+ */
+void gemm_init()
+{
+	int i;
+	
+	for (i = 0; i < GEMM_KERNS; i++) {
+		if (gemm_kerns[i].supported()) {
+			gemm_kern = &gemm_kerns[i];
+			return;
+		}
+	}
+}
+
+/*
+ * Forces a specific kernel set to be used
+ *
+ * name = Name of kernel set ("avx512", "avx2", "scalar")
+ *
+ * Returns 0 on success, -1 if the set does not exist or is not supported
+ */
+int gemm_select(char *name)
+{
+	int i;
+	
+	for (i = 0; i < GEMM_KERNS; i++) {
+		if (!strcmp(gemm_kerns[i].name, name)) {
+			if (!gemm_kerns[i].supported()) return -1;
+			gemm_kern = &gemm_kerns[i];
+			return 0;
+		}
+	}
+	
+	return -1;
+}
+
+/*
+ * Returns the name of the selected kernel set
+ */
+char *gemm_name()
+{
+	if (!gemm_kern) gemm_init();
+	
+	return gemm_kern->name;
+}
+
+/*
+ * Packs a block of A into panels of mr rows
+ * Each panel is stored column by column, rows past the end are zeroed
+ *
+ * ta = A is stored transposed
+ * mc = Rows in block
+ * kc = Columns in block
+ * a = Pointer to top left of block
+ * lda = Row stride of A
+ * mr = Panel height
+ * ap = Packing buffer
+ */
+static void gemm_pack_a(int ta, int mc, int kc, float *a, int lda, int mr, float *ap)
+{
+	int i, p, ir, rows;
+	float *src;
+	
+	for (ir = 0; ir < mc; ir += mr) {
+		rows = mc - ir < mr ? mc - ir : mr;
+		
+		if (ta) {
+			// Panel columns are already contiguous in memory
+			for (p = 0; p < kc; p++) {
+				src = a + p * lda + ir;
+				for (i = 0; i < rows; i++)
+					ap[p * mr + i] = src[i];
+				for (; i < mr; i++)
+					ap[p * mr + i] = 0;
+			}
+		} else {
+			for (i = 0; i < rows; i++) {
+				src = a + (ir + i) * lda;
+				for (p = 0; p < kc; p++)
+					ap[p * mr + i] = src[p];
+			}
+			for (; i < mr; i++)
+				for (p = 0; p < kc; p++)
+					ap[p * mr + i] = 0;
+		}
+		
+		ap += mr * kc;
+	}
+}
+
+/*
+ * Packs a block of B into panels of nr columns
+ * Each panel is stored row by row, columns past the end are zeroed
+ *
+ * tb = B is stored transposed
+ * kc = Rows in block
+ * nc = Columns in block
+ * b = Pointer to top left of block
+ * ldb = Row stride of B
+ * nr = Panel width
+ * bp = Packing buffer
+ */
+static void gemm_pack_b(int tb, int kc, int nc, float *b, int ldb, int nr, float *bp)
+{
+	int j, p, jr, cols;
+	float *src;
+	
+	for (jr = 0; jr < nc; jr += nr) {
+		cols = nc - jr < nr ? nc - jr : nr;
+		
+		if (tb) {
+			// Walk down each stored row, which is a column of the panel
+			for (j = 0; j < cols; j++) {
+				src = b + (jr + j) * ldb;
+				for (p = 0; p < kc; p++)
+					bp[p * nr + j] = src[p];
+			}
+			for (; j < nr; j++)
+				for (p = 0; p < kc; p++)
+					bp[p * nr + j] = 0;
+		} else {
+			for (p = 0; p < kc; p++) {
+				src = b + p * ldb + jr;
+				for (j = 0; j < cols; j++)
+					bp[p * nr + j] = src[j];
+				for (; j < nr; j++)
+					bp[p * nr + j] = 0;
+			}
+		}
+		
+		bp += nr * kc;
+	}
+}
+
+/*
+ * Computes C = op(A) * op(B), where op() optionally transposes
+ * op(A) is m x k, op(B) is k x n, and C is m x n
+ * Transposed operands are read in their stored layout, nothing is copied
+ * C must not overlap with A or B
+ *
+ * ta = A is stored transposed (k x m), one of GEMM_N or GEMM_T
+ * tb = B is stored transposed (n x k), one of GEMM_N or GEMM_T
+ * m = Rows of op(A) and C
+ * n = Columns of op(B) and C
+ * k = Columns of op(A) and rows of op(B)
+ * a = Pointer to A
+ * lda = Row stride of A
+ * b = Pointer to B
+ * ldb = Row stride of B
+ * c = Pointer to C
+ * ldc = Row stride of C
+ */
+void gemm(int ta, int tb, int m, int n, int k, float *a, int lda, float *b, int ldb, float *c, int ldc)
+{
+	gemm_epi(ta, tb, m, n, k, a, lda, b, ldb, c, ldc, NULL);
+}
+
+/*
+ * Runs the epilogue over a finished block of C
+ *
+ * ep = Epilogue to apply
+ * row = Row of C the block starts at
+ * col = Column of C the block starts at
+ * rows = Rows in the block
+ * cols = Columns in the block
+ * c = Pointer to top left of the block
+ * ldc = Row stride of C
+ */
+static void gemm_epilogue(gemm_epi_t *ep, int row, int col, int rows, int cols, float *c, int ldc)
+{
+	int i, j;
+	float *cr, b;
+	
+	for (i = 0; i < rows; i++) {
+		cr = c + i * ldc;
+		
+		if (ep->bias) {
+			b = ep->bias[(row + i) * ep->incb];
+			for (j = 0; j < cols; j++)
+				cr[j] += b;
+		}
+		
+		if (ep->act)
+			ep->act(cr, ep->out + (row + i) * ep->ldo + col, cols);
+	}
+}
+
+/*
+ * Same as gemm, but every element of C also goes through an epilogue
+ * while it is still in cache, right after its sum is complete
+ *
+ * ta, tb, m, n, k, a, lda, b, ldb, c, ldc = Same as gemm
+ * ep = Epilogue to apply, NULL for none
+ */
+void gemm_epi(int ta, int tb, int m, int n, int k, float *a, int lda, float *b, int ldb, float *c, int ldc, gemm_epi_t *ep)
+{
+	int ic, jc, pc, ir, jr, mc, nc, kc, mr, nr, rows, cols, i, j;
+	float tile[GEMM_MR_MAX * GEMM_NR_MAX] __attribute__((aligned(64)));
+	float *cp;
+	gemm_kern_t *kern;
+	
+	if (!gemm_kern) gemm_init();
+	kern = gemm_kern;
+	
+	if (m <= 0 || n <= 0) return;
+	
+	// Nothing to sum up, C is just zero
+	if (k <= 0) {
+		for (i = 0; i < m; i++)
+			memset(c + i * ldc, 0, sizeof(float) * n);
+		if (ep) gemm_epilogue(ep, 0, 0, m, n, c, ldc);
+		return;
+	}
+	
+	// A single column of B transposed is already contiguous
+	if (n == 1 && tb) ldb = 1;
+	
+	// Single column vectors don't need any of the blocking
+	if (n == 1 && (ldb == 1 || k <= GEMM_KC * GEMM_NC) && (!ta || m <= GEMM_MC * GEMM_KC)) {
+		// The vector kernels want x to be contiguous
+		if (ldb != 1) {
+			for (i = 0; i < k; i++)
+				gemm_bpack[i] = b[i * ldb];
+			b = gemm_bpack;
+		}
+		
+		if (!ta) {
+			kern->gemv(m, k, a, lda, b, c, ldc);
+		} else if (ldc == 1) {
+			kern->gemvt(m, k, a, lda, b, c);
+		} else {
+			// Sum into a contiguous buffer, then spread it out into C
+			kern->gemvt(m, k, a, lda, b, gemm_apack);
+			for (i = 0; i < m; i++)
+				c[i * ldc] = gemm_apack[i];
+		}
+		
+		// Contiguous columns get the bias and activation in one go
+		if (ep && ldc == 1 && ep->ldo == 1) {
+			for (i = 0; ep->bias && i < m; i++)
+				c[i] += ep->bias[i * ep->incb];
+			if (ep->act) ep->act(c, ep->out, m);
+		} else if (ep) {
+			gemm_epilogue(ep, 0, 0, m, 1, c, ldc);
+		}
+		return;
+	}
+	
+	mr = kern->mr;
+	nr = kern->nr;
+	
+	for (jc = 0; jc < n; jc += GEMM_NC) {
+		nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+		
+		for (pc = 0; pc < k; pc += GEMM_KC) {
+			kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+			
+			// Pack a block of B, this stays in cache for all of A
+			gemm_pack_b(tb, kc, nc, tb ? b + jc * ldb + pc : b + pc * ldb + jc, ldb, nr, gemm_bpack);
+			
+			for (ic = 0; ic < m; ic += GEMM_MC) {
+				mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+				
+				gemm_pack_a(ta, mc, kc, ta ? a + pc * lda + ic : a + ic * lda + pc, lda, mr, gemm_apack);
+				
+				// Run the micro-kernel over every tile in the block
+				for (jr = 0; jr < nc; jr += nr) {
+					cols = nc - jr < nr ? nc - jr : nr;
+					
+					for (ir = 0; ir < mc; ir += mr) {
+						rows = mc - ir < mr ? mc - ir : mr;
+						cp = c + (ic + ir) * ldc + jc + jr;
+						
+						if (rows == mr && cols == nr) {
+							kern->ukr(kc, gemm_apack + ir * kc, gemm_bpack + jr * kc, cp, ldc, pc > 0);
+						} else {
+							// Edge tiles go through a buffer so we don't write past C
+							kern->ukr(kc, gemm_apack + ir * kc, gemm_bpack + jr * kc, tile, nr, 0);
+							for (i = 0; i < rows; i++)
+								for (j = 0; j < cols; j++)
+									cp[i * ldc + j] = pc ? cp[i * ldc + j] + tile[i * nr + j] : tile[i * nr + j];
+						}
+						
+						// Last block of k, the tile is final and still hot
+						if (ep && pc + kc >= k)
+							gemm_epilogue(ep, ic + ir, jc + jr, rows, cols, cp, ldc);
+					}
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,647 @@
+/*
+ * half.c
+ *
+ * Half width weight storage for dense layers
+ *
+ * Weights and bias are stored as IEEE half or bfloat16, and only widened to
+ * fp32 once they are in registers, so a matrix-vector product streams half
+ * the bytes. Batched products widen a block of rows at a time into a cache
+ * resident buffer and hand it to the regular GEMM engine, whose epilogue
+ * takes care of the bias and activation.
+ */
+
+#include "inc/half.h"
+#include "inc/gemm.h"
+#include "inc/mem.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HALF_X86
+#endif
+
+/* Types and structs */
+// Matrix-vector kernel, computes y = A * x with rows of A stored as type
+// k must be a multiple of HALF_ALIGN, x must be padded with zeros to match
+typedef void (*half_gemv_t)(int type, int m, int k, unsigned short *a, int lda, float *x, float *y);
+
+// Widens n values of type to fp32, n must be a multiple of HALF_ALIGN
+typedef void (*half_widen_t)(int type, unsigned short *src, float *dst, int n);
+
+// Kernel set for an instruction set
+typedef struct half_kern {
+	char *name;
+
+	half_gemv_t gemv;
+	half_widen_t widen;
+
+	int (*supported)();	// Returns true if the CPU can run the kernels
+} half_kern_t;
+
+/* Globals */
+// Widened rows, bias and vectors, one set per thread
+static __thread float *half_buf = NULL;
+static __thread size_t half_size = 0;
+
+// Currently selected kernel set
+static half_kern_t *half_kern = NULL;
+
+/*
+ * Converts an fp32 value to a half width value, rounding to nearest even
+ *
+ * type = HALF_F16 or HALF_BF16
+ * f = Value to convert
+ *
+ * Returns converted value
+ */
+unsigned short half_from_float(int type, float f)
+{
+	union { float f; unsigned int u; } v, magic;
+	unsigned int sign;
+	unsigned short o;
+	
+	v.f = f;
+	
+	if (type == HALF_BF16) {
+		// NaNs must stay NaNs, everything else rounds on the low 16 bits
+		if ((v.u & 0x7FFFFFFF) > 0x7F800000)
+			return (v.u >> 16) | 0x40;
+		return (v.u + 0x7FFF + ((v.u >> 16) & 1)) >> 16;
+	}
+	
+	sign = v.u & 0x80000000;
+	v.u ^= sign;
+	
+	if (v.u >= 0x47800000) {
+		// Too big even for the largest half, or Inf or NaN
+		o = v.u > 0x7F800000 ? 0x7E00 : 0x7C00;
+	} else if (v.u < 0x38800000) {
+		// Subnormal or zero, let the fp32 add do the rounding
+		magic.u = 126 << 23;
+		v.f += magic.f;
+		o = v.u - magic.u;
+	} else {
+		// Rebias the exponent and round the mantissa, carries roll into the exponent
+		v.u += ((unsigned int) (15 - 127) << 23) + 0xFFF + ((v.u >> 13) & 1);
+		o = v.u >> 13;
+	}
+	
+	return o | (sign >> 16);
+}
+
+/*
+ * Converts a half width value to fp32, which is always exact
+ *
+ * type = HALF_F16 or HALF_BF16
+ * h = Value to convert
+ *
+ * Returns converted value
+ */
+float half_to_float(int type, unsigned short h)
+{
+	union { float f; unsigned int u; } v, magic;
+	unsigned int exp;
+	
+	if (type == HALF_BF16) {
+		v.u = (unsigned int) h << 16;
+		return v.f;
+	}
+	
+	v.u = (h & 0x7FFF) << 13;
+	exp = v.u & (0x7C00 << 13);
+	v.u += (127 - 15) << 23;
+	
+	if (exp == 0x7C00 << 13) {
+		// Inf or NaN
+		v.u += (128 - 16) << 23;
+	} else if (!exp) {
+		// Subnormal, renormalize through an fp32 subtract
+		magic.u = 113 << 23;
+		v.u += 1 << 23;
+		v.f -= magic.f;
+	}
+	
+	v.u |= (unsigned int) (h & 0x8000) << 16;
+	return v.f;
+}
+
+/*
+ * Portable matrix-vector kernel
+ *
+ * type = HALF_F16 or HALF_BF16
+ * m = Rows of A and length of y
+ * k = Columns of A and length of x
+ * a = Pointer to A
+ * lda = Row stride of A
+ * x = Pointer to x
+ * y = Pointer to y, must be contiguous
+ */
+static void half_gemv_c(int type, int m, int k, unsigned short *a, int lda, float *x, float *y)
+{
+	int i, p;
+	float s0, s1, s2, s3;
+	
+	for (i = 0; i < m; i++, a += lda) {
+		s0 = s1 = s2 = s3 = 0;
+		for (p = 0; p < k; p += 4) {
+			s0 += half_to_float(type, a[p]) * x[p];
+			s1 += half_to_float(type, a[p+1]) * x[p+1];
+			s2 += half_to_float(type, a[p+2]) * x[p+2];
+			s3 += half_to_float(type, a[p+3]) * x[p+3];
+		}
+		
+		y[i] = (s0 + s1) + (s2 + s3);
+	}
+}
+
+/*
+ * Portable widening kernel
+ *
+ * type = HALF_F16 or HALF_BF16
+ * src = Values to widen
+ * dst = Where to put the fp32 values
+ * n = Number of values
+ */
+static void half_widen_c(int type, unsigned short *src, float *dst, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		dst[i] = half_to_float(type, src[i]);
+}
+
+/*
+ * Portable kernels run anywhere
+ */
+static int half_supported_c()
+{
+	return 1;
+}
+
+#ifdef HALF_X86
+
+/*
+ * Loads 8 half width values and widens them to fp32
+ *
+ * type = HALF_F16 or HALF_BF16
+ * p = Values to load
+ *
+ * Returns widened values
+ */
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 half_load_avx2(int type, unsigned short *p)
+{
+	__m128i v;
+	
+	v = _mm_loadu_si128((__m128i *) p);
+	if (type == HALF_F16) return _mm256_cvtph_ps(v);
+	
+	// bfloat16 is the top half of an fp32
+	return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(v), 16));
+}
+
+/*
+ * Sums up all of the lanes in an AVX register
+ *
+ * v = Register to sum
+ *
+ * Returns sum of lanes
+ */
+__attribute__((target("avx2,fma,f16c")))
+static inline float half_hsum_avx2(__m256 v)
+{
+	__m128 x;
+	
+	x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+	x = _mm_add_ss(x, _mm_movehdup_ps(x));
+	
+	return _mm_cvtss_f32(x);
+}
+
+/*
+ * AVX2 matrix-vector loop, four rows at a time
+ * Inlined with a constant type so each storage type gets its own loop
+ *
+ * type, m, k, a, lda, x, y = Same as half_gemv_c
+ */
+__attribute__((target("avx2,fma,f16c")))
+static inline __attribute__((always_inline)) void half_gemv_avx2_body(int type, int m, int k, unsigned short *a, int lda, float *x, float *y)
+{
+	__m256 s0, s1, s2, s3, v;
+	unsigned short *a0, *a1, *a2, *a3;
+	int i, p;
+	
+	for (i = 0; i + 4 <= m; i += 4) {
+		a0 = a + (size_t) i * lda;
+		a1 = a0 + lda;
+		a2 = a1 + lda;
+		a3 = a2 + lda;
+		
+		s0 = s1 = s2 = s3 = _mm256_setzero_ps();
+		for (p = 0; p < k; p += 8) {
+			v = _mm256_loadu_ps(x + p);
+			s0 = _mm256_fmadd_ps(half_load_avx2(type, a0 + p), v, s0);
+			s1 = _mm256_fmadd_ps(half_load_avx2(type, a1 + p), v, s1);
+			s2 = _mm256_fmadd_ps(half_load_avx2(type, a2 + p), v, s2);
+			s3 = _mm256_fmadd_ps(half_load_avx2(type, a3 + p), v, s3);
+		}
+		
+		y[i] = half_hsum_avx2(s0);
+		y[i+1] = half_hsum_avx2(s1);
+		y[i+2] = half_hsum_avx2(s2);
+		y[i+3] = half_hsum_avx2(s3);
+	}
+	
+	// Leftover rows
+	for (; i < m; i++) {
+		a0 = a + (size_t) i * lda;
+		
+		s0 = _mm256_setzero_ps();
+		for (p = 0; p < k; p += 8)
+			s0 = _mm256_fmadd_ps(half_load_avx2(type, a0 + p), _mm256_loadu_ps(x + p), s0);
+		
+		y[i] = half_hsum_avx2(s0);
+	}
+}
+
+/*
+ * AVX2 + FMA + F16C matrix-vector kernel
+ *
+ * type, m, k, a, lda, x, y = Same as half_gemv_c
+ */
+__attribute__((target("avx2,fma,f16c")))
+static void half_gemv_avx2(int type, int m, int k, unsigned short *a, int lda, float *x, float *y)
+{
+	if (type == HALF_F16)
+		half_gemv_avx2_body(HALF_F16, m, k, a, lda, x, y);
+	else
+		half_gemv_avx2_body(HALF_BF16, m, k, a, lda, x, y);
+}
+
+/*
+ * AVX2 + F16C widening kernel
+ *
+ * type, src, dst, n = Same as half_widen_c
+ */
+__attribute__((target("avx2,fma,f16c")))
+static void half_widen_avx2(int type, unsigned short *src, float *dst, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i += 8)
+		_mm256_storeu_ps(dst + i, half_load_avx2(type, src + i));
+}
+
+/*
+ * AVX2 kernels need AVX2, FMA and F16C
+ */
+static int half_supported_avx2()
+{
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+}
+
+/*
+ * Loads 16 half width values and widens them to fp32
+ *
+ * type = HALF_F16 or HALF_BF16
+ * p = Values to load
+ *
+ * Returns widened values
+ */
+__attribute__((target("avx512f")))
+static inline __m512 half_load_avx512(int type, unsigned short *p)
+{
+	__m256i v;
+	
+	v = _mm256_loadu_si256((__m256i *) p);
+	if (type == HALF_F16) return _mm512_cvtph_ps(v);
+	
+	// bfloat16 is the top half of an fp32
+	return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(v), 16));
+}
+
+/*
+ * AVX-512 matrix-vector loop, four rows at a time
+ * Inlined with a constant type so each storage type gets its own loop
+ *
+ * type, m, k, a, lda, x, y = Same as half_gemv_c
+ */
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void half_gemv_avx512_body(int type, int m, int k, unsigned short *a, int lda, float *x, float *y)
+{
+	__m512 s0, s1, s2, s3, v;
+	unsigned short *a0, *a1, *a2, *a3;
+	int i, p;
+	
+	for (i = 0; i + 4 <= m; i += 4) {
+		a0 = a + (size_t) i * lda;
+		a1 = a0 + lda;
+		a2 = a1 + lda;
+		a3 = a2 + lda;
+		
+		s0 = s1 = s2 = s3 = _mm512_setzero_ps();
+		for (p = 0; p < k; p += 16) {
+			v = _mm512_loadu_ps(x + p);
+			s0 = _mm512_fmadd_ps(half_load_avx512(type, a0 + p), v, s0);
+			s1 = _mm512_fmadd_ps(half_load_avx512(type, a1 + p), v, s1);
+			s2 = _mm512_fmadd_ps(half_load_avx512(type, a2 + p), v, s2);
+			s3 = _mm512_fmadd_ps(half_load_avx512(type, a3 + p), v, s3);
+		}
+		
+		y[i] = _mm512_reduce_add_ps(s0);
+		y[i+1] = _mm512_reduce_add_ps(s1);
+		y[i+2] = _mm512_reduce_add_ps(s2);
+		y[i+3] = _mm512_reduce_add_ps(s3);
+	}
+	
+	// Leftover rows
+	for (; i < m; i++) {
+		a0 = a + (size_t) i * lda;
+		
+		s0 = _mm512_setzero_ps();
+		for (p = 0; p < k; p += 16)
+			s0 = _mm512_fmadd_ps(half_load_avx512(type, a0 + p), _mm512_loadu_ps(x + p), s0);
+		
+		y[i] = _mm512_reduce_add_ps(s0);
+	}
+}
+
+/*
+ * AVX-512 matrix-vector kernel
+ *
+ * type, m, k, a, lda, x, y = Same as half_gemv_c
+ */
+__attribute__((target("avx512f")))
+static void half_gemv_avx512(int type, int m, int k, unsigned short *a, int lda, float *x, float *y)
+{
+	if (type == HALF_F16)
+		half_gemv_avx512_body(HALF_F16, m, k, a, lda, x, y);
+	else
+		half_gemv_avx512_body(HALF_BF16, m, k, a, lda, x, y);
+}
+
+/*
+ * AVX-512 widening kernel
+ *
+ * type, src, dst, n = Same as half_widen_c
+ */
+__attribute__((target("avx512f")))
+static void half_widen_avx512(int type, unsigned short *src, float *dst, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i += 16)
+		_mm512_storeu_ps(dst + i, half_load_avx512(type, src + i));
+}
+
+/*
+ * AVX-512 kernels only need the foundation instructions
+ */
+static int half_supported_avx512()
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+#endif
+
+/*
+ * Kernel sets, in order of preference
+ */
+static half_kern_t half_kerns[] = {
+#ifdef HALF_X86
+	{"avx512", half_gemv_avx512, half_widen_avx512, half_supported_avx512},
+	{"avx2", half_gemv_avx2, half_widen_avx2, half_supported_avx2},
+#endif
+	{"scalar", half_gemv_c, half_widen_c, half_supported_c}
+};
+
+#define HALF_KERNS (sizeof(half_kerns) / sizeof(half_kern_t))
+
+/*
+ * Picks the best kernel set that the CPU supports
+ * Called automatically on first use, but can be called at startup instead
+ */
+void half_init()
+{
+	int i;
+	
+	for (i = 0; i < HALF_KERNS; i++) {
+		if (half_kerns[i].supported()) {
+			half_kern = &half_kerns[i];
+			return;
+		}
+	}
+}
+
+/*
+ * Forces a specific kernel set to be used
+ *
+ * name = Name of kernel set ("avx512", "avx2", "scalar")
+ *
+ * Returns 0 on success, -1 if the set does not exist or is not supported
+ */
+int half_select(char *name)
+{
+	int i;
+	
+	for (i = 0; i < HALF_KERNS; i++) {
+		if (!strcmp(half_kerns[i].name, name)) {
+			if (!half_kerns[i].supported()) return -1;
+			half_kern = &half_kerns[i];
+			return 0;
+		}
+	}
+	
+	return -1;
+}
+
+/*
+ * Returns the name of the selected kernel set
+ */
+char *half_name()
+{
+	if (!half_kern) half_init();
+	
+	return half_kern->name;
+}
+
+/*
+ * Converts a layer's weights and bias to half width
+ *
+ * type = HALF_F16 or HALF_BF16
+ * weight = Weights to convert (outputs x inputs)
+ * bias = Bias to convert (outputs x 1)
+ *
+ * Returns pointer to new half struct
+ */
+half_t *half_new(int type, matrix_t *weight, matrix_t *bias)
+{
+	half_t *new;
+	size_t size;
+	int r, i;
+	
+	new = (half_t *) mem_alloc(sizeof(half_t));
+	new->type = type;
+	new->rows = weight->height;
+	new->cols = weight->width;
+	new->stride = (weight->width + HALF_ALIGN - 1) / HALF_ALIGN * HALF_ALIGN;
+	if (!new->stride) new->stride = HALF_ALIGN;
+	new->view = 0;
+	
+	// Padding stays zero, so the kernels never need edge cases
+	size = sizeof(unsigned short) * new->stride * new->rows;
+	if (!size) size = sizeof(unsigned short) * HALF_ALIGN;
+	new->weight = (unsigned short *) mem_align(64, size);
+	memset(new->weight, 0, size);
+	new->bias = (unsigned short *) mem_alloc(sizeof(unsigned short) * (new->rows ? new->rows : 1));
+	
+	for (r = 0; r < new->rows; r++) {
+		for (i = 0; i < new->cols; i++)
+			new->weight[(size_t) r * new->stride + i] = half_from_float(type, weight->data[(size_t) r * weight->stride + i]);
+		new->bias[r] = half_from_float(type, bias->data[r * bias->stride]);
+	}
+	
+	return new;
+}
+
+/*
+ * Creates a half struct whose weights and bias live somewhere else,
+ * like a mapped checkpoint
+ * The values must outlive the struct
+ *
+ * type = HALF_F16 or HALF_BF16
+ * rows = Rows of the weights (outputs)
+ * cols = Columns of the weights (inputs)
+ * stride = Values between weight rows, a multiple of HALF_ALIGN with zero padding
+ * weight = Weight values
+ * bias = Bias values, one per row
+ *
+ * Returns pointer to new half struct
+ */
+half_t *half_new_view(int type, int rows, int cols, int stride, unsigned short *weight, unsigned short *bias)
+{
+	half_t *new;
+	
+	new = (half_t *) mem_alloc(sizeof(half_t));
+	new->type = type;
+	new->rows = rows;
+	new->cols = cols;
+	new->stride = stride;
+	new->weight = weight;
+	new->bias = bias;
+	new->view = 1;
+	
+	return new;
+}
+
+/*
+ * Widens half width weights and bias back to fp32
+ *
+ * h = Half width weights and bias
+ * weight = Widened weights (rows x cols), already sized to fit
+ * bias = Widened bias (rows x 1), already sized to fit
+ */
+void half_widen(half_t *h, matrix_t *weight, matrix_t *bias)
+{
+	int r, i;
+	
+	for (r = 0; r < h->rows; r++) {
+		for (i = 0; i < h->cols; i++)
+			weight->data[(size_t) r * weight->stride + i] = half_to_float(h->type, h->weight[(size_t) r * h->stride + i]);
+		bias->data[r * bias->stride] = half_to_float(h->type, h->bias[r]);
+	}
+}
+
+/*
+ * Runs a half width layer
+ * Single samples go through the matrix-vector kernel, which widens the
+ * weights in registers. Blocks of samples widen HALF_MB rows at a time and
+ * run them through the GEMM engine.
+ *
+ * h = Half width weights and bias
+ * act = Array activation kernel, NULL for none
+ * prev = Inputs (cols x samples)
+ * z = Intermediate (rows x samples), already sized to fit
+ * result = Result (rows x samples), already sized to fit
+ */
+void half_forward(half_t *h, void (*act)(float *in, float *out, int n), matrix_t *prev, matrix_t *z, matrix_t *result)
+{
+	float *x, *y, *o, *b, *w;
+	int n, i, r, mb;
+	size_t size;
+	gemm_epi_t ep;
+	
+	if (!half_kern) half_init();
+	
+	// Scratch only grows, it holds a vector, the bias and outputs, and a block of rows
+	size = sizeof(float) * ((size_t) h->stride * (HALF_MB + 1) + (size_t) h->rows * 3);
+	size = (size + 63) / 64 * 64;
+	if (size > half_size) {
+		mem_free(half_buf);
+		half_size = size;
+		half_buf = (float *) mem_align(64, half_size);
+	}
+	w = half_buf;
+	x = w + (size_t) h->stride * HALF_MB;
+	b = x + h->stride;
+	y = b + h->rows;
+	o = y + h->rows;
+	
+	for (i = 0; i < h->rows; i++)
+		b[i] = half_to_float(h->type, h->bias[i]);
+	
+	n = prev->width;
+	if (n == 1) {
+		// The kernel wants x contiguous and padded out like the rows
+		// Views have no row pointers, so go through data and stride
+		for (i = 0; i < h->cols; i++)
+			x[i] = prev->data[(size_t) i * prev->stride];
+		memset(x + h->cols, 0, sizeof(float) * (h->stride - h->cols));
+		
+		half_kern->gemv(h->type, h->rows, h->stride, h->weight, h->stride, x, y);
+		
+		for (i = 0; i < h->rows; i++)
+			y[i] += b[i];
+		if (act) act(y, o, h->rows);
+		else memcpy(o, y, sizeof(float) * h->rows);
+		
+		for (i = 0; i < h->rows; i++) {
+			z->data[(size_t) i * z->stride] = y[i];
+			result->data[(size_t) i * result->stride] = o[i];
+		}
+		return;
+	}
+	
+	for (r = 0; r < h->rows; r += HALF_MB) {
+		mb = h->rows - r < HALF_MB ? h->rows - r : HALF_MB;
+		
+		// Widen a block of rows, small enough to stay in cache for the product
+		half_kern->widen(h->type, h->weight + (size_t) r * h->stride, w, mb * h->stride);
+		
+		ep.bias = b + r;
+		ep.incb = 1;
+		ep.out = result->data + (size_t) r * result->stride;
+		ep.ldo = result->stride;
+		ep.act = act;
+		
+		gemm_epi(GEMM_N, GEMM_N, mb, n, h->cols, w, h->stride, prev->data, prev->stride,
+			z->data + (size_t) r * z->stride, z->stride, &ep);
+	}
+}
+
+/*
+ * Frees a half struct
+ *
+ * h = Pointer to half struct
+ */
+void half_free(half_t *h)
+{
+	if (!h->view) {
+		mem_free(h->weight);
+		mem_free(h->bias);
+	}
+	
+	mem_free(h);
+}
@@ -1,8 +1,56 @@
 #ifndef ACTIVE_H
 #define ACTIVE_H
 
+/* Defines */
+// Activation function IDs
+#define ACTIVE_LINEAR 0
+#define ACTIVE_RELU 1
+#define ACTIVE_LRELU 2
+#define ACTIVE_SIGMOID 3
+#define ACTIVE_TANH 4
+#define ACTIVE_SOFTMAX 5	// Output layer only, trained with cross-entropy
+#define ACTIVE_COUNT 6
+
+// Slope of leaky ReLU for negative inputs
+#define ACTIVE_LRELU_SLOPE 0.01F
+
+// Samples softmax works on at once
+#define ACTIVE_BLOCK 64
+
+/* Types and structs */
+// Function type for activation functions
+typedef float (*actf_t)(float);
+
+// Function type for array activation kernels, out[i] = f(in[i])
+typedef void (*actvf_t)(float *in, float *out, int n);
+
+// Function type for array derivative kernels, delta[i] *= f'(z[i])
+typedef void (*actdf_t)(float *z, float *delta, int n);
+
+// Activation function registry entry
+typedef struct active {
+	int id;
+	char *name;
+	
+	actf_t act;			// Activation function
+	actf_t der;			// Derivative of activation function
+	
+	actvf_t act_v;		// Array activation kernel
+	actdf_t der_v;		// Array derivative kernel
+} active_t;
+
 /* Prototypes */
+active_t *active_get(int id);
+float active_linear(float in);
+float active_linear_der(float in);
 float active_relu(float in);
 float active_relu_der(float in);
+float active_lrelu(float in);
+float active_lrelu_der(float in);
+float active_sigmoid(float in);
+float active_sigmoid_der(float in);
+float active_tanh(float in);
+float active_tanh_der(float in);
+void active_softmax(float *x, int ld, int rows, int n);
 
-#endif
\ No newline at end of file
+#endif
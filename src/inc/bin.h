@@ -0,0 +1,47 @@
+/*
+ * Binary dataset files are laid out as follows:
+ *
+ * bin_header_t, then count records of record bytes each
+ *
+ * Every record holds osize floats of output, followed by isize inputs of
+ * dtype. Everything is stored in the native byte order of the machine
+ * that wrote the file.
+ */
+
+#ifndef BIN_H
+#define BIN_H
+
+#include "csv.h"
+
+/* Defines */
+// File magic and format version
+#define BIN_MAGIC "PMLD"
+#define BIN_VERSION 1
+
+// Input value types, the same as the csv storage types
+#define BIN_F32 CSV_F32
+#define BIN_U8 CSV_U8
+
+/* Types and structs */
+// Binary dataset header
+typedef struct bin_header {
+	char magic[4];
+	int version;
+	
+	int isize;			// Input size
+	int osize;			// Output size
+	int count;			// Number of records
+	
+	int dtype;			// Type of input values, BIN_F32 or BIN_U8
+	float scale;		// Multiplier that turns BIN_U8 inputs into floats
+	int record;			// Size of a record in bytes
+	
+	char pad[32];		// Pads the header out to 64 bytes
+} bin_header_t;
+
+/* Prototypes */
+int bin_check(bin_header_t *h, size_t size);
+int bin_save(batch_t *batch, char *path, int dtype, int max);
+batch_t *bin_load(char *path);
+
+#endif
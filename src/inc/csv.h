@@ -3,12 +3,25 @@
 
 #include "matrix.h"
 
+#include <stddef.h>
+
+/* Defines */
+// Ways a record can be bad
+#define CSV_ERR_MANY 1	// Too many columns
+#define CSV_ERR_FEW 2	// Not enough columns
+
+// How sample inputs are stored
+#define CSV_F32 0		// Normalized floats
+#define CSV_U8 1		// Packed uint8, normalized when gathered
+
 /* Types and structs */
 // Training sample struct
 typedef struct sample {
-	matrix_t *input;
+	matrix_t *input;	// Sized to the inputs, has no data if they are packed
 	matrix_t *output;
 	
+	unsigned char *raw;	// Packed uint8 inputs, NULL if they are floats
+	
 	int serial;			// Serial number for training object
 } sample_t;
 
@@ -16,11 +29,24 @@ typedef struct batch {
 	sample_t **samples;
 	
 	int count;
+	float scale;		// Multiplier that normalizes packed inputs
+	
+	// Shared storage, set when the samples don't own their own memory
+	void *slab;			// Sample and matrix structs, allocated in one go
+	void *store;		// Values the samples point into
+	void *map;			// Mapped file the sample matricies point into
+	size_t map_size;	// Size of the mapping
 } batch_t;
 
 /* Prototypes */
-batch_t *csv_load(char *path, int max, char single, int isize, int osize);
+batch_t *csv_load(char *path, int max, char single, int isize, int osize, int type);
+int csv_parse(char *p, char *eol, float *in, unsigned char *raw, float *out, int max, char single, int isize, int osize);
 batch_t *csv_subset(batch_t *source, int count);
+void csv_resample(batch_t *source, batch_t *dest);
+void csv_gather(batch_t *batch, int start, int count, matrix_t *in, matrix_t *out);
+batch_t *csv_batch_new(int count);
+batch_t *csv_batch_view(int count, int isize, int osize, float *in, size_t istride, float *out, size_t ostride);
+batch_t *csv_batch_pack(int count, int isize, int osize, unsigned char *in, size_t istride, float *out, size_t ostride, float scale);
 sample_t *csv_sample_new(int isize, int osize);
 void csv_sample_free(sample_t *sample);
 void csv_batch_free(batch_t *batch);
@@ -1,16 +1,33 @@
 #ifndef DIST_H
 #define DIST_H
 
+/* Defines */
+// Gaussian pairs generated per pass of the vector kernel
+#define DIST_BLOCK 64
+
 /* Types and structs */
 typedef struct f_pair {
 	float f1;
 	float f2;
 } f_pair_t;
 
+// Generator state, xoshiro256**
+// Every thread has its own stream, see dist_rng()
+typedef struct dist_rng {
+	unsigned long long s[4];
+} dist_rng_t;
+
 /* Prototypes */
 void dist_init();
+void dist_seed(unsigned long long seed);
+void dist_rng_seed(dist_rng_t *r, unsigned long long seed, int stream);
+dist_rng_t *dist_rng();
+unsigned long long dist_next(dist_rng_t *r);
+int dist_below(dist_rng_t *r, int n);
+float dist_uniform(dist_rng_t *r);
+void dist_gauss_fill(dist_rng_t *r, float *a, int cnt, float scale);
 float dist_randf();
 f_pair_t dist_gauss();
 void dist_he_init(float *a, int cnt, int in); 
 
-#endif
\ No newline at end of file
+#endif
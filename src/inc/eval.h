@@ -0,0 +1,63 @@
+#ifndef EVAL_H
+#define EVAL_H
+
+#include "matrix.h"
+#include "net.h"
+#include "csv.h"
+#include "pool.h"
+#include "stream.h"
+
+/* Defines */
+// Metrics an evaluation pass can collect, any combination
+#define EVAL_COST 1			// Mean cost, cross-entropy for softmax outputs
+#define EVAL_CORRECT 2		// Samples whose largest output is the hot one
+#define EVAL_TOPK 4			// Samples whose hot output is among the k largest
+#define EVAL_CONFUSION 8	// Counts of every desired and predicted output pair
+#define EVAL_ALL 15
+
+// Samples fed through the network at once
+#define EVAL_BATCH 256
+
+/* Types and structs */
+// Private buffers and partial results of one evaluation thread
+typedef struct eval_worker {
+	net_ctx_t *ctx;
+	matrix_t *in;		// Gathered input samples
+	matrix_t *out;		// Gathered output samples
+	
+	double cost;		// Summed cost of this thread's samples
+	long correct;
+	long topk;
+	long *confusion;	// osize x osize, NULL if not collected
+} eval_worker_t;
+
+// Runs a network over whole datasets, collecting every metric in one forward pass
+typedef struct eval {
+	network_t *net;
+	pool_t *pool;		// NULL when single threaded
+	
+	eval_worker_t *workers;
+	int threads;		// Number of workers
+	int metrics;		// EVAL_* metrics to collect
+	int k;				// Outputs that count for EVAL_TOPK
+	batch_t *cur;		// Batch being evaluated
+	
+	// Results, summed over every pass since the last reset
+	long count;			// Samples evaluated
+	double cost;		// Summed cost, divide by count for the mean
+	long correct;
+	long topk;
+	long *confusion;	// Row is the desired output, column the predicted one
+} eval_t;
+
+/* Prototypes */
+eval_t *eval_new(network_t *net, int threads, int metrics, int k);
+void eval_reset(eval_t *e);
+void eval_add(eval_t *e, batch_t *batch);
+void eval_run(eval_t *e, batch_t *batch);
+void eval_stream(eval_t *e, stream_t *s);
+float eval_cost(eval_t *e);
+void eval_print(eval_t *e);
+void eval_free(eval_t *e);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * All matricies passed into the gemm routines are addressed as follows:
+ *
+ * a[ROW * lda + COL]
+ *
+ * Which matches the data + stride layout of matrix_t
+ */
+
+#ifndef GEMM_H
+#define GEMM_H
+
+/* Defines */
+// Operand layouts
+#define GEMM_N 0	// Stored as is
+#define GEMM_T 1	// Stored transposed
+
+/* Types and structs */
+// Epilogue run over C once its sums are complete, C += bias, out = act(C)
+typedef struct gemm_epi {
+	float *bias;		// One value per row of C, NULL for none
+	int incb;			// Stride between bias values
+	
+	float *out;			// Activation output, same shape as C
+	int ldo;			// Row stride of out
+	
+	void (*act)(float *in, float *out, int n);	// Array activation kernel, NULL for none
+} gemm_epi_t;
+
+/* Prototypes */
+void gemm_init();
+int gemm_select(char *name);
+char *gemm_name();
+void gemm(int ta, int tb, int m, int n, int k, float *a, int lda, float *b, int ldb, float *c, int ldc);
+void gemm_epi(int ta, int tb, int m, int n, int k, float *a, int lda, float *b, int ldb, float *c, int ldc, gemm_epi_t *ep);
+
+#endif
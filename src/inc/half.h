@@ -0,0 +1,49 @@
+/*
+ * Half width layers keep their weights and bias as 16 bit floats, which
+ * kernels widen to fp32 in registers and accumulate in fp32. Either IEEE
+ * half (1 sign, 5 exponent, 10 mantissa bits) or bfloat16 (the top half
+ * of an fp32) can be used.
+ */
+
+#ifndef HALF_H
+#define HALF_H
+
+#include "matrix.h"
+
+/* Defines */
+// Storage types, these match the checkpoint dtypes
+#define HALF_F16 1
+#define HALF_BF16 2
+
+// Values per row are padded out to a multiple of this
+#define HALF_ALIGN 32
+
+// Rows widened to fp32 at a time for batched products, a multiple of the GEMM block height
+#define HALF_MB 192
+
+/* Types and structs */
+// Half width copy of a layer's weights and bias
+typedef struct half {
+	int type;			// HALF_F16 or HALF_BF16
+	int rows;			// Rows of the weights (outputs)
+	int cols;			// Columns of the weights (inputs)
+	int stride;			// Values between rows, a multiple of HALF_ALIGN
+	
+	unsigned short *weight;	// Weights, padding is zero
+	unsigned short *bias;	// Bias, one per row
+	char view;			// Weight and bias are views of memory owned elsewhere
+} half_t;
+
+/* Prototypes */
+void half_init();
+int half_select(char *name);
+char *half_name();
+unsigned short half_from_float(int type, float f);
+float half_to_float(int type, unsigned short h);
+half_t *half_new(int type, matrix_t *weight, matrix_t *bias);
+half_t *half_new_view(int type, int rows, int cols, int stride, unsigned short *weight, unsigned short *bias);
+void half_widen(half_t *h, matrix_t *weight, matrix_t *bias);
+void half_forward(half_t *h, void (*act)(float *in, float *out, int n), matrix_t *prev, matrix_t *z, matrix_t *result);
+void half_free(half_t *h);
+
+#endif
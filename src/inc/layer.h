@@ -2,11 +2,11 @@
 #define LAYER_H
 
 #include "matrix.h"
+#include "active.h"
+#include "quant.h"
+#include "half.h"
 
 /* Types and structs */
-// Function type for activation functions
-typedef float (*actf_t)(float);
-
 // Function type for initialization functions
 typedef void  (*initf_t)(float *, int, int);
 
@@ -17,9 +17,12 @@ typedef struct layer {
 	
 	int isize;			// Layer input size
 	int osize;			// Layer output size
+	int index;			// Position in the network, from 0
 	
-	actf_t act;			// Activation function
-	actf_t der;			// Derivative of activation function
+	active_t *act;		// Activation function and derivative
+	char view;			// Weight and bias are views of memory owned elsewhere
+	quant_t *quant;		// Int8 copy of the weights inference runs on, NULL for fp32
+	half_t *half;		// Half width weights and bias inference runs on, NULL for fp32
 	
 	matrix_t *z;		// Calculate intermediate
 	matrix_t *result;	// Calculation result
@@ -30,8 +33,14 @@ typedef struct layer {
 
 /* Prototypes */
 void layer_init(layer_t *l, initf_t init);
+double layer_flops(layer_t *l, int n);
+double layer_bytes(layer_t *l, int n);
 void layer_execute(layer_t *l, matrix_t *prev);
-layer_t *layer_new(int isize, int osize, actf_t act, actf_t der);
+void layer_forward(layer_t *l, matrix_t *prev, matrix_t *z, matrix_t *result);
+layer_t *layer_new(int isize, int osize, int act);
+layer_t *layer_new_view(int isize, int osize, int act, float *weight, int stride, float *bias);
+void layer_quantize(layer_t *l);
+void layer_half(layer_t *l, int type);
 void layer_free(layer_t *l);
 
 #endif
\ No newline at end of file
@@ -2,21 +2,38 @@
  * It should be noted that matrix values arrays are addressed as follows:
  *
  * l->values[ROW][COL] or l->values[Y][X]
+ *
+ * The values array is only a row pointer view into data, which holds the
+ * entire matrix as one contiguous, 64-byte aligned block. Rows are stride
+ * floats apart, so the hot paths should prefer:
+ *
+ * l->data[ROW * l->stride + COL]
+ *
+ * Matricies made with matrix_view() borrow their data from somewhere else
+ * (a mapped file, a shared block) and have no row pointers
  */
 
 #ifndef MATRIX_H
 #define MATRIX_H
 
+/* Defines */
+// Alignment of matrix data blocks, in bytes
+#define MATRIX_ALIGN 64
+
 /* Types and structs */
 // Matrix struct
 typedef struct matrix {
 	int width;
 	int height;
-	float **values;
+	int stride;			// Distance between rows, in floats
+	float *data;		// Contiguous row-major storage
+	float **values;		// Row pointer view into data
 } matrix_t;
 
 /* Prototypes */
 void matrix_mul(matrix_t *a, matrix_t *b, matrix_t *c);
+void matrix_mul_tn(matrix_t *a, matrix_t *b, matrix_t *c);
+void matrix_mul_nt(matrix_t *a, matrix_t *b, matrix_t *c);
 matrix_t *matrix_nmul(matrix_t *a, matrix_t *b);
 void matrix_add(matrix_t *a, matrix_t *b, matrix_t *c);
 matrix_t *matrix_nadd(matrix_t *a, matrix_t *b);
@@ -26,9 +43,12 @@ void matrix_trans(matrix_t *a, matrix_t *b);
 matrix_t *matrix_ntrans(matrix_t *a);
 void matrix_prod(matrix_t *a, matrix_t *b, matrix_t *c);
 matrix_t *matrix_nprod(matrix_t *a, matrix_t *b);
+void matrix_zero(matrix_t *m);
 
 matrix_t *matrix_new(int width, int height);
+void matrix_view(matrix_t *m, float *data, int width, int height, int stride);
+void matrix_resize(matrix_t *m, int width);
 void matrix_free(matrix_t *m);
 void matrix_print(matrix_t *m);
 
-#endif
\ No newline at end of file
+#endif
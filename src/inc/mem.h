@@ -0,0 +1,12 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+/* Prototypes */
+void *mem_alloc(size_t size);
+void *mem_align(size_t align, size_t size);
+void mem_free(void *p);
+long mem_count();
+
+#endif
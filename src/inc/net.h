@@ -5,6 +5,26 @@
 #include "layer.h"
 #include "net.h"
 
+#include <stddef.h>
+
+/* Defines */
+// Checkpoint file magic and format version
+#define NET_MAGIC "PMLN"
+#define NET_VERSION 1
+
+// Alignment of weight and bias blobs in a checkpoint, in bytes
+#define NET_ALIGN 64
+
+// Ways to load a checkpoint
+#define NET_LOAD_COPY 0	// Weights are copied into memory
+#define NET_LOAD_MAP 1	// Weights point into a private mapping of the file
+#define NET_LOAD_SHARED 2	// Weights point into a read-only mapping shared by every process, inference only
+
+// Weight storage types
+#define NET_F32 0
+#define NET_F16 HALF_F16
+#define NET_BF16 HALF_BF16
+
 /* Types and structs */
 
 // Neural network data structure
@@ -15,12 +35,77 @@ typedef struct network {
 	
 	int isize;
 	int osize;
+	
+	void *map;			// Mapped checkpoint the layers point into, if any
+	size_t map_size;	// Size of the mapping
+	char readonly;		// Weights can't be written, so the network can't be trained
+	char quant;			// Layers run on int8 weights, so the network can't be trained
+	char half;			// HALF_* type layers are stored as, 0 for fp32, can't be trained either
 } network_t;
 
+// Caller owned scratch for running a network, one per thread
+// The network itself is never written to, so any number of contexts
+// can run the same network at once
+typedef struct net_ctx {
+	network_t *net;
+	
+	matrix_t **z;		// Intermediate for every layer
+	matrix_t **result;	// Result for every layer
+	int depth;			// Layers the buffers were made for
+	
+	int batch;			// Samples the buffers were sized for
+} net_ctx_t;
+
+/*
+ * Checkpoint files are laid out as follows:
+ *
+ * net_header_t, then a net_record_t for every layer, then the blobs
+ *
+ * Weight blobs are osize rows of stride values, bias blobs are osize
+ * values, both in the layer's dtype. Every blob starts on a NET_ALIGN
+ * boundary, so a mapped file can be used in place. Everything is stored
+ * in native byte order.
+ *
+ * Half width rows are zero padded out to a multiple of HALF_ALIGN.
+ */
+typedef struct net_header {
+	char magic[4];
+	int version;
+	
+	int isize;			// Network input size
+	int depth;			// Number of layers
+	
+	char pad[48];		// Pads the header out to 64 bytes
+} net_header_t;
+
+// Checkpoint entry for a single layer
+typedef struct net_record {
+	int isize;			// Layer input size
+	int osize;			// Layer output size
+	int act;			// Activation function ID
+	int dtype;			// Weight and bias storage type, NET_F32, NET_F16 or NET_BF16
+	int stride;			// Distance between weight rows, in values
+	int pad0;
+	
+	long long weight;	// File offset of the weight blob
+	long long bias;		// File offset of the bias blob
+	
+	char pad[24];		// Pads the record out to 64 bytes
+} net_record_t;
+
 /* Prototypes */
 matrix_t *net_execute(network_t *net, matrix_t *in);
-void net_add_layer(network_t *net, int size, actf_t act, actf_t der, initf_t init);
+matrix_t *net_execute_batch(network_t *net, matrix_t *in);
+matrix_t *net_forward(network_t *net, matrix_t *in, matrix_t **z, matrix_t **result);
+net_ctx_t *net_ctx_new(network_t *net, int batch);
+matrix_t *net_run(net_ctx_t *ctx, matrix_t *in);
+void net_ctx_free(net_ctx_t *ctx);
+void net_add_layer(network_t *net, int size, int act, initf_t init);
 network_t *net_new(int size);
+int net_save(network_t *net, char *path);
+network_t *net_load(char *path, int mode);
+void net_quantize(network_t *net);
+void net_half(network_t *net, int type);
 void net_free(network_t *n);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,54 @@
+/*
+ * Optimizers turn summed gradients into weight updates. Plain SGD needs no
+ * state, momentum keeps a velocity for every weight and Adam keeps the
+ * first and second moments of the gradient:
+ *
+ * m = b1 * m + (1 - b1) * g
+ * v = b2 * v + (1 - b2) * g^2
+ * w -= rate * m' / (sqrt(v') + eps)
+ *
+ * Every update is a single pass over the weights, gradients and state.
+ */
+
+#ifndef OPTIM_H
+#define OPTIM_H
+
+/* Defines */
+// Optimizer types
+#define OPTIM_SGD 0
+#define OPTIM_MOMENTUM 1
+#define OPTIM_NESTEROV 2
+#define OPTIM_ADAM 3
+#define OPTIM_ADAMW 4
+
+// Default settings
+#define OPTIM_MU 0.9F		// Momentum, and Adam's first moment decay
+#define OPTIM_BETA2 0.999F	// Adam's second moment decay
+#define OPTIM_EPS 1e-8F		// Keeps Adam's step finite
+#define OPTIM_DECAY 0.01F	// AdamW weight decay
+
+/* Types and structs */
+// Optimizer settings, along with the values of the current step
+typedef struct optim {
+	int type;			// OPTIM_* type
+	float mu;			// Momentum, or Adam's first moment decay
+	float beta2;		// Adam's second moment decay
+	float eps;			// Adam's denominator floor
+	float decay;		// AdamW decoupled weight decay
+	
+	long long t;		// Steps taken
+	float rate;			// Learning rate of this step
+	float scale;		// Gradient scale of this step, one over the batch size
+	float step;			// SGD step, rate over the batch size
+	float c1;			// Adam step size, with the first moment correction
+	float c2;			// Adam second moment correction, as a square root
+} optim_t;
+
+/* Prototypes */
+int optim_default(optim_t *o, int type);
+int optim_states(optim_t *o);
+char *optim_name(optim_t *o);
+void optim_begin(optim_t *o, float rate, int count);
+void optim_update(optim_t *o, float *w, float *g, float *m, float *v, int n);
+
+#endif
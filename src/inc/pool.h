@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+/* Types and structs */
+// Function type for pool jobs, called once on every thread
+typedef void (*poolf_t)(void *arg, int id, int count);
+
+struct pool;
+
+// Individual pool thread
+typedef struct pool_thread {
+	struct pool *pool;
+	pthread_t thread;
+	
+	int id;				// Thread number, 0 is the caller
+} pool_thread_t;
+
+// Persistent pool of worker threads
+typedef struct pool {
+	pool_thread_t *threads;
+	int count;			// Number of threads, including the caller
+	
+	pthread_mutex_t lock;
+	pthread_cond_t start;	// Signaled when a job is posted
+	pthread_cond_t done;	// Signaled when the last thread finishes
+	
+	poolf_t func;		// Current job
+	void *arg;			// Current job argument
+	
+	int gen;			// Incremented for every job posted
+	int busy;			// Threads still running the current job
+	char quit;			// Set when the threads should exit
+} pool_t;
+
+/* Prototypes */
+void pool_run(pool_t *p, poolf_t func, void *arg);
+pool_t *pool_new(int count);
+void pool_free(pool_t *p);
+
+#endif
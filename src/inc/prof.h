@@ -0,0 +1,78 @@
+/*
+ * Hot path profiling, compiled in with -DPROF (make PROF=1)
+ *
+ * Spans are timed by phase and layer, along with the floating point work,
+ * bytes moved and heap allocations made while they were open. Totals are
+ * printed as a table, and every span can be written out as a Chrome
+ * trace_event timeline (chrome://tracing or ui.perfetto.dev).
+ *
+ * Without PROF the macros expand to nothing, so none of their arguments
+ * are even evaluated.
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdio.h>
+
+/* Defines */
+// Phases spans are counted under
+#define PROF_FORWARD 0	// Layer forward pass
+#define PROF_BP1 1		// Output delta
+#define PROF_BP2 2		// Delta of the previous layer
+#define PROF_BP3 3		// Bias gradient
+#define PROF_BP4 4		// Weight gradient
+#define PROF_UPDATE 5	// Gradient sum and weight update
+#define PROF_GATHER 6	// Copying samples into blocks
+#define PROF_PHASES 7
+
+// Layers counted separately, deeper layers share the last slot
+// Spans that aren't tied to a layer use layer -1
+#define PROF_LAYERS 16
+
+// Spans kept for the timeline by default, later ones are only counted
+#define PROF_EVENTS (1 << 20)
+
+#ifdef PROF
+#define PROF_BEGIN(span) prof_span_t span; prof_begin(&span)
+#define PROF_END(span, phase, layer, flops, bytes) prof_end(&span, phase, layer, flops, bytes)
+#else
+#define PROF_BEGIN(span)
+#define PROF_END(span, phase, layer, flops, bytes)
+#endif
+
+/* Types and structs */
+// Open span
+typedef struct prof_span {
+	long long start;	// Start time in nanoseconds
+	long allocs;		// Allocation count at the start
+} prof_span_t;
+
+// Running totals of one phase of one layer
+typedef struct prof_stat {
+	long long calls;
+	long long ns;		// Time spent
+	long long flops;	// Floating point operations
+	long long bytes;	// Bytes read and written
+	long long allocs;	// Heap allocations
+} prof_stat_t;
+
+// Single span on the timeline
+typedef struct prof_event {
+	long long start;	// Start time in nanoseconds, from prof_start()
+	long long ns;		// Duration
+	long long flops;
+	short phase;
+	short layer;
+	int tid;			// Profiler thread number
+} prof_event_t;
+
+/* Prototypes */
+void prof_start(int events);
+void prof_begin(prof_span_t *span);
+void prof_end(prof_span_t *span, int phase, int layer, double flops, double bytes);
+void prof_report(FILE *f);
+int prof_trace(char *path);
+void prof_stop();
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * Quantized layers keep an int8 copy of the fp32 weights, with one scale
+ * per row, and run inference on it:
+ *
+ * weight[r][i] ~= scale[r] * q[r][i]
+ *
+ * The inputs of every sample are quantized on the fly to unsigned 7 bit
+ * values with their own scale and zero point, which keeps the AVX2 pair
+ * sums from ever saturating
+ */
+
+#ifndef QUANT_H
+#define QUANT_H
+
+#include "matrix.h"
+
+/* Defines */
+// Rows per register tile, quantized weights are padded out to a multiple
+#define QUANT_MR 4
+
+// Largest quantized input value
+#define QUANT_MAX 127
+
+/* Types and structs */
+// Int8 copy of a weight matrix
+typedef struct quant {
+	int rows;			// Rows of the original weights (outputs)
+	int cols;			// Columns of the original weights (inputs)
+	int stride;			// Bytes between rows, a multiple of 64
+	
+	signed char *weight;	// Quantized weights, rows padded to QUANT_MR, padding is zero
+	float *scale;		// Scale of every row
+	int *sum;			// Sum of every row, to take the input zero points back out
+} quant_t;
+
+/* Prototypes */
+void quant_init();
+int quant_select(char *name);
+char *quant_name();
+quant_t *quant_new(matrix_t *weight);
+void quant_forward(quant_t *q, float *bias, int incb, void (*act)(float *in, float *out, int n), matrix_t *prev, matrix_t *z, matrix_t *result);
+void quant_free(quant_t *q);
+
+#endif
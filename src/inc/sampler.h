@@ -0,0 +1,46 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "matrix.h"
+#include "csv.h"
+#include "dist.h"
+
+#include <pthread.h>
+
+/* Defines */
+// Number of gathered blocks, one being trained on while the other fills
+#define SAMPLER_SLOTS 2
+
+// States of a block slot
+#define SAMPLER_EMPTY 0	// Waiting to be filled
+#define SAMPLER_FULL 1	// Filled, waiting to be trained on
+#define SAMPLER_HELD 2	// Being trained on
+
+/* Types and structs */
+// Hands out every sample of a batch once per epoch, in shuffled mini-batches
+// The next mini-batch is gathered on a background thread
+typedef struct sampler {
+	batch_t *source;
+	sample_t **order;	// Source samples in this epoch's order
+	int batch;			// Samples per mini-batch
+	int pos;			// Next sample in order to gather
+	dist_rng_t rng;		// Shuffle generator, only used by the sampler thread
+	
+	matrix_t *in[SAMPLER_SLOTS];	// Gathered inputs (isize x batch)
+	matrix_t *out[SAMPLER_SLOTS];	// Gathered outputs (osize x batch)
+	int count[SAMPLER_SLOTS];		// Samples in each block, 0 marks the end of an epoch
+	int state[SAMPLER_SLOTS];		// SAMPLER_* state of each block
+	int next;			// Next slot to hand out
+	
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// Signaled whenever a slot changes state
+	char quit;			// Set when the thread should exit
+} sampler_t;
+
+/* Prototypes */
+sampler_t *sampler_new(batch_t *source, int batch);
+int sampler_next(sampler_t *s, matrix_t **in, matrix_t **out);
+void sampler_free(sampler_t *s);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "net.h"
+#include "matrix.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+/* Defines */
+// Defaults for the batching policy
+#define SERVE_BATCH 32		// Most requests run in one forward pass
+#define SERVE_WAIT 1000		// Longest a request is held for a fuller batch, microseconds
+
+// Longest request line accepted, in bytes
+#define SERVE_LINE (64 * 1024)
+
+// Most bytes a reply can take, for a network with osize outputs
+#define SERVE_ROOM(osize) ((size_t) (osize) * 16 + 256)
+
+// Latencies kept for the percentiles, the most recent ones win
+#define SERVE_STATS (64 * 1024)
+
+// Kinds of request
+#define SERVE_INFER 0		// Run the inputs through the network
+#define SERVE_REPORT 1		// Reply with the current stats
+#define SERVE_ERROR 2		// Line couldn't be parsed, reply with an error
+
+/* Types and structs */
+struct serve;
+
+// Client requests are read from, replies are written back in request order
+typedef struct serve_conn {
+	struct serve *server;
+	int in;				// Descriptor requests are read from
+	int out;			// Descriptor replies are written to
+	char own;			// Close the descriptors once done
+	char dead;			// Writing failed, drop any further replies
+	
+	int refs;			// Reader plus requests still queued
+	struct serve_conn *next;	// Next open connection
+} serve_conn_t;
+
+// Single queued request, recycled through the server's free list
+typedef struct serve_req {
+	serve_conn_t *conn;
+	int kind;			// SERVE_* kind of request
+	long long start;	// Arrival time, nanoseconds
+	float *input;		// Input values, isize of them
+	
+	struct serve_req *next;
+} serve_req_t;
+
+// Queues single requests and runs them through the network in batches
+// A batch is run once it is full, or once its oldest request is due
+typedef struct serve {
+	network_t *net;
+	net_ctx_t *ctx;		// Scratch for the batching thread
+	matrix_t *in;		// Gathered inputs (isize x batch)
+	char *reply;		// Replies waiting to be written
+	size_t size;		// Size of reply
+	
+	int batch;			// Most requests per forward pass
+	long long wait;		// Longest the oldest request is held, nanoseconds
+	
+	serve_req_t *head;	// Oldest queued request
+	serve_req_t *tail;	// Newest queued request
+	serve_req_t *free;	// Requests ready to be reused
+	int pending;		// Requests queued
+	serve_conn_t *conns;	// Open connections
+	
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// Signaled when a request is queued, or on quit
+	pthread_cond_t idle;	// Signaled when a connection closes
+	char quit;			// Set when the thread should exit once the queue is empty
+	
+	// Only touched by the batching thread
+	float *lat;			// Most recent latencies, microseconds
+	float *sorted;		// Scratch for the percentiles
+	long served;		// Inference requests answered
+	long batches;		// Forward passes run
+	long long first;	// Arrival of the first request answered, nanoseconds
+	long long last;		// Time the last batch was answered, nanoseconds
+} serve_t;
+
+/* Prototypes */
+serve_t *serve_new(network_t *net, int batch, int wait);
+void serve_fd(serve_t *s, int in, int out);
+int serve_unix(serve_t *s, char *path);
+void serve_report(serve_t *s, FILE *f);
+void serve_stop(serve_t *s);
+void serve_free(serve_t *s);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "csv.h"
+#include "bin.h"
+
+#include <stddef.h>
+
+/* Defines */
+// Kinds of files a stream can read
+#define STREAM_CSV 0
+#define STREAM_BIN 1
+
+// Bytes read from a csv file at a time
+#define STREAM_READ (1024 * 1024)
+
+/* Types and structs */
+// Dataset read from disk a window of records at a time
+// Memory use depends only on the window size, not the dataset size
+typedef struct stream {
+	int fd;
+	int type;			// STREAM_CSV or STREAM_BIN
+	
+	int isize;			// Input size
+	int osize;			// Output size
+	int max;			// Maximum integer size, csv only
+	char single;		// Singleton label mode, csv only
+	
+	int window;			// Most records held at once
+	long record;		// Records handed out since the last rewind
+	char error;			// Set after a bad record, nothing more is read
+	
+	batch_t *batch;		// Current window, samples are views into in and out
+	sample_t **slots;	// Samples in storage order, so batch can be shuffled
+	float *in;			// Inputs of the window, back to back
+	float *out;			// Outputs of the window, back to back
+	
+	char *buf;			// Raw bytes read from the file
+	size_t size;		// Size of buf
+	size_t pos;			// First unparsed byte in buf, csv only
+	size_t len;			// Bytes of buf holding data, csv only
+	char eof;			// Nothing left to read, csv only
+	
+	bin_header_t head;	// File header, binary only
+} stream_t;
+
+/* Prototypes */
+stream_t *stream_open(char *path, int window, int max, char single, int isize, int osize);
+batch_t *stream_next(stream_t *s);
+void stream_rewind(stream_t *s);
+void stream_close(stream_t *s);
+
+#endif
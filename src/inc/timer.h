@@ -0,0 +1,7 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* Prototypes */
+long long timer_now();
+
+#endif
@@ -4,12 +4,66 @@
 #include "matrix.h"
 #include "net.h"
 #include "csv.h"
+#include "pool.h"
+#include "stream.h"
+#include "optim.h"
+
+/* Types and structs */
+// Private buffers for a thread working on part of a batch
+typedef struct train_worker {
+	matrix_t *in;		// Gathered input samples
+	matrix_t *out;		// Gathered output samples
+	
+	matrix_t **z;		// Intermediate for every layer
+	matrix_t **act;		// Activation for every layer
+	matrix_t **delta;	// Delta for every layer
+	
+	matrix_t **grad_w;	// Weight gradients
+	matrix_t **grad_b;	// Bias gradients
+	
+	int start;			// First sample in the batch
+	int count;			// Number of samples
+} train_worker_t;
+
+// Training context, owns every buffer needed to train a network
+typedef struct trainer {
+	network_t *net;
+	pool_t *pool;
+	
+	train_worker_t *workers;
+	int threads;		// Number of workers
+	int batch;			// Largest batch size
+	int active;			// Workers with samples in the current batch
+	
+	// Shape of the network the buffers were made for
+	int depth;
+	int isize;
+	int osize;
+	
+	batch_t *cur;		// Batch currently being trained on
+	matrix_t *in;		// Or pre-gathered inputs being trained on
+	matrix_t *out;		// And their outputs
+	
+	optim_t opt;		// Optimizer, with its step count
+	matrix_t **state_w[2];	// Optimizer state of every layer's weights, NULL if not needed
+	matrix_t **state_b[2];	// Optimizer state of every layer's bias
+} trainer_t;
 
 /* Prototypes */
 float train_cost(matrix_t *res, matrix_t *des);
+float train_cost_ce(matrix_t *res, matrix_t *des);
 float train_cost_batch(network_t *net, batch_t *batch);
 int train_correct(network_t *net, batch_t *batch);
-void train_batch(network_t *net, batch_t *batch, float rate);
+float train_cost_stream(network_t *net, stream_t *s);
+int train_correct_stream(network_t *net, stream_t *s);
+trainer_t *train_new(network_t *net, int batch, int threads);
+void train_free(trainer_t *t);
+int train_optim(trainer_t *t, optim_t *o);
+void train_step(trainer_t *t, batch_t *batch, float rate);
+void train_step_block(trainer_t *t, matrix_t *in, matrix_t *out, float rate);
+void train_batch(network_t *net, trainer_t **t, batch_t *batch, float rate);
+void train_stream(trainer_t *t, stream_t *s, int size, float rate);
 void train_backprop(network_t *net, sample_t *sample, matrix_t **grad_w, matrix_t **grad_b, matrix_t **delta_w, matrix_t **delta_b);
+void train_backprop_batch(network_t *net, matrix_t *in, matrix_t *out, train_worker_t *w);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,9 @@
  */
 
 #include "inc/layer.h"
+#include "inc/mem.h"
+#include "inc/gemm.h"
+#include "inc/prof.h"
 
 #include <stdlib.h>
 
@@ -20,35 +23,106 @@ void layer_init(layer_t *l, initf_t init)
 	int i;
 	
 	// Zero out the bias matrix
-	for (i = 0; i < l->bias->height; i++)
-		l->bias->values[i][0] = 0;
+	matrix_zero(l->bias);
 	
 	// And init the weight matrix
 	for (i = 0; i < l->weight->height; i++)
-		init(l->weight->values[i], l->weight->width, l->isize);
+		init(l->weight->data + i * l->weight->stride, l->weight->width, l->isize);
+}
+
+/*
+ * Counts the floating point work of one product with a layer's weights,
+ * which is the same forward, for BP2 and for BP4
+ *
+ * l = Layer
+ * n = Number of samples
+ *
+ * Returns number of operations
+ */
+double layer_flops(layer_t *l, int n)
+{
+	return 2.0 * l->osize * l->isize * n;
+}
+
+/*
+ * Counts the bytes one product with a layer's weights moves, the weights
+ * once in whatever width they are stored plus an isize and two osize
+ * blocks of fp32
+ *
+ * l = Layer
+ * n = Number of samples
+ *
+ * Returns number of bytes
+ */
+double layer_bytes(layer_t *l, int n)
+{
+	int size;
+	
+	size = (l->quant ? 1 : (l->half ? 2 : sizeof(float)));
+	return (double) size * l->osize * l->isize + sizeof(float) * ((double) l->isize * n + 2.0 * l->osize * n);
 }
 
 /*
  * Update the result given the result from the last matrix
+ * The previous result can hold any number of samples, one per column,
+ * the z and result matricies are resized to match
  *
  * l = Layer to execute
+ * prev = Result of the previous layer (isize x samples)
  */
 void layer_execute(layer_t *l, matrix_t *prev)
 {
-	int i;
-	
 	// If there is no matrix or no previous matrix, bad news!
 	if (!l || !prev) return;
 	
-	// Multiply the weight by the results of the last layer
-	matrix_mul(l->weight, prev, l->z);
+	layer_forward(l, prev, l->z, l->result);
+}
+
+/*
+ * Runs a layer into caller supplied z and result matricies
+ * The layer itself is not modified, so this is safe to call from
+ * multiple threads at once as long as they use their own matricies
+ *
+ * l = Layer to execute
+ * prev = Result of the previous layer (isize x samples)
+ * z = Calculated intermediate (osize x samples), resized to fit
+ * result = Calculation result (osize x samples), resized to fit
+ */
+void layer_forward(layer_t *l, matrix_t *prev, matrix_t *z, matrix_t *result)
+{
+	gemm_epi_t ep;
+	
+	PROF_BEGIN(span);
+	
+	// Make room for every sample in the batch
+	matrix_resize(z, prev->width);
+	matrix_resize(result, prev->width);
+	
+	// Quantized layers have their own kernels, with the same epilogue
+	if (l->quant) {
+		quant_forward(l->quant, l->bias->data, l->bias->stride, l->act->act_v, prev, z, result);
+	} else if (l->half) {
+		half_forward(l->half, l->act->act_v, prev, z, result);
+	} else {
+		// Add the bias and run the activation on each tile of z
+		// as soon as it is done, so z and result are written only once
+		ep.bias = l->bias->data;
+		ep.incb = l->bias->stride;
+		ep.out = result->data;
+		ep.ldo = result->stride;
+		ep.act = l->act->act_v;
+		
+		// Multiply the weight by the results of the last layer
+		// With more than one sample, this is a single matrix-matrix product
+		gemm_epi(GEMM_N, GEMM_N, l->osize, prev->width, l->isize, l->weight->data, l->weight->stride,
+			prev->data, prev->stride, z->data, z->stride, &ep);
+	}
 	
-	// Add the bias
-	matrix_add(l->z, l->bias, l->z);
+	// Softmax spans every output of a sample, so it runs on the finished block
+	if (l->act->id == ACTIVE_SOFTMAX)
+		active_softmax(result->data, result->stride, result->height, result->width);
 	
-	// Now run everything through the activation function
-	for (i = 0; i < l->result->height; i++)
-		l->result->values[i][0] = l->act(l->z->values[i][0]);
+	PROF_END(span, PROF_FORWARD, l->index, layer_flops(l, prev->width), layer_bytes(l, prev->width));
 }
 
 /*
@@ -57,31 +131,34 @@ void layer_execute(layer_t *l, matrix_t *prev)
  *
  * isize = Input layer size
  * osize = Output layer size
- * act = Activation function
- * der = Derivative of activation function
+ * act = Activation function ID (ACTIVE_*)
  *
  * Returns pointer to new layer struct
  */
-layer_t *layer_new(int isize, int osize, actf_t act, actf_t der)
+layer_t *layer_new(int isize, int osize, int act)
 {
 	layer_t *new;
 	
 	// Alloc new struct
-	new = (layer_t *) malloc(sizeof(layer_t));
+	new = (layer_t *) mem_alloc(sizeof(layer_t));
 	
-	// Set activate function and derivative
-	new->act = act;
-	new->der = der;
+	// Look up activate function and derivative, unknown IDs fall back to linear
+	new->act = active_get(act);
+	if (!new->act) new->act = active_get(ACTIVE_LINEAR);
 	
 	// Create weight, bias, z, result matrix
 	new->weight = matrix_new(isize, osize);
 	new->bias = matrix_new(1, osize);
 	new->z = matrix_new(1, osize);
 	new->result = matrix_new(1, osize);
+	new->view = 0;
+	new->quant = NULL;
+	new->half = NULL;
 	
 	// Set the input and output sizes
 	new->isize = isize;
 	new->osize = osize;
+	new->index = 0;
 	
 	// Null out next and prev layer
 	new->next = NULL;
@@ -90,6 +167,101 @@ layer_t *layer_new(int isize, int osize, actf_t act, actf_t der)
 	return new;
 }
 
+/*
+ * Allocates memory for a new layer struct whose weight and bias are
+ * views of values that live somewhere else, like a mapped checkpoint
+ * The values must outlive the layer
+ *
+ * isize = Input layer size
+ * osize = Output layer size
+ * act = Activation function ID (ACTIVE_*)
+ * weight = Weight values (osize rows of isize)
+ * stride = Distance between weight rows, in floats
+ * bias = Bias values (osize, back to back)
+ *
+ * Returns pointer to new layer struct
+ */
+layer_t *layer_new_view(int isize, int osize, int act, float *weight, int stride, float *bias)
+{
+	layer_t *new;
+	
+	new = (layer_t *) mem_alloc(sizeof(layer_t));
+	
+	new->act = active_get(act);
+	if (!new->act) new->act = active_get(ACTIVE_LINEAR);
+	
+	// Only the structs are ours
+	new->weight = (matrix_t *) mem_alloc(sizeof(matrix_t));
+	new->bias = (matrix_t *) mem_alloc(sizeof(matrix_t));
+	matrix_view(new->weight, weight, isize, osize, stride);
+	matrix_view(new->bias, bias, 1, osize, 1);
+	new->view = 1;
+	new->quant = NULL;
+	new->half = NULL;
+	
+	new->z = matrix_new(1, osize);
+	new->result = matrix_new(1, osize);
+	
+	new->isize = isize;
+	new->osize = osize;
+	new->index = 0;
+	new->next = NULL;
+	new->prev = NULL;
+	
+	return new;
+}
+
+/*
+ * Gives a layer loaded straight from mapped half width values its fp32
+ * weights and bias, which only hold empty placeholders until something
+ * needs them
+ *
+ * l = Layer to widen
+ */
+static void layer_widen(layer_t *l)
+{
+	if (l->weight->data || !l->half) return;
+	
+	// Placeholders are bare view structs, the widened values are ours
+	mem_free(l->weight);
+	mem_free(l->bias);
+	l->weight = matrix_new(l->isize, l->osize);
+	l->bias = matrix_new(1, l->osize);
+	l->view = 0;
+	
+	half_widen(l->half, l->weight, l->bias);
+}
+
+/*
+ * Quantizes the weights of a layer to int8, which inference then runs on
+ * The fp32 weights are kept, but changes to them aren't picked up, so this
+ * is for layers that are done training
+ *
+ * l = Layer to quantize
+ */
+void layer_quantize(layer_t *l)
+{
+	layer_widen(l);
+	if (l->quant) quant_free(l->quant);
+	l->quant = quant_new(l->weight);
+}
+
+/*
+ * Stores the weights and bias of a layer at half width, which inference
+ * then runs on
+ * Like quantizing, the fp32 weights are kept but changes to them aren't
+ * picked up
+ *
+ * l = Layer to convert
+ * type = HALF_F16 or HALF_BF16, 0 to go back to fp32
+ */
+void layer_half(layer_t *l, int type)
+{
+	layer_widen(l);
+	if (l->half) half_free(l->half);
+	l->half = type ? half_new(type, l->weight, l->bias) : NULL;
+}
+
 /*
  * Frees the utilized memory of an existing layer struct
  *
@@ -97,12 +269,19 @@ layer_t *layer_new(int isize, int osize, actf_t act, actf_t der)
  */
 void layer_free(layer_t *l)
 {
-	// Free matrixes
-	matrix_free(l->weight);
-	matrix_free(l->bias);
+	// Free matrixes, views only have their structs
+	if (l->view) {
+		mem_free(l->weight);
+		mem_free(l->bias);
+	} else {
+		matrix_free(l->weight);
+		matrix_free(l->bias);
+	}
 	matrix_free(l->z);
 	matrix_free(l->result);
+	if (l->quant) quant_free(l->quant);
+	if (l->half) half_free(l->half);
 	
 	// Free struct
-	free(l);
+	mem_free(l);
 }
\ No newline at end of file
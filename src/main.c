@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <unistd.h>
 #include "inc/layer.h"
 #include "inc/matrix.h"
 #include "inc/dist.h"
@@ -6,46 +7,184 @@
 #include "inc/active.h"
 #include "inc/csv.h"
 #include "inc/train.h"
+#include "inc/gemm.h"
+#include "inc/mem.h"
+#include "inc/bin.h"
+#include "inc/sampler.h"
+#include "inc/serve.h"
+#include "inc/quant.h"
+#include "inc/half.h"
+#include "inc/prof.h"
+#include "inc/eval.h"
 
-int main()
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Converts an MNIST style csv file into a binary dataset file
+ *
+ * argc = Number of arguments after the subcommand
+ * argv = Arguments, csv path, binary path and an optional type (f32 or u8)
+ *
+ * Returns exit status
+ */
+static int main_convert(int argc, char **argv)
+{
+	batch_t *set;
+	int dtype, ret;
+	
+	if (argc < 2) {
+		printf("Usage: punyml convert <in.csv> <out.bin> [f32|u8]\n");
+		return 1;
+	}
+	
+	// Floats can be used in place once mapped, bytes take a quarter of the space
+	dtype = (argc > 2 && !strcmp(argv[2], "u8")) ? BIN_U8 : BIN_F32;
+	
+	set = csv_load(argv[0], 256, 1, 784, 10, dtype);
+	if (!set) return 1;
+	
+	ret = bin_save(set, argv[1], dtype, 256);
+	if (!ret) printf("Wrote %d records to %s\n", set->count, argv[1]);
+	
+	csv_batch_free_all(set);
+	return ret ? 1 : 0;
+}
+
+/*
+ * Serves a saved network, on stdin and stdout or on a unix domain socket
+ * Replies are the only thing written to stdout
+ *
+ * argc = Number of arguments after the subcommand
+ * argv = Arguments, network path, then optionally the socket path ("-" for
+ *        stdin), the most requests per batch and the latency budget in microseconds
+ *
+ * Returns exit status
+ */
+static int main_serve(int argc, char **argv)
+{
+	network_t *net;
+	serve_t *s;
+	int batch, wait, ret;
+	
+	if (argc < 1) {
+		fprintf(stderr, "Usage: punyml serve <model.net> [socket|-] [batch] [wait_us]\n");
+		return 1;
+	}
+	
+	// Read-only and shared, so every server process uses the same pages
+	net = net_load(argv[0], NET_LOAD_SHARED);
+	if (!net) return 1;
+	
+	batch = argc > 2 ? atoi(argv[2]) : SERVE_BATCH;
+	wait = argc > 3 ? atoi(argv[3]) : SERVE_WAIT;
+	s = serve_new(net, batch, wait);
+	fprintf(stderr, "Serving %s (%d inputs, %d outputs), batches of up to %d within %dus\n",
+		argv[0], net->isize, net->osize, s->batch, (int) (s->wait / 1000));
+	
+	ret = 0;
+	if (argc > 1 && strcmp(argv[1], "-")) {
+		fprintf(stderr, "Listening on %s\n", argv[1]);
+		ret = serve_unix(s, argv[1]);
+	} else {
+		serve_fd(s, 0, 1);
+	}
+	
+	// Answer everything still queued before reporting
+	serve_stop(s);
+	serve_report(s, stderr);
+	
+	serve_free(s);
+	net_free(net);
+	return ret ? 1 : 0;
+}
+
+int main(int argc, char **argv)
 {
-	batch_t *tset, *sset;
+	batch_t *tset;
+	sampler_t *sampler;
+	matrix_t *in, *out;
 	layer_t *l;
 	network_t *net;
-	int i,j ;
+	trainer_t *trainer;
+	eval_t *eval;
+	int i,j, threads;
+	int correct, reduced;
+	long allocs;
 	
 	// Init random seeds
 	dist_init();
 	
-	tset = csv_load("mnist_test.csv", 256, 1, 784, 10);
+	// Pick matrix kernels for this CPU
+	gemm_init();
+	
+	// Replies go to stdout, so check for this before printing anything
+	if (argc > 1 && !strcmp(argv[1], "serve"))
+		return main_serve(argc - 2, argv + 2);
+	
+	printf("Using %s matrix kernels\n", gemm_name());
+	
+	if (argc > 1 && !strcmp(argv[1], "convert"))
+		return main_convert(argc - 2, argv + 2);
+	
+	// Prefer the converted dataset, it maps in without any parsing
+	if (!access("mnist_test.bin", R_OK))
+		tset = bin_load("mnist_test.bin");
+	else
+		tset = csv_load("mnist_test.csv", 256, 1, 784, 10, CSV_U8);
+	if (!tset) return 1;
 	
 	net = net_new(784);
 	
-	net_add_layer(net, 30, &active_relu, &active_relu_der, &dist_he_init);
-	net_add_layer(net, 10, &active_relu, &active_relu_der, &dist_he_init);
+	net_add_layer(net, 30, ACTIVE_RELU, &dist_he_init);
+	net_add_layer(net, 10, ACTIVE_SOFTMAX, &dist_he_init);
 	
 	printf("Network stats: Depth=%d, ISize=%d, OSize=%d\n", net->depth, net->isize, net->osize);
+	
+	// Train on every core
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	trainer = train_new(net, 10, threads);
+	sampler = sampler_new(tset, 10);
+	printf("Training with %d threads\n", threads);
 	//net_execute(net, tset->samples[0]->input);
 	//matrix_print(net->layer_tail->result);
 	//printf("Error: %f\n", train_cost(net_execute(net, tset->samples[0]->input), tset->samples[0]->output));
 	
 	//if (net) return 0;
 	
-	printf("Initial performance: %d/%d correct\n", train_correct(net, tset), tset->count);
+	// Cost and accuracy both come from one threaded pass over the set
+	eval = eval_new(net, threads, EVAL_COST | EVAL_CORRECT, 1);
+	eval_run(eval, tset);
+	printf("Initial performance: %ld/%d correct\n", eval->correct, tset->count);
+	
+#ifdef PROF
+	prof_start(0);
+#endif
 	
 	for (j = 0; j < 30; j++) {
-		printf("Starting epoch #%d at cost %f...\n", j, train_cost_batch(net, tset));	
+		// The network hasn't changed since the last pass
+		printf("Starting epoch #%d at cost %f...\n", j, eval_cost(eval));
 	
-		for (i = 0; i < tset->count/10; i++) {
-			sset = csv_subset(tset, 10);
+		allocs = mem_count();
 		
-			// Do the training
-			train_batch(net, sset, 0.3);	
-		}
+		// Every sample once, already gathered by the sampler thread
+		while (sampler_next(sampler, &in, &out))
+			train_step_block(trainer, in, out, 0.3);
 		
-		printf("End epoch #%d at cost %f (%d/%d correct)\n", j, train_cost_batch(net, tset), train_correct(net, tset), tset->count);
+		allocs = mem_count() - allocs;
+		
+		eval_run(eval, tset);
+		printf("End epoch #%d at cost %f (%ld/%d correct, %ld allocations)\n", j, eval_cost(eval), eval->correct, tset->count, allocs);
 	}
 	
+#ifdef PROF
+	// Where training time went, and the timeline of it
+	prof_report(stdout);
+	if (!prof_trace("trace.json"))
+		printf("Wrote timeline to trace.json\n");
+	prof_stop();
+#endif
+	
 	// Print out network
 	l = net->layer_head;
 	for (i = 0; i < net->depth; i++) {
@@ -55,4 +194,33 @@ int main()
 		matrix_print(l->bias);
 	}
 	
+	// Keep the trained network around
+	if (!net_save(net, "mnist.net"))
+		printf("Saved network to mnist.net\n");
+	
+	// Full breakdown of how the trained network does
+	eval_free(eval);
+	eval = eval_new(net, threads, EVAL_ALL, 3);
+	eval_run(eval, tset);
+	eval_print(eval);
+	correct = eval->correct;
+	
+	// See how much accuracy half width storage gives up
+	net_half(net, HALF_F16);
+	eval_run(eval, tset);
+	reduced = eval->correct;
+	printf("Stored as fp16 with %s kernels: %d/%d correct, %+d vs fp32\n", half_name(), reduced, tset->count, reduced - correct);
+	if (!net_save(net, "mnist_f16.net"))
+		printf("Saved half width network to mnist_f16.net\n");
+	
+	// And int8 inference, which takes over from half width
+	net_quantize(net);
+	eval_run(eval, tset);
+	reduced = eval->correct;
+	printf("Quantized to int8 with %s kernels: %d/%d correct, %+d vs fp32\n", quant_name(), reduced, tset->count, reduced - correct);
+	
+	eval_free(eval);
+	train_free(trainer);
+	sampler_free(sampler);
+	csv_batch_free_all(tset);
 }
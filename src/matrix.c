@@ -5,9 +5,12 @@
  */
 
 #include "inc/matrix.h"
+#include "inc/mem.h"
+#include "inc/gemm.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /*
  * Performs the dot product of matrix A and matrix B into matrix C
@@ -19,24 +22,48 @@
  */
 void matrix_mul(matrix_t *a, matrix_t *b, matrix_t *c)
 {
-	int x,y,z;
-	float tmp;
-	
 	// Checks to see if rows and columns line up
 	if (a->width != b->height) printf("Argument mismatch!\n");
 	if (c->width != b->width || c->height != a->height) printf("Return mismatch!\n");
 	
-	for (y = 0; y < c->height; y++) {
-		for (x = 0; x < c->width; x++) {
-			// Calculate sum of products for this position in the matrix
-			tmp = 0;
-			for (z = 0; z < a->width; z++) {
-				tmp += a->values[y][z] * b->values[z][x];
-			}
-			
-			c->values[y][x] = tmp;
-		}
-	}
+	// Hand it off to the blocked kernels
+	gemm(GEMM_N, GEMM_N, c->height, c->width, a->width, a->data, a->stride, b->data, b->stride, c->data, c->stride);
+}
+
+/*
+ * Performs the dot product of transposed matrix A and matrix B into matrix C
+ * A is read in place, no transposed copy is made
+ * No error checking is performed, caller should already know the bounds of A^T*B=C
+ *
+ * a = Pointer to matrix A
+ * b = Pointer to matrix B
+ * c = Pointer to matrix C
+ */
+void matrix_mul_tn(matrix_t *a, matrix_t *b, matrix_t *c)
+{
+	// Checks to see if rows and columns line up
+	if (a->height != b->height) printf("Argument mismatch!\n");
+	if (c->width != b->width || c->height != a->width) printf("Return mismatch!\n");
+	
+	gemm(GEMM_T, GEMM_N, c->height, c->width, a->height, a->data, a->stride, b->data, b->stride, c->data, c->stride);
+}
+
+/*
+ * Performs the dot product of matrix A and transposed matrix B into matrix C
+ * B is read in place, no transposed copy is made
+ * No error checking is performed, caller should already know the bounds of A*B^T=C
+ *
+ * a = Pointer to matrix A
+ * b = Pointer to matrix B
+ * c = Pointer to matrix C
+ */
+void matrix_mul_nt(matrix_t *a, matrix_t *b, matrix_t *c)
+{
+	// Checks to see if rows and columns line up
+	if (a->width != b->width) printf("Argument mismatch!\n");
+	if (c->width != b->height || c->height != a->height) printf("Return mismatch!\n");
+	
+	gemm(GEMM_N, GEMM_T, c->height, c->width, a->width, a->data, a->stride, b->data, b->stride, c->data, c->stride);
 }
 
 /*
@@ -79,12 +106,16 @@ matrix_t *matrix_nmul(matrix_t *a, matrix_t *b)
 void matrix_add(matrix_t *a, matrix_t *b, matrix_t *c)
 {
 	int x,y;
+	float *ra, *rb, *rc;
 	
 	for (y = 0; y < c->height; y++) {
-		for (x = 0; x < c->width; x++) {
-			// Calculate sum for this position in the matrix
-			c->values[y][x] = a->values[y][x] + b->values[y][x];
-		}
+		ra = a->data + y * a->stride;
+		rb = b->data + y * b->stride;
+		rc = c->data + y * c->stride;
+		
+		// Calculate sum for this row of the matrix
+		for (x = 0; x < c->width; x++)
+			rc[x] = ra[x] + rb[x];
 	}
 }
 
@@ -126,13 +157,17 @@ matrix_t *matrix_nadd(matrix_t *a, matrix_t *b)
  */
 void matrix_sub(matrix_t *a, matrix_t *b, matrix_t *c)
 {
-	int x,y; 
+	int x,y;
+	float *ra, *rb, *rc;
 	
 	for (y = 0; y < c->height; y++) {
-		for (x = 0; x < c->width; x++) {
-			// Calculate minuend for this position in the matrix
-			c->values[y][x] = a->values[y][x] - b->values[y][x];
-		}
+		ra = a->data + y * a->stride;
+		rb = b->data + y * b->stride;
+		rc = c->data + y * c->stride;
+		
+		// Calculate minuend for this row of the matrix
+		for (x = 0; x < c->width; x++)
+			rc[x] = ra[x] - rb[x];
 	}
 }
 
@@ -174,12 +209,15 @@ matrix_t *matrix_nsub(matrix_t *a, matrix_t *b)
 void matrix_trans(matrix_t *a, matrix_t *b)
 {
 	int x,y;
+	float *ra;
 	
 	// Just shift the data around
-	for (y = 0; y < a->height; y++)
+	for (y = 0; y < a->height; y++) {
+		ra = a->data + y * a->stride;
 		for (x = 0; x < a->width; x++)
-			b->values[x][y] = a->values[y][x];
-	
+			b->data[x * b->stride + y] = ra[x];
+	}
+
 }
 
 /*
@@ -217,12 +255,16 @@ matrix_t *matrix_ntrans(matrix_t *a)
 void matrix_prod(matrix_t *a, matrix_t *b, matrix_t *c)
 {
 	int x,y;
+	float *ra, *rb, *rc;
 	
 	// Multiply 'em
-	for (y = 0; y < a->height; y++)
+	for (y = 0; y < a->height; y++) {
+		ra = a->data + y * a->stride;
+		rb = b->data + y * b->stride;
+		rc = c->data + y * c->stride;
 		for (x = 0; x < a->width; x++)
-			c->values[y][x] = a->values[y][x] * b->values[y][x];
-			
+			rc[x] = ra[x] * rb[x];
+	}
 }
 
 /*
@@ -246,14 +288,70 @@ matrix_t *matrix_nprod(matrix_t *a, matrix_t *b)
 	if (a->width != b->width || a->height != b->height) return NULL;
 	
 	// Create new matrix and produce
-	c = matrix_new(a->height, a->width);
+	c = matrix_new(a->width, a->height);
 	matrix_prod(a, b, c);
 	
 	return c;
 	
 }
+
+/*
+ * Sets every value in a matrix to zero
+ *
+ * m = Pointer to matrix struct
+ */
+void matrix_zero(matrix_t *m)
+{
+	memset(m->data, 0, sizeof(float) * m->stride * m->height);
+}
+
+/*
+ * Calculates the row stride for a matrix of a given width
+ * Wide rows are padded out so every row starts on an aligned boundary,
+ * narrow ones (column vectors and such) are packed back to back
+ *
+ * width = Width of matrix
+ *
+ * Returns row stride in floats
+ */
+static int matrix_stride(int width)
+{
+	int line;
+	
+	line = MATRIX_ALIGN / sizeof(float);
+	if (width < line) return width;
+	
+	return (width + line - 1) / line * line;
+}
+
+/*
+ * Allocates the value block and row pointers for a matrix struct
+ * Width, height and stride must already be set
+ *
+ * m = Pointer to matrix struct
+ */
+static void matrix_alloc(matrix_t *m)
+{
+	int i;
+	size_t size;
+	
+	// Allocate one block for all of the values
+	// mem_align() wants the size to be a multiple of the alignment
+	size = sizeof(float) * m->stride * m->height;
+	size = (size + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+	if (!size) size = MATRIX_ALIGN;
+	m->data = (float *) mem_align(MATRIX_ALIGN, size);
+	memset(m->data, 0, size);
+	
+	// Set up row pointers into the block
+	m->values = (float **) mem_alloc(sizeof(float *) * (m->height ? m->height : 1));
+	for (i = 0; i < m->height; i++)
+		m->values[i] = m->data + i * m->stride;
+}
+
 /*
  * Allocates memory for a new matrix struct
+ * Values are stored in a single aligned block, and are zeroed out
  *
  * width = Width of new matrix
  * height = Height of new matrix
@@ -262,40 +360,78 @@ matrix_t *matrix_nprod(matrix_t *a, matrix_t *b)
  */
 matrix_t *matrix_new(int width, int height)
 {
-	int i;
 	matrix_t *new;
 	
 	// Alloc and setup new struct
-	new = (matrix_t *) malloc(sizeof(matrix_t));
+	new = (matrix_t *) mem_alloc(sizeof(matrix_t));
 	new->width = width;
 	new->height = height;
+	new->stride = matrix_stride(width);
 	
-	// Allocate memory for values
-	new->values = (float **) malloc(sizeof(float *) * height);
-	for (i = 0; i < height; i++)
-		new->values[i] = (float *) malloc(sizeof(float) * width);
+	matrix_alloc(new);
 	
 	return new;
 }
 
 /*
- * Frees the utilized memory of an existing matrix struct
+ * Sets up a matrix struct over values that live somewhere else
+ * Nothing is allocated and the values are not touched, so view matricies
+ * must never be passed to matrix_resize() or matrix_free()
+ * Views have no row pointers, values is NULL
+ *
+ * m = Pointer to matrix struct to fill in
+ * data = Pointer to first value
+ * width = Width of matrix
+ * height = Height of matrix
+ * stride = Distance between rows, in floats
+ */
+void matrix_view(matrix_t *m, float *data, int width, int height, int stride)
+{
+	m->width = width;
+	m->height = height;
+	m->stride = stride;
+	m->data = data;
+	m->values = NULL;
+}
+
+/*
+ * Changes the width of an existing matrix
+ * Memory is only reallocated if the new width does not fit in the row stride,
+ * in which case the values are zeroed out
  *
  * m = Pointer to matrix struct
+ * width = New width of matrix
  */
-void matrix_free(matrix_t *m)
+void matrix_resize(matrix_t *m, int width)
 {
-	int i;
+	// Already fits, nothing else to do
+	if (width <= m->stride) {
+		m->width = width;
+		return;
+	}
 	
-	//Free rows of matrix
-	for (i = 0; i < m->height; i++)
-		free(m->values[i]);
+	// Free old block and get a new one
+	mem_free(m->values);
+	mem_free(m->data);
 	
-	//Free matrix itself
-	free(m->values);
+	m->width = width;
+	m->stride = matrix_stride(width);
+	matrix_alloc(m);
+}
+
+/*
+ * Frees the utilized memory of an existing matrix struct
+ *
+ * m = Pointer to matrix struct
+ */
+void matrix_free(matrix_t *m)
+{
+	//Free row pointers and data block
+	mem_free(m->values);
+	mem_free(m->data);
 	
 	//Free struct
-	free(m);
+	mem_free(m);
 }
 
 /*
@@ -315,7 +451,7 @@ void matrix_print(matrix_t *m)
 	for (y = 0; y < m->height; y++) {
 		printf("[");
 		for (x = 0; x < m->width; x++) {
-			printf("%.2f", m->values[y][x]);
+			printf("%.2f", m->data[y * m->stride + x]);
 			if (x != m->width-1) printf(",	");
 		}
 		printf("]\n");
@@ -0,0 +1,63 @@
+/*
+ * mem.c
+ *
+ * Heap allocation wrappers
+ *
+ * Everything in PunyML allocates through here, so the number of
+ * allocations made by any stretch of code can be checked with mem_count()
+ */
+
+#include "inc/mem.h"
+
+#include <stdlib.h>
+
+/* Globals */
+// Number of allocations made so far
+static long mem_allocs = 0;
+
+/*
+ * Allocates a block of memory
+ *
+ * size = Size of block in bytes
+ *
+ * Returns pointer to block
+ */
+void *mem_alloc(size_t size)
+{
+	__atomic_fetch_add(&mem_allocs, 1, __ATOMIC_RELAXED);
+	
+	return malloc(size);
+}
+
+/*
+ * Allocates an aligned block of memory
+ *
+ * align = Alignment in bytes, must be a power of two
+ * size = Size of block in bytes, must be a multiple of align
+ *
+ * Returns pointer to block
+ */
+void *mem_align(size_t align, size_t size)
+{
+	__atomic_fetch_add(&mem_allocs, 1, __ATOMIC_RELAXED);
+	
+	return aligned_alloc(align, size);
+}
+
+/*
+ * Frees a block from mem_alloc() or mem_align()
+ *
+ * p = Pointer to block
+ */
+void mem_free(void *p)
+{
+	free(p);
+}
+
+/*
+ * Returns the number of allocations made since startup
+ */
+long mem_count()
+{
+	return __atomic_load_n(&mem_allocs, __ATOMIC_RELAXED);
+}
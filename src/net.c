@@ -5,9 +5,15 @@
  */
  
 #include "inc/net.h"
+#include "inc/mem.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
  * Feeds a set of inputs into the network, and returns the result
@@ -18,13 +24,31 @@
  * Returns pointer to output matrix (do not try to free)
  */
 matrix_t *net_execute(network_t *net, matrix_t *in)
+{
+	// Make sure input matrix matches bounds
+	// I know, actual sanity checking!
+	if (in->width != 1 || in->height != net->isize) return NULL;
+	
+	return net_execute_batch(net, in);
+}
+
+/*
+ * Feeds a whole batch of inputs into the network, and returns the results
+ * Every layer is run as one matrix-matrix product over the batch, so the
+ * weights are only streamed through once
+ *
+ * net = Network to execute
+ * in = Input block, one sample per column (isize x samples)
+ *
+ * Returns pointer to output block, osize x samples (do not try to free)
+ */
+matrix_t *net_execute_batch(network_t *net, matrix_t *in)
 {
 	layer_t *curr_layer;
 	matrix_t *result;
 	
 	// Make sure input matrix matches bounds
-	// I know, actual sanity checking!
-	if (in->width != 1 || in->height != net->isize) return NULL;
+	if (in->width < 1 || in->height != net->isize) return NULL;
 	
 	// If the network has no layers, just return the input matrix
 	if (!net->layer_head) return in;
@@ -48,34 +72,153 @@ matrix_t *net_execute(network_t *net, matrix_t *in)
 	return result;
 }
 
-void net_add_layer(network_t *net, int size, actf_t act, actf_t der, initf_t init)
+/*
+ * Feeds a block of inputs through the network using caller supplied buffers
+ * Nothing in the network is modified, so multiple threads can run the same
+ * network at once as long as they each have their own buffers
+ *
+ * net = Network to execute
+ * in = Input block, one sample per column (isize x samples)
+ * z = Intermediate matrix for every layer, resized to fit
+ * result = Result matrix for every layer, resized to fit
+ *
+ * Returns pointer to output block, osize x samples
+ */
+matrix_t *net_forward(network_t *net, matrix_t *in, matrix_t **z, matrix_t **result)
 {
-	layer_t *new;
+	layer_t *l;
+	matrix_t *prev;
+	int i;
 	
-	// Make sure network actually exists
-	if (!net) return;
+	// Make sure input matrix matches bounds
+	if (in->width < 1 || in->height != net->isize) return NULL;
 	
-	// Create new layer
-	// Input size is the size of the last output
-	// Output size is the defined size
-	new = layer_new(net->osize, size, act, der);
+	// Run through every layer in order
+	prev = in;
+	for (l = net->layer_head, i = 0; l; l = l->next, i++) {
+		layer_forward(l, prev, z[i], result[i]);
+		prev = result[i];
+	}
+	
+	return prev;
+}
+
+/*
+ * Creates an execution context for a network
+ * Buffers are sized up front, so running up to batch samples at a time
+ * never allocates
+ *
+ * net = Network the context will run
+ * batch = Largest number of samples run at once
+ *
+ * Returns pointer to new context struct
+ */
+net_ctx_t *net_ctx_new(network_t *net, int batch)
+{
+	net_ctx_t *new;
+	layer_t *l;
+	int i;
+	
+	if (batch < 1) batch = 1;
 	
+	new = (net_ctx_t *) mem_alloc(sizeof(net_ctx_t));
+	new->net = net;
+	new->batch = batch;
+	new->depth = net->depth;
+	
+	new->z = (matrix_t **) mem_alloc(sizeof(matrix_t *) * (net->depth ? net->depth : 1));
+	new->result = (matrix_t **) mem_alloc(sizeof(matrix_t *) * (net->depth ? net->depth : 1));
+	for (l = net->layer_head, i = 0; l; l = l->next, i++) {
+		new->z[i] = matrix_new(batch, l->osize);
+		new->result[i] = matrix_new(batch, l->osize);
+	}
+	
+	return new;
+}
+
+/*
+ * Feeds a block of inputs through the network of a context
+ * Safe to call from many threads at once, each with its own context
+ *
+ * ctx = Execution context
+ * in = Input block, one sample per column (isize x samples)
+ *
+ * Returns pointer to output block, osize x samples, owned by the context
+ * and good until the next call, NULL if the input doesn't fit the network
+ */
+matrix_t *net_run(net_ctx_t *ctx, matrix_t *in)
+{
+	// Layers added since the context was made have no buffers
+	if (ctx->depth != ctx->net->depth) return NULL;
+	if (in->width < 1 || in->height != ctx->net->isize) return NULL;
+	
+	return net_forward(ctx->net, in, ctx->z, ctx->result);
+}
+
+/*
+ * Frees an execution context
+ *
+ * ctx = Execution context
+ */
+void net_ctx_free(net_ctx_t *ctx)
+{
+	int i;
+	
+	for (i = 0; i < ctx->depth; i++) {
+		matrix_free(ctx->z[i]);
+		matrix_free(ctx->result[i]);
+	}
+	mem_free(ctx->z);
+	mem_free(ctx->result);
+	mem_free(ctx);
+}
+
+/*
+ * Appends a layer to the end of a network
+ * The layer's input size must match the network's output size
+ *
+ * net = Network struct
+ * l = Layer to append
+ */
+static void net_append(network_t *net, layer_t *l)
+{
 	// Update depth and net output size
+	l->index = net->depth;
 	net->depth++;
-	net->osize = size;
+	net->osize = l->osize;
 	
 	// Now append the layer onto the doubly linked list
 	if (!net->layer_head)
-		net->layer_head = new;
+		net->layer_head = l;
 	
 	if (!net->layer_tail)
-		net->layer_tail = new;
+		net->layer_tail = l;
 	else {
-		new->prev = net->layer_tail;
-		net->layer_tail->next = new;
-		net->layer_tail = new;
+		l->prev = net->layer_tail;
+		net->layer_tail->next = l;
+		net->layer_tail = l;
+	}
+}
+
+void net_add_layer(network_t *net, int size, int act, initf_t init)
+{
+	layer_t *new;
+	
+	// Make sure network actually exists
+	if (!net) return;
+	
+	// Softmax only has a derivative as the output layer, through the cost
+	if (net->layer_tail && net->layer_tail->act->id == ACTIVE_SOFTMAX) {
+		printf("Softmax is only allowed on the output layer!\n");
+		return;
 	}
 	
+	// Create new layer
+	// Input size is the size of the last output
+	// Output size is the defined size
+	new = layer_new(net->osize, size, act);
+	net_append(net, new);
+	
 	// Finally, init the new layer
 	layer_init(new, init);
 }
@@ -92,7 +235,7 @@ network_t *net_new(int size)
 	network_t *new;
 	
 	// Allocate memory for new struct
-	new = (network_t *) malloc(sizeof(network_t));
+	new = (network_t *) mem_alloc(sizeof(network_t));
 	
 	// Set input and output size
 	// This will be the same as the network has no layers
@@ -104,9 +247,310 @@ network_t *net_new(int size)
 	new->layer_head = NULL;
 	new->layer_tail = NULL;
 	
+	new->map = NULL;
+	new->map_size = 0;
+	new->readonly = 0;
+	new->quant = 0;
+	new->half = 0;
+	
 	return new;
 }
 
+/*
+ * Writes zeros to a file until the position is aligned
+ *
+ * f = File to write to
+ * pos = Current position in the file, updated
+ */
+static void net_pad(FILE *f, long long *pos)
+{
+	static const char zero[NET_ALIGN];
+	int n;
+	
+	n = (NET_ALIGN - *pos % NET_ALIGN) % NET_ALIGN;
+	fwrite(zero, 1, n, f);
+	*pos += n;
+}
+
+/*
+ * Saves a network to a checkpoint file
+ *
+ * net = Network struct
+ * path = Path of the file to create
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int net_save(network_t *net, char *path)
+{
+	FILE *f;
+	net_header_t h;
+	net_record_t *recs;
+	layer_t *l;
+	long long pos;
+	size_t size;
+	int i, y;
+	
+	f = fopen(path, "wb");
+	if (!f) {
+		printf("Failed to create file %s!\n", path);
+		return -1;
+	}
+	
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, NET_MAGIC, 4);
+	h.version = NET_VERSION;
+	h.isize = net->isize;
+	h.depth = net->depth;
+	
+	// Lay out the blobs after the layer table
+	recs = (net_record_t *) mem_alloc(sizeof(net_record_t) * (net->depth ? net->depth : 1));
+	memset(recs, 0, sizeof(net_record_t) * net->depth);
+	pos = sizeof(h) + sizeof(net_record_t) * net->depth;
+	for (l = net->layer_head, i = 0; l; l = l->next, i++) {
+		// Half width layers are stored the way they are held
+		recs[i].isize = l->isize;
+		recs[i].osize = l->osize;
+		recs[i].act = l->act->id;
+		recs[i].dtype = l->half ? l->half->type : NET_F32;
+		recs[i].stride = l->half ? l->half->stride : l->weight->stride;
+		size = l->half ? sizeof(unsigned short) : sizeof(float);
+		
+		pos = (pos + NET_ALIGN - 1) / NET_ALIGN * NET_ALIGN;
+		recs[i].weight = pos;
+		pos += size * (long long) recs[i].stride * l->osize;
+		
+		pos = (pos + NET_ALIGN - 1) / NET_ALIGN * NET_ALIGN;
+		recs[i].bias = pos;
+		pos += size * l->osize;
+	}
+	
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(recs, sizeof(net_record_t), net->depth, f);
+	pos = sizeof(h) + sizeof(net_record_t) * net->depth;
+	
+	// Weights go out in their in memory layout, bias as one run
+	for (l = net->layer_head; l; l = l->next) {
+		if (l->half) {
+			net_pad(f, &pos);
+			fwrite(l->half->weight, sizeof(unsigned short) * l->half->stride, l->osize, f);
+			pos += sizeof(unsigned short) * (long long) l->half->stride * l->osize;
+			
+			net_pad(f, &pos);
+			fwrite(l->half->bias, sizeof(unsigned short), l->osize, f);
+			pos += sizeof(unsigned short) * l->osize;
+			continue;
+		}
+		
+		net_pad(f, &pos);
+		fwrite(l->weight->data, sizeof(float) * l->weight->stride, l->osize, f);
+		pos += sizeof(float) * (long long) l->weight->stride * l->osize;
+		
+		net_pad(f, &pos);
+		for (y = 0; y < l->osize; y++)
+			fwrite(l->bias->data + y * l->bias->stride, sizeof(float), 1, f);
+		pos += sizeof(float) * l->osize;
+	}
+	
+	mem_free(recs);
+	
+	if (fclose(f)) {
+		printf("Failed to write file %s!\n", path);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Checks that the layer table of a checkpoint is valid
+ *
+ * h = Pointer to header
+ * recs = Pointer to layer table
+ * size = Size of the whole file in bytes
+ *
+ * Returns 0 if the file is valid, -1 if not
+ */
+static int net_check(net_header_t *h, net_record_t *recs, size_t size)
+{
+	int i, isize;
+	net_record_t *r;
+	size_t vsize;
+	
+	isize = h->isize;
+	for (i = 0; i < h->depth; i++) {
+		r = &recs[i];
+		
+		// Layers have to chain together
+		if (r->isize != isize || r->osize <= 0 || r->stride < r->isize || !active_get(r->act))
+			return -1;
+		if (r->act == ACTIVE_SOFTMAX && i != h->depth - 1)
+			return -1;
+		
+		// Half width rows are padded out for the kernels
+		if (r->dtype == NET_F32)
+			vsize = sizeof(float);
+		else if ((r->dtype == NET_F16 || r->dtype == NET_BF16) && !(r->stride % HALF_ALIGN))
+			vsize = sizeof(unsigned short);
+		else
+			return -1;
+		
+		// Blobs have to be aligned and inside the file
+		if (r->weight % NET_ALIGN || r->bias % NET_ALIGN || r->weight < 0 || r->bias < 0)
+			return -1;
+		if (r->weight + vsize * (long long) r->stride * r->osize > size || r->bias + vsize * r->osize > size)
+			return -1;
+		
+		isize = r->osize;
+	}
+	
+	return 0;
+}
+
+/*
+ * Loads a network from a checkpoint file
+ * With NET_LOAD_MAP, layer weights point straight into a private mapping
+ * of the file, so loading costs nothing but setting up the layers and
+ * pages are only read in as they are used. Training a mapped network
+ * works, but changed pages are copied and never written back.
+ *
+ * NET_LOAD_SHARED maps the file read-only and shared instead, so every
+ * process serving the same checkpoint uses the same pages out of the
+ * page cache, and only holds its own activation scratch. The network is
+ * marked read-only and can't be trained.
+ *
+ * Inference on half width layers runs on the half width values, in place
+ * when mapped. Copies are widened to fp32 up front for quantizing, mapped
+ * layers only once they are quantized or converted, so processes sharing
+ * a half width checkpoint don't each hold an fp32 copy.
+ *
+ * path = Path of a file written by net_save()
+ * mode = NET_LOAD_COPY, NET_LOAD_MAP or NET_LOAD_SHARED
+ *
+ * Returns new network struct, NULL on failure
+ */
+network_t *net_load(char *path, int mode)
+{
+	int fd, i, y;
+	struct stat st;
+	char *map;
+	net_header_t *h;
+	net_record_t *recs, *r;
+	network_t *net;
+	layer_t *l;
+	half_t *half;
+	float *w, *b;
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("Failed to open file %s!\n", path);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	
+	if (st.st_size < sizeof(net_header_t)) {
+		printf("File too small to be a checkpoint!\n");
+		close(fd);
+		return NULL;
+	}
+	
+	// The mapping keeps the file around, so the descriptor can go
+	if (mode == NET_LOAD_SHARED)
+		map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	else
+		map = (char *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Failed to map file!\n");
+		return NULL;
+	}
+	
+	// Sanity check everything before trusting any of it
+	h = (net_header_t *) map;
+	recs = (net_record_t *) (map + sizeof(net_header_t));
+	if (memcmp(h->magic, NET_MAGIC, 4) || h->version != NET_VERSION || h->isize <= 0 || h->depth < 0 ||
+		sizeof(net_header_t) + sizeof(net_record_t) * (size_t) h->depth > st.st_size || net_check(h, recs, st.st_size)) {
+		printf("Not a valid checkpoint file!\n");
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	
+	net = net_new(h->isize);
+	
+	for (i = 0; i < h->depth; i++) {
+		r = &recs[i];
+		w = (float *) (map + r->weight);
+		b = (float *) (map + r->bias);
+		
+		if (r->dtype != NET_F32 && mode != NET_LOAD_COPY) {
+			// Inference runs on the mapped values in place, fp32 is only widened if quantized
+			l = layer_new_view(r->isize, r->osize, r->act, NULL, r->isize, NULL);
+			l->half = half_new_view(r->dtype, r->osize, r->isize, r->stride, (unsigned short *) w, (unsigned short *) b);
+			net->half = r->dtype;
+		} else if (r->dtype != NET_F32) {
+			// Widened fp32 weights are only for quantizing, converting back is exact
+			l = layer_new(r->isize, r->osize, r->act);
+			half = half_new_view(r->dtype, r->osize, r->isize, r->stride, (unsigned short *) w, (unsigned short *) b);
+			half_widen(half, l->weight, l->bias);
+			half_free(half);
+			l->half = half_new(r->dtype, l->weight, l->bias);
+			net->half = r->dtype;
+		} else if (mode != NET_LOAD_COPY) {
+			l = layer_new_view(r->isize, r->osize, r->act, w, r->stride, b);
+		} else {
+			l = layer_new(r->isize, r->osize, r->act);
+			for (y = 0; y < r->osize; y++) {
+				memcpy(l->weight->data + y * l->weight->stride, w + (size_t) y * r->stride, sizeof(float) * r->isize);
+				l->bias->data[y * l->bias->stride] = b[y];
+			}
+		}
+		
+		net_append(net, l);
+	}
+	
+	if (mode != NET_LOAD_COPY) {
+		net->map = map;
+		net->map_size = st.st_size;
+		net->readonly = (mode == NET_LOAD_SHARED);
+	} else {
+		munmap(map, st.st_size);
+	}
+	
+	return net;
+}
+
+/*
+ * Quantizes every layer of a network to int8 for inference
+ * Training is done by then, the fp32 weights stay around for saving
+ *
+ * net = Network to quantize
+ */
+void net_quantize(network_t *net)
+{
+	layer_t *l;
+	
+	for (l = net->layer_head; l; l = l->next)
+		layer_quantize(l);
+	
+	net->quant = 1;
+}
+
+/*
+ * Stores every layer of a network at half width for inference
+ * Training is done by then, the fp32 weights stay around for quantizing
+ *
+ * net = Network to convert
+ * type = HALF_F16 or HALF_BF16, 0 to go back to fp32
+ */
+void net_half(network_t *net, int type)
+{
+	layer_t *l;
+	
+	for (l = net->layer_head; l; l = l->next)
+		layer_half(l, type);
+	
+	net->half = type;
+}
+
 /*
  * Frees network struct and all attached layers
  *
@@ -124,6 +568,9 @@ void net_free(network_t *n)
 		curr_layer = next_layer;
 	}
 	
+	// Layers were pointing into this
+	if (n->map) munmap(n->map, n->map_size);
+	
 	// Free struct
-	free(n);
+	mem_free(n);
 }
\ No newline at end of file
@@ -0,0 +1,195 @@
+/*
+ * optim.c
+ *
+ * Optimizer update kernels
+ *
+ * Each optimizer has its own loop, so the choice is made once per row and
+ * the loops themselves are branch free and vectorize.
+ */
+
+#include "inc/optim.h"
+
+#include <math.h>
+
+/* Defines */
+// Update kernels are compiled for every supported vector width,
+// the loader picks the widest one the CPU can run
+#if defined(__x86_64__) && defined(__GNUC__)
+#define OPTIM_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define OPTIM_CLONES
+#endif
+
+// State decaying below this is flushed to zero, denormals are very slow
+#define OPTIM_TINY 1e-30F
+
+/*
+ * Fills in the default settings of an optimizer
+ *
+ * o = Optimizer struct to fill
+ * type = Optimizer type (OPTIM_*)
+ *
+ * Returns 0 on success, -1 for an unknown type
+ */
+int optim_default(optim_t *o, int type)
+{
+	if (type < OPTIM_SGD || type > OPTIM_ADAMW) return -1;
+	
+	o->type = type;
+	o->mu = OPTIM_MU;
+	o->beta2 = OPTIM_BETA2;
+	o->eps = OPTIM_EPS;
+	o->decay = (type == OPTIM_ADAMW ? OPTIM_DECAY : 0);
+	
+	o->t = 0;
+	o->rate = 0;
+	o->scale = 0;
+	o->step = 0;
+	o->c1 = 0;
+	o->c2 = 0;
+	
+	return 0;
+}
+
+/*
+ * Counts the state buffers an optimizer keeps for every weight
+ *
+ * o = Optimizer settings
+ *
+ * Returns 0, 1 or 2
+ */
+int optim_states(optim_t *o)
+{
+	switch (o->type) {
+	case OPTIM_MOMENTUM:
+	case OPTIM_NESTEROV:
+		return 1;
+	case OPTIM_ADAM:
+	case OPTIM_ADAMW:
+		return 2;
+	}
+	
+	return 0;
+}
+
+/*
+ * Returns the name of an optimizer
+ *
+ * o = Optimizer settings
+ */
+char *optim_name(optim_t *o)
+{
+	switch (o->type) {
+	case OPTIM_MOMENTUM:
+		return "momentum";
+	case OPTIM_NESTEROV:
+		return "nesterov";
+	case OPTIM_ADAM:
+		return "adam";
+	case OPTIM_ADAMW:
+		return "adamw";
+	}
+	
+	return "sgd";
+}
+
+/*
+ * Starts a new step, working out the values every update of it shares
+ *
+ * o = Optimizer settings
+ * rate = Learning rate
+ * count = Number of samples the gradients were summed over
+ */
+void optim_begin(optim_t *o, float rate, int count)
+{
+	o->t++;
+	o->rate = rate;
+	o->scale = 1.0F / count;
+	o->step = rate / ((float) count);
+	
+	// Adam's moments start at zero, so early steps are scaled back up
+	if (o->type == OPTIM_ADAM || o->type == OPTIM_ADAMW) {
+		o->c1 = rate / (1 - powf(o->mu, o->t));
+		o->c2 = 1 / sqrtf(1 - powf(o->beta2, o->t));
+	}
+}
+
+/*
+ * Plain gradient descent, the step is rate over the batch size
+ */
+OPTIM_CLONES
+static void optim_sgd(float *w, float *g, int n, float step)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		w[i] -= step * g[i];
+}
+
+/*
+ * Gradient descent with momentum, or Nesterov momentum which steps from
+ * where the velocity is about to take the weights
+ */
+OPTIM_CLONES
+static void optim_momentum(float *w, float *g, float *m, int n, float rate, float scale, float mu, int nesterov)
+{
+	float d;
+	int i;
+	
+	for (i = 0; i < n; i++) {
+		d = g[i] * scale;
+		m[i] = mu * m[i] + d;
+		m[i] = (fabsf(m[i]) < OPTIM_TINY ? 0 : m[i]);
+		
+		// Nesterov steps along the gradient plus the new velocity
+		w[i] -= rate * (nesterov ? d + mu * m[i] : m[i]);
+	}
+}
+
+/*
+ * Adam, with AdamW's weight decay applied to the weights directly
+ */
+OPTIM_CLONES
+static void optim_adam(float *w, float *g, float *m, float *v, int n, optim_t o)
+{
+	float d, keep;
+	int i;
+	
+	keep = 1 - o.rate * o.decay;
+	
+	for (i = 0; i < n; i++) {
+		d = g[i] * o.scale;
+		m[i] = o.mu * m[i] + (1 - o.mu) * d;
+		v[i] = o.beta2 * v[i] + (1 - o.beta2) * d * d;
+		m[i] = (fabsf(m[i]) < OPTIM_TINY ? 0 : m[i]);
+		v[i] = (v[i] < OPTIM_TINY ? 0 : v[i]);
+		w[i] = w[i] * keep - o.c1 * m[i] / (sqrtf(v[i]) * o.c2 + o.eps);
+	}
+}
+
+/*
+ * Updates a run of weights from their summed gradients and state
+ *
+ * o = Optimizer, with the current step started by optim_begin()
+ * w = Weights
+ * g = Gradients summed over the batch
+ * m = First state buffer (velocity or first moment), unused for SGD
+ * v = Second state buffer (second moment), only used by Adam
+ * n = Number of weights
+ */
+void optim_update(optim_t *o, float *w, float *g, float *m, float *v, int n)
+{
+	switch (o->type) {
+	case OPTIM_MOMENTUM:
+	case OPTIM_NESTEROV:
+		optim_momentum(w, g, m, n, o->rate, o->scale, o->mu, o->type == OPTIM_NESTEROV);
+		break;
+	case OPTIM_ADAM:
+	case OPTIM_ADAMW:
+		optim_adam(w, g, m, v, n, *o);
+		break;
+	default:
+		optim_sgd(w, g, n, o->step);
+		break;
+	}
+}
@@ -0,0 +1,151 @@
+/*
+ * pool.c
+ *
+ * Persistent worker threads for splitting up work
+ */
+
+#include "inc/pool.h"
+#include "inc/mem.h"
+
+#include <stdlib.h>
+
+/*
+ * Main loop of a pool thread
+ * Waits for a job to be posted, runs it, then goes back to sleep
+ *
+ * arg = Pointer to pool thread struct
+ */
+static void *pool_loop(void *arg)
+{
+	pool_thread_t *t;
+	pool_t *p;
+	int gen;
+	
+	t = (pool_thread_t *) arg;
+	p = t->pool;
+	
+	// Threads are started before any jobs are posted
+	gen = 0;
+	
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		// Wait for something new to do
+		while (p->gen == gen && !p->quit)
+			pthread_cond_wait(&p->start, &p->lock);
+		
+		if (p->quit) break;
+		gen = p->gen;
+		pthread_mutex_unlock(&p->lock);
+		
+		// Do our part of the job
+		p->func(p->arg, t->id, p->count);
+		
+		// Let the caller know if we were the last one
+		pthread_mutex_lock(&p->lock);
+		if (!--p->busy)
+			pthread_cond_signal(&p->done);
+	}
+	
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/*
+ * Runs a job on every thread of the pool, and waits for all of them to finish
+ * The calling thread takes part as thread 0
+ *
+ * p = Pointer to pool struct
+ * func = Job function
+ * arg = Argument passed to the job function
+ */
+void pool_run(pool_t *p, poolf_t func, void *arg)
+{
+	// No pool threads, so just do it here
+	if (p->count == 1) {
+		func(arg, 0, 1);
+		return;
+	}
+	
+	// Post the job and wake everyone up
+	pthread_mutex_lock(&p->lock);
+	p->func = func;
+	p->arg = arg;
+	p->busy = p->count - 1;
+	p->gen++;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+	
+	// Do our own part
+	func(arg, 0, p->count);
+	
+	// Wait for the stragglers
+	pthread_mutex_lock(&p->lock);
+	while (p->busy)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Creates a new pool and starts up its threads
+ *
+ * count = Number of threads, including the caller
+ *
+ * Returns pointer to new pool struct
+ */
+pool_t *pool_new(int count)
+{
+	pool_t *new;
+	int i;
+	
+	if (count < 1) count = 1;
+	
+	// Alloc and setup new struct
+	new = (pool_t *) mem_alloc(sizeof(pool_t));
+	new->count = count;
+	new->gen = 0;
+	new->busy = 0;
+	new->quit = 0;
+	new->func = NULL;
+	new->arg = NULL;
+	
+	pthread_mutex_init(&new->lock, NULL);
+	pthread_cond_init(&new->start, NULL);
+	pthread_cond_init(&new->done, NULL);
+	
+	// Start up everything but thread 0
+	new->threads = (pool_thread_t *) mem_alloc(sizeof(pool_thread_t) * count);
+	for (i = 1; i < count; i++) {
+		new->threads[i].pool = new;
+		new->threads[i].id = i;
+		pthread_create(&new->threads[i].thread, NULL, pool_loop, &new->threads[i]);
+	}
+	
+	return new;
+}
+
+/*
+ * Stops all of the threads in a pool and frees it
+ *
+ * p = Pointer to pool struct
+ */
+void pool_free(pool_t *p)
+{
+	int i;
+	
+	// Tell everyone to quit
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+	
+	for (i = 1; i < p->count; i++)
+		pthread_join(p->threads[i].thread, NULL);
+	
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->done);
+	
+	// Free struct
+	mem_free(p->threads);
+	mem_free(p);
+}
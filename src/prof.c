@@ -0,0 +1,200 @@
+/*
+ * prof.c
+ *
+ * Hot path profiling, totals by phase and layer plus a timeline
+ *
+ * Totals are kept with relaxed atomics, so any thread can close a span
+ * without taking a lock. Timeline slots are handed out the same way.
+ */
+
+#include "inc/prof.h"
+#include "inc/mem.h"
+#include "inc/timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Globals */
+// Names of the phases, for the table and the timeline
+static const char *prof_names[PROF_PHASES] = {
+	"forward", "bp1", "bp2", "bp3", "bp4", "update", "gather"
+};
+
+// Totals of every phase of every layer, slot 0 is for spans without a layer
+static prof_stat_t prof_stats[PROF_PHASES][PROF_LAYERS + 1];
+
+// Timeline, with the number of slots handed out so far
+static prof_event_t *prof_events = NULL;
+static int prof_cap = 0;
+static long long prof_count = 0;
+
+// Time everything is measured from
+static long long prof_epoch = 0;
+
+// Number of threads seen, and the number of the current one
+static int prof_threads = 0;
+static __thread int prof_tid = -1;
+
+/*
+ * Clears the totals and starts a new timeline
+ * Should be called while nothing is being profiled
+ *
+ * events = Spans to keep for the timeline, 0 for PROF_EVENTS
+ */
+void prof_start(int events)
+{
+	if (events <= 0) events = PROF_EVENTS;
+	
+	// Only grow the timeline
+	if (events > prof_cap) {
+		mem_free(prof_events);
+		prof_events = (prof_event_t *) mem_alloc(sizeof(prof_event_t) * events);
+		prof_cap = prof_events ? events : 0;
+	}
+	
+	memset(prof_stats, 0, sizeof(prof_stats));
+	prof_count = 0;
+	prof_epoch = timer_now();
+}
+
+/*
+ * Opens a span
+ *
+ * span = Span to open
+ */
+void prof_begin(prof_span_t *span)
+{
+	span->allocs = mem_count();
+	span->start = timer_now();
+}
+
+/*
+ * Closes a span, adding it to the totals and the timeline
+ * Allocations are counted over the whole process, so with other threads
+ * running they are only a rough guide
+ *
+ * span = Span opened with prof_begin()
+ * phase = Phase the span belongs to (PROF_*)
+ * layer = Layer number, -1 if not tied to a layer
+ * flops = Floating point operations done
+ * bytes = Bytes read and written
+ */
+void prof_end(prof_span_t *span, int phase, int layer, double flops, double bytes)
+{
+	prof_stat_t *s;
+	prof_event_t *e;
+	long long end, ns, i;
+	long allocs;
+	
+	end = timer_now();
+	allocs = mem_count() - span->allocs;
+	ns = end - span->start;
+	
+	if (layer >= PROF_LAYERS) layer = PROF_LAYERS - 1;
+	s = &prof_stats[phase][layer + 1];
+	
+	__atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->flops, (long long) flops, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->bytes, (long long) bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->allocs, allocs, __ATOMIC_RELAXED);
+	
+	// Number threads as they show up, so the timeline has one row each
+	if (prof_tid < 0)
+		prof_tid = __atomic_fetch_add(&prof_threads, 1, __ATOMIC_RELAXED);
+	
+	// Spans past the end of the timeline are still in the totals
+	i = __atomic_fetch_add(&prof_count, 1, __ATOMIC_RELAXED);
+	if (i >= prof_cap) return;
+	
+	e = &prof_events[i];
+	e->start = span->start - prof_epoch;
+	e->ns = ns;
+	e->flops = (long long) flops;
+	e->phase = phase;
+	e->layer = layer;
+	e->tid = prof_tid;
+}
+
+/*
+ * Prints the totals as a table, one row for every phase of every layer
+ * Time is summed over threads, so it can add up to more than wall time
+ *
+ * f = File to print to
+ */
+void prof_report(FILE *f)
+{
+	prof_stat_t *s;
+	long long total;
+	double sec;
+	int p, l;
+	
+	total = 0;
+	for (p = 0; p < PROF_PHASES; p++)
+		for (l = 0; l <= PROF_LAYERS; l++)
+			total += prof_stats[p][l].ns;
+	
+	fprintf(f, "%-8s %5s %10s %10s %6s %10s %8s %8s %8s\n", "phase", "layer", "calls", "total ms", "%", "avg us", "GFLOP/s", "GB/s", "allocs");
+	for (p = 0; p < PROF_PHASES; p++) {
+		for (l = 0; l <= PROF_LAYERS; l++) {
+			s = &prof_stats[p][l];
+			if (!s->calls) continue;
+			
+			sec = s->ns * 1e-9;
+			if (l) fprintf(f, "%-8s %5d", prof_names[p], l - 1);
+			else fprintf(f, "%-8s %5s", prof_names[p], "-");
+			fprintf(f, " %10lld %10.3f %6.2f %10.3f %8.2f %8.2f %8lld\n", s->calls, sec * 1e3,
+				total ? 100.0 * s->ns / total : 0, sec * 1e6 / s->calls,
+				sec > 0 ? s->flops / sec * 1e-9 : 0, sec > 0 ? s->bytes / sec * 1e-9 : 0, s->allocs);
+		}
+	}
+	fprintf(f, "%-8s %5s %10s %10.3f\n", "total", "", "", total * 1e-6);
+	
+	if (prof_count > prof_cap)
+		fprintf(f, "Timeline is missing %lld of %lld spans\n", prof_count - prof_cap, prof_count);
+}
+
+/*
+ * Writes the timeline as Chrome trace_event JSON
+ *
+ * path = Path of the file to write
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int prof_trace(char *path)
+{
+	FILE *f;
+	prof_event_t *e;
+	int i, n;
+	
+	f = fopen(path, "w");
+	if (!f) {
+		printf("Failed to open %s for writing!\n", path);
+		return -1;
+	}
+	
+	// Complete events, with times in microseconds
+	n = prof_count < prof_cap ? prof_count : prof_cap;
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	for (i = 0; i < n; i++) {
+		e = &prof_events[i];
+		fprintf(f, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+			"\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %d, \"flops\": %lld}}%s\n",
+			prof_names[e->phase], e->layer < 0 ? "data" : "layer", e->tid,
+			e->start * 1e-3, e->ns * 1e-3, e->layer, e->flops, i + 1 < n ? "," : "");
+	}
+	fprintf(f, "]}\n");
+	
+	if (fclose(f)) return -1;
+	return 0;
+}
+
+/*
+ * Frees the timeline, totals are kept until the next prof_start()
+ */
+void prof_stop()
+{
+	mem_free(prof_events);
+	prof_events = NULL;
+	prof_cap = 0;
+}
@@ -0,0 +1,437 @@
+/*
+ * quant.c
+ *
+ * Int8 inference for dense layers
+ *
+ * Weights are quantized once, symmetrically per row. Inputs are quantized
+ * per sample every call, and packed so every sample's values sit back to
+ * back like the weight rows. The kernels then compute a QUANT_MR row by 2
+ * sample tile of int32 dot products, which is scaled back to fp32, biased
+ * and written out as z right away. The activation runs over each tile's rows
+ * while they are still in cache.
+ */
+
+#include "inc/quant.h"
+#include "inc/mem.h"
+
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANT_X86
+#endif
+
+/* Types and structs */
+// Micro-kernel, dot products of QUANT_MR weight rows with two samples
+// c is filled row by row, two sums per row
+typedef void (*quant_ukr_t)(int k, unsigned char *a0, unsigned char *a1, signed char *w, int ldw, int *c);
+
+// Kernel for an instruction set
+typedef struct quant_kern {
+	char *name;
+	quant_ukr_t ukr;
+	int (*supported)();	// Returns true if the CPU can run the kernel
+} quant_kern_t;
+
+/* Globals */
+// Quantized inputs, with the scale and zero point of every sample and
+// room to turn them around, one set per thread
+static __thread unsigned char *quant_buf = NULL;
+static __thread size_t quant_size = 0;
+
+// Currently selected kernel
+static quant_kern_t *quant_kern = NULL;
+
+/*
+ * Portable micro-kernel
+ *
+ * k = Length of rows, a multiple of 64
+ * a0 = Quantized inputs of the first sample
+ * a1 = Quantized inputs of the second sample
+ * w = First of QUANT_MR weight rows
+ * ldw = Row stride of w
+ * c = Sums, QUANT_MR rows of 2
+ */
+static void quant_ukr_c(int k, unsigned char *a0, unsigned char *a1, signed char *w, int ldw, int *c)
+{
+	int r, p, s0, s1;
+	
+	for (r = 0; r < QUANT_MR; r++, w += ldw) {
+		s0 = s1 = 0;
+		for (p = 0; p < k; p++) {
+			s0 += a0[p] * w[p];
+			s1 += a1[p] * w[p];
+		}
+		
+		c[r * 2] = s0;
+		c[r * 2 + 1] = s1;
+	}
+}
+
+/*
+ * Portable kernel runs anywhere
+ */
+static int quant_supported_c()
+{
+	return 1;
+}
+
+#ifdef QUANT_X86
+
+/*
+ * Sums up all of the lanes in an AVX integer register
+ *
+ * v = Register to sum
+ *
+ * Returns sum of lanes
+ */
+__attribute__((target("avx2")))
+static inline int quant_hsum_avx2(__m256i v)
+{
+	__m128i x;
+	
+	x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+	
+	return _mm_cvtsi128_si32(x);
+}
+
+/*
+ * AVX2 micro-kernel
+ * Byte products are summed in pairs to 16 bits, which can't saturate with
+ * inputs of at most QUANT_MAX, then widened to 32 bits
+ *
+ * k = Length of rows, a multiple of 64
+ * a0 = Quantized inputs of the first sample
+ * a1 = Quantized inputs of the second sample
+ * w = First of QUANT_MR weight rows
+ * ldw = Row stride of w
+ * c = Sums, QUANT_MR rows of 2
+ */
+__attribute__((target("avx2")))
+static void quant_ukr_avx2(int k, unsigned char *a0, unsigned char *a1, signed char *w, int ldw, int *c)
+{
+	__m256i acc[QUANT_MR * 2], x0, x1, wr, ones;
+	int r, p;
+	
+	ones = _mm256_set1_epi16(1);
+	for (r = 0; r < QUANT_MR * 2; r++)
+		acc[r] = _mm256_setzero_si256();
+	
+	for (p = 0; p < k; p += 32) {
+		x0 = _mm256_load_si256((__m256i *) (a0 + p));
+		x1 = _mm256_load_si256((__m256i *) (a1 + p));
+		
+		for (r = 0; r < QUANT_MR; r++) {
+			wr = _mm256_load_si256((__m256i *) (w + r * ldw + p));
+			acc[r * 2] = _mm256_add_epi32(acc[r * 2], _mm256_madd_epi16(_mm256_maddubs_epi16(x0, wr), ones));
+			acc[r * 2 + 1] = _mm256_add_epi32(acc[r * 2 + 1], _mm256_madd_epi16(_mm256_maddubs_epi16(x1, wr), ones));
+		}
+	}
+	
+	for (r = 0; r < QUANT_MR * 2; r++)
+		c[r] = quant_hsum_avx2(acc[r]);
+}
+
+/*
+ * AVX2 kernel needs AVX2
+ */
+static int quant_supported_avx2()
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * AVX-512 VNNI micro-kernel
+ * Every instruction sums groups of four byte products straight into 32 bits
+ *
+ * k = Length of rows, a multiple of 64
+ * a0 = Quantized inputs of the first sample
+ * a1 = Quantized inputs of the second sample
+ * w = First of QUANT_MR weight rows
+ * ldw = Row stride of w
+ * c = Sums, QUANT_MR rows of 2
+ */
+__attribute__((target("avx512f,avx512vnni")))
+static void quant_ukr_vnni(int k, unsigned char *a0, unsigned char *a1, signed char *w, int ldw, int *c)
+{
+	__m512i acc[QUANT_MR * 2], x0, x1, wr;
+	int r, p;
+	
+	for (r = 0; r < QUANT_MR * 2; r++)
+		acc[r] = _mm512_setzero_si512();
+	
+	for (p = 0; p < k; p += 64) {
+		x0 = _mm512_load_si512(a0 + p);
+		x1 = _mm512_load_si512(a1 + p);
+		
+		for (r = 0; r < QUANT_MR; r++) {
+			wr = _mm512_load_si512(w + r * ldw + p);
+			acc[r * 2] = _mm512_dpbusd_epi32(acc[r * 2], x0, wr);
+			acc[r * 2 + 1] = _mm512_dpbusd_epi32(acc[r * 2 + 1], x1, wr);
+		}
+	}
+	
+	for (r = 0; r < QUANT_MR * 2; r++)
+		c[r] = _mm512_reduce_add_epi32(acc[r]);
+}
+
+/*
+ * VNNI kernel needs AVX-512 VNNI
+ */
+static int quant_supported_vnni()
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vnni");
+}
+
+#endif
+
+/*
+ * Kernels, in order of preference
+ */
+static quant_kern_t quant_kerns[] = {
+#ifdef QUANT_X86
+	{"vnni", quant_ukr_vnni, quant_supported_vnni},
+	{"avx2", quant_ukr_avx2, quant_supported_avx2},
+#endif
+	{"scalar", quant_ukr_c, quant_supported_c}
+};
+
+#define QUANT_KERNS (sizeof(quant_kerns) / sizeof(quant_kern_t))
+
+/*
+ * Picks the best kernel that the CPU supports
+ * Called automatically on first use, but can be called at startup instead
+ */
+void quant_init()
+{
+	int i;
+	
+	for (i = 0; i < QUANT_KERNS; i++) {
+		if (quant_kerns[i].supported()) {
+			quant_kern = &quant_kerns[i];
+			return;
+		}
+	}
+}
+
+/*
+ * Forces a specific kernel to be used
+ *
+ * name = Name of kernel ("vnni", "avx2", "scalar")
+ *
+ * Returns 0 on success, -1 if the kernel does not exist or is not supported
+ */
+int quant_select(char *name)
+{
+	int i;
+	
+	for (i = 0; i < QUANT_KERNS; i++) {
+		if (!strcmp(quant_kerns[i].name, name)) {
+			if (!quant_kerns[i].supported()) return -1;
+			quant_kern = &quant_kerns[i];
+			return 0;
+		}
+	}
+	
+	return -1;
+}
+
+/*
+ * Returns the name of the selected kernel
+ */
+char *quant_name()
+{
+	if (!quant_kern) quant_init();
+	
+	return quant_kern->name;
+}
+
+/*
+ * Quantizes a weight matrix, one scale per row
+ *
+ * weight = Weights to quantize (outputs x inputs)
+ *
+ * Returns pointer to new quant struct
+ */
+quant_t *quant_new(matrix_t *weight)
+{
+	quant_t *new;
+	float *row, max, inv;
+	int rows, r, i, sum;
+	size_t size;
+	
+	new = (quant_t *) mem_alloc(sizeof(quant_t));
+	new->rows = weight->height;
+	new->cols = weight->width;
+	new->stride = (weight->width + 63) / 64 * 64;
+	if (!new->stride) new->stride = 64;
+	
+	// Padding rows and columns stay zero, so the kernels never need edge cases
+	rows = (weight->height + QUANT_MR - 1) / QUANT_MR * QUANT_MR;
+	size = (size_t) rows * new->stride;
+	new->weight = (signed char *) mem_align(64, size);
+	memset(new->weight, 0, size);
+	new->scale = (float *) mem_alloc(sizeof(float) * rows);
+	new->sum = (int *) mem_alloc(sizeof(int) * rows);
+	
+	for (r = 0; r < rows; r++) {
+		new->scale[r] = 0;
+		new->sum[r] = 0;
+		if (r >= weight->height) continue;
+		
+		// Largest weight of the row maps to 127
+		row = weight->data + (size_t) r * weight->stride;
+		max = 0;
+		for (i = 0; i < weight->width; i++)
+			if (fabsf(row[i]) > max) max = fabsf(row[i]);
+		
+		inv = max > 0 ? 127.0F / max : 0;
+		sum = 0;
+		for (i = 0; i < weight->width; i++) {
+			new->weight[(size_t) r * new->stride + i] = (signed char) lrintf(row[i] * inv);
+			sum += new->weight[(size_t) r * new->stride + i];
+		}
+		
+		new->scale[r] = max / 127.0F;
+		new->sum[r] = sum;
+	}
+	
+	return new;
+}
+
+/*
+ * Quantizes every sample of a block of inputs
+ * Each sample gets a scale and zero point covering its own range, which
+ * always includes zero so zero stays exact
+ *
+ * q = Quantized weights the inputs are for
+ * prev = Inputs (cols x samples)
+ * a = Quantized samples, stride bytes each
+ * scale = Scale of every sample
+ * zero = Zero point of every sample
+ * t = Scratch for the samples as fp32, cols floats each
+ */
+static void quant_inputs(quant_t *q, matrix_t *prev, unsigned char *a, float *scale, int *zero, float *t)
+{
+	float *row, *lo, *hi, *src, v, min, inv;
+	unsigned char *dst;
+	int i, j, n;
+	
+	n = prev->width;
+	
+	// Range of every sample, the scale and zero point arrays hold it for now
+	lo = scale;
+	hi = (float *) zero;
+	for (j = 0; j < n; j++)
+		lo[j] = hi[j] = 0;
+	
+	// Samples are columns, so turn them into rows on the same pass
+	for (i = 0; i < q->cols; i++) {
+		row = prev->data + (size_t) i * prev->stride;
+		for (j = 0; j < n; j++) {
+			t[(size_t) j * q->cols + i] = row[j];
+			lo[j] = row[j] < lo[j] ? row[j] : lo[j];
+			hi[j] = row[j] > hi[j] ? row[j] : hi[j];
+		}
+	}
+	
+	for (j = 0; j < n; j++) {
+		// Read the range out before its slots are overwritten
+		min = lo[j];
+		v = hi[j] - min;
+		scale[j] = v > 0 ? v / QUANT_MAX : 1;
+		zero[j] = (int) lrintf(-min / scale[j]);
+		
+		// Store samples back to back, to line up with the weight rows
+		inv = 1.0F / scale[j];
+		src = t + (size_t) j * q->cols;
+		dst = a + (size_t) j * q->stride;
+		for (i = 0; i < q->cols; i++) {
+			v = src[i] * inv + zero[j] + 0.5F;
+			v = v < 0 ? 0 : (v > QUANT_MAX ? QUANT_MAX : v);
+			dst[i] = (unsigned char) v;
+		}
+		
+		// Padding has to be zero as well
+		memset(dst + q->cols, 0, q->stride - q->cols);
+	}
+}
+
+/*
+ * Runs a quantized layer
+ * Sums are scaled back to fp32 and biased as soon as each tile is done,
+ * and the activation runs over the tile's rows right after
+ *
+ * q = Quantized weights
+ * bias = One value per row, NULL for none
+ * incb = Stride between bias values
+ * act = Array activation kernel
+ * prev = Inputs (cols x samples)
+ * z = Intermediate (rows x samples), already sized to fit
+ * result = Result (rows x samples), already sized to fit
+ */
+void quant_forward(quant_t *q, float *bias, int incb, void (*act)(float *in, float *out, int n), matrix_t *prev, matrix_t *z, matrix_t *result)
+{
+	unsigned char *a;
+	float *scale, *zr, *res, b;
+	int *zero, c[QUANT_MR * 2];
+	int n, r, rr, j, jj, j1;
+	size_t size;
+	
+	if (!quant_kern) quant_init();
+	
+	// Scratch for the quantized inputs only grows
+	n = prev->width;
+	size = (size_t) n * q->stride + sizeof(float) * n + sizeof(int) * n + sizeof(float) * n * q->cols;
+	if (size > quant_size) {
+		mem_free(quant_buf);
+		quant_size = (size + 63) / 64 * 64;
+		quant_buf = (unsigned char *) mem_align(64, quant_size);
+	}
+	a = quant_buf;
+	scale = (float *) (a + (size_t) n * q->stride);
+	zero = (int *) (scale + n);
+	
+	quant_inputs(q, prev, a, scale, zero, (float *) (zero + n));
+	
+	for (r = 0; r < q->rows; r += QUANT_MR) {
+		for (j = 0; j < n; j += 2) {
+			// An odd last sample is paired with itself
+			j1 = j + 1 < n ? j + 1 : j;
+			quant_kern->ukr(q->stride, a + (size_t) j * q->stride, a + (size_t) j1 * q->stride,
+				q->weight + (size_t) r * q->stride, q->stride, c);
+			
+			// Take the zero points back out and scale back to fp32
+			for (rr = 0; rr < QUANT_MR && r + rr < q->rows; rr++) {
+				b = bias ? bias[(r + rr) * incb] : 0;
+				for (jj = 0; jj < 2 && j + jj < n; jj++)
+					z->data[(size_t) (r + rr) * z->stride + j + jj] = q->scale[r + rr] * scale[j + jj] *
+						(float) (c[rr * 2 + jj] - zero[j + jj] * q->sum[r + rr]) + b;
+			}
+		}
+		
+		// Views have no row pointers, so go through data and stride
+		for (rr = 0; rr < QUANT_MR && r + rr < q->rows; rr++) {
+			zr = z->data + (size_t) (r + rr) * z->stride;
+			res = result->data + (size_t) (r + rr) * result->stride;
+			if (act) act(zr, res, n);
+			else memcpy(res, zr, sizeof(float) * n);
+		}
+	}
+}
+
+/*
+ * Frees a quant struct
+ *
+ * q = Pointer to quant struct
+ */
+void quant_free(quant_t *q)
+{
+	mem_free(q->weight);
+	mem_free(q->scale);
+	mem_free(q->sum);
+	mem_free(q);
+}
@@ -0,0 +1,203 @@
+/*
+ * sampler.c
+ *
+ * Shuffled mini-batches, gathered ahead of time
+ *
+ * Every epoch is a Fisher-Yates permutation of the source, so each sample
+ * is seen exactly once. A background thread gathers the next mini-batch
+ * into a contiguous block while the current one trains, so neither the
+ * gather nor any allocation sits on the training path.
+ */
+
+#include "inc/sampler.h"
+#include "inc/mem.h"
+#include "inc/prof.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Shuffles the sample order for a new epoch
+ *
+ * s = Pointer to sampler struct
+ */
+static void sampler_shuffle(sampler_t *s)
+{
+	sample_t *tmp;
+	int i, j;
+	
+	for (i = s->source->count - 1; i > 0; i--) {
+		j = dist_below(&s->rng, i + 1);
+		tmp = s->order[i];
+		s->order[i] = s->order[j];
+		s->order[j] = tmp;
+	}
+	
+	s->pos = 0;
+}
+
+/*
+ * Main loop of the prefetch thread
+ * Fills empty slots in turn, with an empty block after the last
+ * mini-batch of every epoch
+ *
+ * arg = Pointer to sampler struct
+ */
+static void *sampler_loop(void *arg)
+{
+	sampler_t *s;
+	batch_t run;
+	int slot, n;
+	char quit;
+	
+	s = (sampler_t *) arg;
+	memset(&run, 0, sizeof(run));
+	
+	for (slot = 0; ; slot = (slot + 1) % SAMPLER_SLOTS) {
+		// Wait for the trainer to give the slot back
+		pthread_mutex_lock(&s->lock);
+		while (s->state[slot] != SAMPLER_EMPTY && !s->quit)
+			pthread_cond_wait(&s->cond, &s->lock);
+		quit = s->quit;
+		pthread_mutex_unlock(&s->lock);
+		
+		if (quit) break;
+		
+		if (s->pos < s->source->count) {
+			// Next run of the order, gathered one sample per column
+			n = s->source->count - s->pos < s->batch ? s->source->count - s->pos : s->batch;
+			run.samples = s->order + s->pos;
+			run.count = n;
+			run.scale = s->source->scale;
+			
+			PROF_BEGIN(span);
+			csv_gather(&run, 0, n, s->in[slot], s->out[slot]);
+			PROF_END(span, PROF_GATHER, -1, 0, sizeof(float) * n * (s->in[slot]->height + s->out[slot]->height));
+			s->pos += n;
+		} else {
+			// Mark the end of the epoch and start on the next one
+			n = 0;
+			sampler_shuffle(s);
+		}
+		
+		pthread_mutex_lock(&s->lock);
+		s->count[slot] = n;
+		s->state[slot] = SAMPLER_FULL;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+	
+	return NULL;
+}
+
+/*
+ * Creates a new sampler and starts gathering the first epoch
+ * The source must outlive the sampler
+ *
+ * source = Batch to sample from
+ * batch = Samples per mini-batch
+ *
+ * Returns pointer to new sampler struct
+ */
+sampler_t *sampler_new(batch_t *source, int batch)
+{
+	sampler_t *new;
+	int i, isize, osize;
+	
+	if (batch < 1) batch = 1;
+	
+	new = (sampler_t *) mem_alloc(sizeof(sampler_t));
+	new->source = source;
+	new->batch = batch;
+	new->next = 0;
+	new->quit = 0;
+	
+	// Seed from the caller's generator, so dist_seed() still seeds everything
+	dist_rng_seed(&new->rng, dist_next(dist_rng()), 0);
+	
+	new->order = (sample_t **) mem_alloc(sizeof(sample_t *) * (source->count ? source->count : 1));
+	memcpy(new->order, source->samples, sizeof(sample_t *) * source->count);
+	sampler_shuffle(new);
+	
+	// Block sizes come from the first sample
+	isize = source->count ? source->samples[0]->input->height : 0;
+	osize = source->count ? source->samples[0]->output->height : 0;
+	for (i = 0; i < SAMPLER_SLOTS; i++) {
+		new->in[i] = matrix_new(batch, isize);
+		new->out[i] = matrix_new(batch, osize);
+		new->count[i] = 0;
+		new->state[i] = SAMPLER_EMPTY;
+	}
+	
+	pthread_mutex_init(&new->lock, NULL);
+	pthread_cond_init(&new->cond, NULL);
+	pthread_create(&new->thread, NULL, sampler_loop, new);
+	
+	return new;
+}
+
+/*
+ * Hands out the next mini-batch of the epoch
+ * The blocks stay valid until the next call, which gives them back
+ * to the prefetch thread
+ *
+ * s = Pointer to sampler struct
+ * in = Set to the gathered inputs (isize x samples)
+ * out = Set to the gathered outputs (osize x samples)
+ *
+ * Returns number of samples, 0 once the epoch is over, after which
+ * the next call starts a new epoch
+ */
+int sampler_next(sampler_t *s, matrix_t **in, matrix_t **out)
+{
+	int i, slot;
+	
+	pthread_mutex_lock(&s->lock);
+	
+	// Whatever we handed out last time is done with
+	for (i = 0; i < SAMPLER_SLOTS; i++) {
+		if (s->state[i] == SAMPLER_HELD) {
+			s->state[i] = SAMPLER_EMPTY;
+			pthread_cond_broadcast(&s->cond);
+		}
+	}
+	
+	slot = s->next;
+	while (s->state[slot] != SAMPLER_FULL)
+		pthread_cond_wait(&s->cond, &s->lock);
+	s->state[slot] = SAMPLER_HELD;
+	
+	pthread_mutex_unlock(&s->lock);
+	
+	s->next = (slot + 1) % SAMPLER_SLOTS;
+	*in = s->in[slot];
+	*out = s->out[slot];
+	
+	return s->count[slot];
+}
+
+/*
+ * Stops the prefetch thread and frees a sampler
+ *
+ * s = Pointer to sampler struct
+ */
+void sampler_free(sampler_t *s)
+{
+	int i;
+	
+	pthread_mutex_lock(&s->lock);
+	s->quit = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+	
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	
+	for (i = 0; i < SAMPLER_SLOTS; i++) {
+		matrix_free(s->in[i]);
+		matrix_free(s->out[i]);
+	}
+	mem_free(s->order);
+	mem_free(s);
+}
@@ -0,0 +1,652 @@
+/*
+ * serve.c
+ *
+ * Inference server with dynamic request batching
+ *
+ * Requests are single samples, one per line, with the input values
+ * separated by commas or spaces. Every line is queued on arrival, and a
+ * single batching thread runs whatever has queued up through the network
+ * as one block, either once there is a full batch or once the oldest
+ * request has waited out the latency budget. Replies go back one line per
+ * request, in the order the requests arrived on each connection, as the
+ * index of the largest output followed by every output value.
+ *
+ * A line reading "stats" is answered with the latency and throughput
+ * figures instead.
+ */
+
+#include "inc/serve.h"
+#include "inc/mem.h"
+#include "inc/timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Set by the signal handler to stop accepting connections
+static volatile sig_atomic_t serve_stopping = 0;
+
+/*
+ * Drops a reference to a connection, freeing it with the last one
+ * Must be called with the server lock held
+ *
+ * c = Pointer to connection struct
+ */
+static void serve_release(serve_conn_t *c)
+{
+	serve_t *s;
+	serve_conn_t **p;
+	
+	if (--c->refs) return;
+	
+	s = c->server;
+	for (p = &s->conns; *p != c; p = &(*p)->next);
+	*p = c->next;
+	
+	if (c->own) {
+		close(c->in);
+		if (c->out != c->in) close(c->out);
+	}
+	
+	mem_free(c);
+	pthread_cond_broadcast(&s->idle);
+}
+
+/*
+ * Writes out everything, retrying short writes
+ *
+ * fd = Descriptor to write to
+ * buf = Bytes to write
+ * len = Number of bytes
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int serve_write(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+	
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		
+		buf += n;
+		len -= n;
+	}
+	
+	return 0;
+}
+
+/*
+ * Sends the replies gathered so far to a connection
+ *
+ * s = Pointer to server struct
+ * c = Connection the replies belong to
+ * len = Bytes of replies
+ */
+static void serve_flush(serve_t *s, serve_conn_t *c, size_t len)
+{
+	if (!len || c->dead) return;
+	if (serve_write(c->out, s->reply, len)) c->dead = 1;
+}
+
+/*
+ * Compares two latencies for qsort
+ */
+static int serve_cmp(const void *a, const void *b)
+{
+	float x = *(const float *) a, y = *(const float *) b;
+	
+	return (x > y) - (x < y);
+}
+
+/*
+ * Formats the latency and throughput figures
+ * Only called from the batching thread, or once it has stopped
+ *
+ * s = Pointer to server struct
+ * buf = Where to put the text
+ * size = Size of buf
+ *
+ * Returns length of the text
+ */
+static int serve_stats(serve_t *s, char *buf, size_t size)
+{
+	int n;
+	float p50, p99, secs;
+	
+	// Percentiles over the most recent requests
+	n = s->served < SERVE_STATS ? s->served : SERVE_STATS;
+	memcpy(s->sorted, s->lat, sizeof(float) * n);
+	qsort(s->sorted, n, sizeof(float), serve_cmp);
+	p50 = n ? s->sorted[(n - 1) / 2] : 0;
+	p99 = n ? s->sorted[(int) ((n - 1) * 0.99F)] : 0;
+	
+	// Throughput from the first arrival to the last reply
+	secs = s->served ? (s->last - s->first) / 1e9F : 0;
+	
+	return snprintf(buf, size, "served=%ld batches=%ld avg_batch=%.2f p50=%.1fus p99=%.1fus throughput=%.1f/s",
+		s->served, s->batches, s->batches ? (float) s->served / s->batches : 0.0F, p50, p99,
+		secs > 0 ? s->served / secs : 0.0F);
+}
+
+/*
+ * Runs a batch of requests through the network and replies to each of them
+ *
+ * s = Pointer to server struct
+ * head = First request of the batch, linked through next
+ */
+static void serve_batch(serve_t *s, serve_req_t *head)
+{
+	serve_req_t *r;
+	serve_conn_t *c;
+	matrix_t *out;
+	size_t len, room;
+	long long now;
+	int n, i, col, best;
+	
+	// Gather the inputs into columns of one block
+	for (n = 0, r = head; r; r = r->next) {
+		if (r->kind != SERVE_INFER) continue;
+		
+		for (i = 0; i < s->net->isize; i++)
+			s->in->values[i][n] = r->input[i];
+		n++;
+	}
+	
+	// One forward pass for the whole lot
+	out = NULL;
+	if (n) {
+		matrix_resize(s->in, n);
+		out = net_run(s->ctx, s->in);
+		s->batches++;
+	}
+	
+	// Replies for consecutive requests of a connection go out in one write
+	room = SERVE_ROOM(s->net->osize);
+	len = 0;
+	c = NULL;
+	for (col = 0, r = head; r; r = r->next) {
+		if (r->conn != c || len + room > s->size) {
+			if (c) serve_flush(s, c, len);
+			c = r->conn;
+			len = 0;
+		}
+		
+		if (r->kind == SERVE_REPORT) {
+			len += serve_stats(s, s->reply + len, s->size - len);
+		} else if (r->kind == SERVE_ERROR) {
+			len += snprintf(s->reply + len, s->size - len, "error: expected %d input values", s->net->isize);
+		} else {
+			// Index of the largest output first, then every output
+			best = 0;
+			for (i = 1; i < s->net->osize; i++)
+				if (out->values[i][col] > out->values[best][col]) best = i;
+			
+			len += snprintf(s->reply + len, s->size - len, "%d", best);
+			for (i = 0; i < s->net->osize; i++)
+				len += snprintf(s->reply + len, s->size - len, ",%g", out->values[i][col]);
+			col++;
+		}
+		s->reply[len++] = '\n';
+	}
+	if (c) serve_flush(s, c, len);
+	
+	// Every request of the batch was answered just now
+	now = timer_now();
+	for (r = head; r; r = r->next) {
+		if (r->kind != SERVE_INFER) continue;
+		
+		if (!s->served) s->first = r->start;
+		s->lat[s->served++ % SERVE_STATS] = (now - r->start) / 1e3F;
+	}
+	s->last = now;
+}
+
+/*
+ * Main loop of the batching thread
+ * Waits for requests, holds them back until the batch is full or the
+ * oldest one is due, then runs them
+ *
+ * arg = Pointer to server struct
+ */
+static void *serve_loop(void *arg)
+{
+	serve_t *s;
+	serve_req_t *head, *r, *next;
+	struct timespec ts;
+	long long due;
+	int n;
+	
+	s = (serve_t *) arg;
+	
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!s->pending && !s->quit)
+			pthread_cond_wait(&s->cond, &s->lock);
+		
+		// Only quit once everything queued has been answered
+		if (!s->pending) break;
+		
+		// Wait for more requests, but no longer than the oldest one can
+		due = s->head->start + s->wait;
+		while (s->pending < s->batch && !s->quit && timer_now() < due) {
+			ts.tv_sec = due / 1000000000LL;
+			ts.tv_nsec = due % 1000000000LL;
+			pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+		}
+		
+		// Take up to a batch off the front of the queue
+		head = s->head;
+		for (n = 1, r = head; n < s->batch && r->next; n++)
+			r = r->next;
+		s->head = r->next;
+		if (!s->head) s->tail = NULL;
+		r->next = NULL;
+		s->pending -= n;
+		pthread_mutex_unlock(&s->lock);
+		
+		serve_batch(s, head);
+		
+		// Hand the requests back for reuse
+		pthread_mutex_lock(&s->lock);
+		for (r = head; r; r = next) {
+			next = r->next;
+			serve_release(r->conn);
+			
+			r->next = s->free;
+			s->free = r;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	
+	return NULL;
+}
+
+/*
+ * Parses a request line and queues it
+ *
+ * c = Connection the line arrived on
+ * line = Null terminated line, without the newline, NULL for one too long to read
+ */
+static void serve_queue(serve_conn_t *c, char *line)
+{
+	serve_t *s;
+	serve_req_t *r;
+	char *p, *end;
+	int i;
+	
+	s = c->server;
+	
+	// Blank lines are ignored
+	for (p = line; p && (*p == ' ' || *p == '\t' || *p == '\r'); p++);
+	if (p && !*p) return;
+	
+	pthread_mutex_lock(&s->lock);
+	r = s->free;
+	if (r) s->free = r->next;
+	pthread_mutex_unlock(&s->lock);
+	
+	// Request and its inputs share one allocation
+	if (!r) {
+		r = (serve_req_t *) mem_alloc(sizeof(serve_req_t) + sizeof(float) * s->net->isize);
+		r->input = (float *) (r + 1);
+	}
+	
+	if (!p) {
+		r->kind = SERVE_ERROR;
+	} else if (!strncmp(p, "stats", 5)) {
+		r->kind = SERVE_REPORT;
+	} else {
+		for (i = 0; i < s->net->isize; i++) {
+			r->input[i] = strtof(p, &end);
+			if (end == p) break;
+			
+			for (p = end; *p == ',' || *p == ' ' || *p == '\t' || *p == '\r'; p++);
+		}
+		
+		// Exactly isize values, and nothing after them
+		r->kind = (i < s->net->isize || *p) ? SERVE_ERROR : SERVE_INFER;
+	}
+	
+	r->conn = c;
+	r->start = timer_now();
+	r->next = NULL;
+	
+	pthread_mutex_lock(&s->lock);
+	if (s->tail) s->tail->next = r;
+	else s->head = r;
+	s->tail = r;
+	s->pending++;
+	c->refs++;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Creates a connection and adds it to the server
+ *
+ * s = Pointer to server struct
+ * in = Descriptor requests are read from
+ * out = Descriptor replies are written to
+ * own = Close the descriptors once the connection is done
+ *
+ * Returns pointer to new connection struct
+ */
+static serve_conn_t *serve_conn_new(serve_t *s, int in, int out, char own)
+{
+	serve_conn_t *c;
+	
+	c = (serve_conn_t *) mem_alloc(sizeof(serve_conn_t));
+	c->server = s;
+	c->in = in;
+	c->out = out;
+	c->own = own;
+	c->dead = 0;
+	
+	// The reader holds a reference until it hits the end
+	c->refs = 1;
+	
+	pthread_mutex_lock(&s->lock);
+	c->next = s->conns;
+	s->conns = c;
+	pthread_mutex_unlock(&s->lock);
+	
+	return c;
+}
+
+/*
+ * Reads requests off a connection until the end, queueing every line
+ * Replies may still be on their way when this returns
+ *
+ * c = Pointer to connection struct
+ */
+static void serve_read(serve_conn_t *c)
+{
+	serve_t *s;
+	char *buf, *line, *end;
+	size_t len;
+	ssize_t n;
+	char skip;
+	
+	s = c->server;
+	buf = (char *) mem_alloc(SERVE_LINE);
+	len = 0;
+	skip = 0;
+	
+	for (;;) {
+		n = read(c->in, buf + len, SERVE_LINE - len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		len += n;
+		
+		// Queue every complete line
+		line = buf;
+		while ((end = memchr(line, '\n', buf + len - line))) {
+			*end = 0;
+			if (!skip) serve_queue(c, line);
+			skip = 0;
+			line = end + 1;
+		}
+		
+		// Keep the start of the next line, unless it can never fit
+		len = buf + len - line;
+		if (len == SERVE_LINE) {
+			if (!skip) serve_queue(c, NULL);
+			skip = 1;
+			len = 0;
+		} else {
+			memmove(buf, line, len);
+		}
+	}
+	
+	// Last line doesn't need a newline
+	if (len && !skip) {
+		buf[len] = 0;
+		serve_queue(c, buf);
+	}
+	
+	mem_free(buf);
+	
+	pthread_mutex_lock(&s->lock);
+	serve_release(c);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Serves requests from one pair of descriptors until the end of input,
+ * for example stdin and stdout
+ *
+ * s = Pointer to server struct
+ * in = Descriptor requests are read from
+ * out = Descriptor replies are written to
+ */
+void serve_fd(serve_t *s, int in, int out)
+{
+	serve_read(serve_conn_new(s, in, out, 0));
+}
+
+/*
+ * Reader thread for a socket connection
+ *
+ * arg = Pointer to connection struct
+ */
+static void *serve_client(void *arg)
+{
+	serve_read((serve_conn_t *) arg);
+	return NULL;
+}
+
+/*
+ * Signal handler that stops the socket server
+ */
+static void serve_signal(int sig)
+{
+	serve_stopping = 1;
+}
+
+/*
+ * Serves requests on a unix domain socket until SIGINT or SIGTERM
+ * Every client gets its own reader thread, but all of them share the
+ * one batching thread, so requests from different clients batch together
+ *
+ * s = Pointer to server struct
+ * path = Path to create the socket at
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int serve_unix(serve_t *s, char *path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct pollfd pfd;
+	pthread_t thread;
+	serve_conn_t *c;
+	int fd, client;
+	
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long!\n");
+		return -1;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create socket!\n");
+		return -1;
+	}
+	
+	// Take over a socket left behind by an earlier run
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 64)) {
+		fprintf(stderr, "Failed to listen on %s!\n", path);
+		close(fd);
+		return -1;
+	}
+	
+	// Clients going away shouldn't take the server with them
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!serve_stopping) {
+		// Wake up now and then to notice a signal
+		if (poll(&pfd, 1, 100) <= 0) continue;
+		
+		client = accept(fd, NULL, NULL);
+		if (client < 0) continue;
+		
+		c = serve_conn_new(s, client, client, 1);
+		if (pthread_create(&thread, NULL, serve_client, c)) {
+			pthread_mutex_lock(&s->lock);
+			serve_release(c);
+			pthread_mutex_unlock(&s->lock);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	
+	close(fd);
+	unlink(path);
+	
+	// Stop every reader, then wait for their replies to go out
+	pthread_mutex_lock(&s->lock);
+	for (c = s->conns; c; c = c->next)
+		shutdown(c->in, SHUT_RD);
+	while (s->conns)
+		pthread_cond_wait(&s->idle, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+	
+	return 0;
+}
+
+/*
+ * Prints the latency and throughput figures
+ * The server must have been stopped first
+ *
+ * s = Pointer to server struct
+ * f = File to print to
+ */
+void serve_report(serve_t *s, FILE *f)
+{
+	char buf[256];
+	
+	serve_stats(s, buf, sizeof(buf));
+	fprintf(f, "%s\n", buf);
+}
+
+/*
+ * Creates a server and starts its batching thread
+ *
+ * net = Network to serve, it is never written to
+ * batch = Most requests run in one forward pass
+ * wait = Longest a request is held back for a fuller batch, microseconds
+ *
+ * Returns pointer to new server struct
+ */
+serve_t *serve_new(network_t *net, int batch, int wait)
+{
+	serve_t *new;
+	pthread_condattr_t attr;
+	
+	if (batch < 1) batch = 1;
+	if (wait < 0) wait = 0;
+	
+	new = (serve_t *) mem_alloc(sizeof(serve_t));
+	new->net = net;
+	new->batch = batch;
+	new->wait = wait * 1000LL;
+	
+	new->ctx = net_ctx_new(net, batch);
+	new->in = matrix_new(batch, net->isize);
+	// Room for a full write plus one more reply
+	new->size = SERVE_LINE + SERVE_ROOM(net->osize);
+	new->reply = (char *) mem_alloc(new->size);
+	
+	new->head = NULL;
+	new->tail = NULL;
+	new->free = NULL;
+	new->pending = 0;
+	new->conns = NULL;
+	new->quit = 0;
+	
+	new->lat = (float *) mem_alloc(sizeof(float) * SERVE_STATS);
+	new->sorted = (float *) mem_alloc(sizeof(float) * SERVE_STATS);
+	new->served = 0;
+	new->batches = 0;
+	new->first = 0;
+	new->last = 0;
+	
+	// Deadlines are on the monotonic clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&new->lock, NULL);
+	pthread_cond_init(&new->cond, &attr);
+	pthread_cond_init(&new->idle, NULL);
+	pthread_condattr_destroy(&attr);
+	
+	pthread_create(&new->thread, NULL, serve_loop, new);
+	
+	return new;
+}
+
+/*
+ * Stops the batching thread once every queued request has been answered
+ *
+ * s = Pointer to server struct
+ */
+void serve_stop(serve_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	if (s->quit) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	s->quit = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	
+	pthread_join(s->thread, NULL);
+}
+
+/*
+ * Frees a server, stopping it first if needed
+ * The network is left alone
+ *
+ * s = Pointer to server struct
+ */
+void serve_free(serve_t *s)
+{
+	serve_req_t *r, *next;
+	
+	serve_stop(s);
+	
+	for (r = s->free; r; r = next) {
+		next = r->next;
+		mem_free(r);
+	}
+	
+	net_ctx_free(s->ctx);
+	matrix_free(s->in);
+	mem_free(s->reply);
+	mem_free(s->lat);
+	mem_free(s->sorted);
+	
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	pthread_cond_destroy(&s->idle);
+	mem_free(s);
+}
@@ -0,0 +1,296 @@
+/*
+ * stream.c
+ *
+ * Streaming datasets that are too big to load into memory
+ *
+ * A stream holds a fixed window of records. Every call to stream_next()
+ * refills the same storage and hands back the same batch struct, so
+ * nothing is allocated once the stream is open.
+ */
+
+#include "inc/stream.h"
+#include "inc/mem.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Reads an exact number of bytes from a file
+ *
+ * fd = File descriptor
+ * buf = Where the bytes go
+ * len = Number of bytes
+ * off = Offset in the file
+ *
+ * Returns 0 on success, -1 on a short read or error
+ */
+static int stream_pread(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t r;
+	
+	while (len) {
+		r = pread(fd, buf, len, off);
+		if (r <= 0) return -1;
+		buf += r;
+		off += r;
+		len -= r;
+	}
+	
+	return 0;
+}
+
+/*
+ * Reads more of a csv file into the buffer
+ * Bytes not parsed yet are moved to the front, and the buffer is grown
+ * if a single record doesn't fit in it
+ *
+ * s = Pointer to stream struct
+ */
+static void stream_fill(stream_t *s)
+{
+	ssize_t r;
+	char *buf;
+	
+	// Keep the part of the record we already have
+	memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+	s->len -= s->pos;
+	s->pos = 0;
+	
+	if (s->len == s->size) {
+		buf = (char *) mem_alloc(s->size * 2);
+		memcpy(buf, s->buf, s->len);
+		mem_free(s->buf);
+		s->buf = buf;
+		s->size *= 2;
+	}
+	
+	r = read(s->fd, s->buf + s->len, s->size - s->len);
+	if (r <= 0)
+		s->eof = 1;
+	else
+		s->len += r;
+}
+
+/*
+ * Parses the next window of records out of a csv file
+ *
+ * s = Pointer to stream struct
+ *
+ * Returns number of records read
+ */
+static int stream_next_csv(stream_t *s)
+{
+	char *p, *eol;
+	int n, err;
+	
+	n = 0;
+	while (n < s->window) {
+		p = s->buf + s->pos;
+		eol = (char *) memchr(p, '\n', s->len - s->pos);
+		
+		if (!eol) {
+			if (!s->eof) {
+				stream_fill(s);
+				continue;
+			}
+			
+			// Last record might not have a newline
+			if (s->pos == s->len) break;
+			eol = s->buf + s->len;
+		}
+		
+		s->pos = (eol - s->buf) + 1;
+		if (s->pos > s->len) s->pos = s->len;
+		
+		// Empty lines are not records
+		if (eol == p) continue;
+		
+		err = csv_parse(p, eol, s->in + (size_t) n * s->isize, NULL, s->out + (size_t) n * s->osize, s->max, s->single, s->isize, s->osize);
+		if (err) {
+			printf("%s collumns for record %ld!\n", err == CSV_ERR_MANY ? "Too many" : "Not enough", s->record + n);
+			s->error = 1;
+			return 0;
+		}
+		
+		n++;
+	}
+	
+	return n;
+}
+
+/*
+ * Reads the next window of records out of a binary dataset file
+ *
+ * s = Pointer to stream struct
+ *
+ * Returns number of records read
+ */
+static int stream_next_bin(stream_t *s)
+{
+	bin_header_t *h;
+	unsigned char *rec;
+	float *in;
+	int i, y, n;
+	
+	h = &s->head;
+	n = h->count - s->record < s->window ? h->count - s->record : s->window;
+	if (n <= 0) return 0;
+	
+	if (stream_pread(s->fd, s->buf, (size_t) n * h->record, sizeof(bin_header_t) + (off_t) h->record * s->record)) {
+		printf("Failed to read record %ld!\n", s->record);
+		s->error = 1;
+		return 0;
+	}
+	
+	// Split each record into the window storage
+	for (i = 0; i < n; i++) {
+		rec = (unsigned char *) s->buf + (size_t) h->record * i;
+		in = s->in + (size_t) s->isize * i;
+		
+		memcpy(s->out + (size_t) s->osize * i, rec, sizeof(float) * s->osize);
+		rec += sizeof(float) * s->osize;
+		
+		if (h->dtype == BIN_U8) {
+			for (y = 0; y < s->isize; y++)
+				in[y] = rec[y] * h->scale;
+		} else {
+			memcpy(in, rec, sizeof(float) * s->isize);
+		}
+	}
+	
+	return n;
+}
+
+/*
+ * Opens a dataset file for streaming
+ * Binary dataset files are picked up by their header, and their sizes
+ * come from it, everything else is read as csv
+ *
+ * path = Path of a csv or binary dataset file
+ * window = Number of records to hold at once
+ * max = Maximum integer size (usually 256), csv only
+ * single = Singleton label mode, csv only
+ * isize = Input size, csv only
+ * osize = Output size, csv only
+ *
+ * Returns pointer to new stream struct, NULL on failure
+ */
+stream_t *stream_open(char *path, int window, int max, char single, int isize, int osize)
+{
+	stream_t *new;
+	struct stat st;
+	size_t size;
+	int fd;
+	
+	printf("Streaming from file %s\n", path);
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("Failed to open file!\n");
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	
+	new = (stream_t *) mem_alloc(sizeof(stream_t));
+	memset(new, 0, sizeof(stream_t));
+	new->fd = fd;
+	new->window = window < 1 ? 1 : window;
+	new->type = STREAM_CSV;
+	new->max = max;
+	new->single = single;
+	new->isize = isize;
+	new->osize = osize;
+	
+	// Binary files say how big they are
+	if (!stream_pread(fd, (char *) &new->head, sizeof(bin_header_t), 0) && !bin_check(&new->head, st.st_size)) {
+		new->type = STREAM_BIN;
+		new->isize = new->head.isize;
+		new->osize = new->head.osize;
+	}
+	
+	// Raw buffer holds a whole window of records, or a chunk of csv
+	new->size = (new->type == STREAM_BIN) ? (size_t) new->head.record * new->window : STREAM_READ;
+	new->buf = (char *) mem_alloc(new->size);
+	
+	// Window storage, inputs for every sample then outputs for every sample
+	size = sizeof(float) * ((size_t) new->isize + new->osize) * new->window;
+	size = (size + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+	new->in = (float *) mem_align(MATRIX_ALIGN, size);
+	new->out = new->in + (size_t) new->isize * new->window;
+	
+	new->batch = csv_batch_view(new->window, new->isize, new->osize, new->in, new->isize, new->out, new->osize);
+	new->batch->store = new->in;
+	
+	new->slots = (sample_t **) mem_alloc(sizeof(sample_t *) * new->window);
+	memcpy(new->slots, new->batch->samples, sizeof(sample_t *) * new->window);
+	
+	stream_rewind(new);
+	
+	return new;
+}
+
+/*
+ * Reads the next window of records
+ * The batch returned is the same every time, and is only good until the
+ * next call. Its samples may be reordered freely.
+ *
+ * s = Pointer to stream struct
+ *
+ * Returns batch holding the window, NULL at the end of the file or on error
+ */
+batch_t *stream_next(stream_t *s)
+{
+	int i, n;
+	
+	if (s->error) return NULL;
+	
+	n = (s->type == STREAM_BIN) ? stream_next_bin(s) : stream_next_csv(s);
+	if (!n) return NULL;
+	
+	// Undo any shuffling from the last window
+	memcpy(s->batch->samples, s->slots, sizeof(sample_t *) * n);
+	for (i = 0; i < n; i++)
+		s->batch->samples[i]->serial = s->record + i;
+	
+	s->batch->count = n;
+	s->record += n;
+	
+	return s->batch;
+}
+
+/*
+ * Goes back to the start of the file
+ *
+ * s = Pointer to stream struct
+ */
+void stream_rewind(stream_t *s)
+{
+	lseek(s->fd, 0, SEEK_SET);
+	
+	s->record = 0;
+	s->error = 0;
+	s->pos = 0;
+	s->len = 0;
+	s->eof = 0;
+}
+
+/*
+ * Closes a stream and frees everything it holds
+ *
+ * s = Pointer to stream struct
+ */
+void stream_close(stream_t *s)
+{
+	close(s->fd);
+	
+	// Frees the window storage too
+	s->batch->count = s->window;
+	csv_batch_free_all(s->batch);
+	
+	mem_free(s->slots);
+	mem_free(s->buf);
+	mem_free(s);
+}
@@ -0,0 +1,24 @@
+/*
+ * timer.c
+ *
+ * Monotonic time for profiling, benchmarks and request deadlines
+ */
+
+#include "inc/timer.h"
+
+#include <time.h>
+
+/*
+ * Gets the time from a clock that never jumps
+ * The clock is CLOCK_MONOTONIC, so values can be used as deadlines for
+ * condition variables set up with that clock
+ *
+ * Returns time in nanoseconds
+ */
+long long timer_now()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
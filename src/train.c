@@ -5,12 +5,20 @@
  */
 
 #include "inc/train.h"
+#include "inc/mem.h"
+#include "inc/prof.h"
+#include "inc/dist.h"
+#include "inc/eval.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
 
 /*
  * Calculates the cost value for a result and desired outcome
+ * If there are multiple samples (columns), their costs are summed up
  *
  * res = Result matrix
  * des = Desired outcome matrix
@@ -19,14 +27,46 @@
  */
 float train_cost(matrix_t *res, matrix_t *des)
 {
-	int i;
-	float tmp, cost;
+	int x, y;
+	float tmp, cost, *r, *d;
 	
 	// Summate the squared differences between result and desired outcome *phew*
 	cost = 0;
-	for (i = 0; i < res->height; i++) {
-		tmp = res->values[i][0] - des->values[i][0];
-		cost += tmp * tmp;
+	for (y = 0; y < res->height; y++) {
+		r = res->data + y * res->stride;
+		d = des->data + y * des->stride;
+		for (x = 0; x < res->width; x++) {
+			tmp = r[x] - d[x];
+			cost += tmp * tmp;
+		}
+	}
+	
+	return cost;
+}
+
+/*
+ * Calculates the cross-entropy cost of softmax results and desired outcome
+ * If there are multiple samples (columns), their costs are summed up
+ * Its derivative with respect to the softmax input is just res - des, so
+ * train_cost_d() covers both costs
+ *
+ * res = Result matrix, each column a softmax distribution
+ * des = Desired outcome matrix
+ *
+ * Returns cost value
+ */
+float train_cost_ce(matrix_t *res, matrix_t *des)
+{
+	int x, y;
+	float cost, *r, *d;
+	
+	// Only the hot outputs count, the rest multiply out to zero
+	cost = 0;
+	for (y = 0; y < res->height; y++) {
+		r = res->data + y * res->stride;
+		d = des->data + y * des->stride;
+		for (x = 0; x < res->width; x++)
+			if (d[x] > 0) cost -= d[x] * logf(r[x] > FLT_MIN ? r[x] : FLT_MIN);
 	}
 	
 	return cost;
@@ -34,20 +74,21 @@ float train_cost(matrix_t *res, matrix_t *des)
 
 /*
  * Feeds forwards the network through multiple sample and returns an average cost
+ * Networks with a softmax output are scored with cross-entropy
+ * Use an evaluator to collect several metrics in one pass, or to use threads
  *
  * net = Neural network struct
  * batch = Batch of samples
  */
 float train_cost_batch(network_t *net, batch_t *batch)
 {
-	int i;
+	eval_t *e;
 	float cost;
 	
-	cost = 0;
-	for (i = 0; i < batch->count; i++) {
-		cost += train_cost(net_execute(net, batch->samples[i]->input), batch->samples[i]->output);
-	}
-	cost /= (float) batch->count;
+	e = eval_new(net, 1, EVAL_COST, 1);
+	eval_run(e, batch);
+	cost = eval_cost(e);
+	eval_free(e);
 	
 	return cost;
 }
@@ -65,129 +106,628 @@ void train_cost_d(matrix_t *res, matrix_t *des, matrix_t *cost)
 }
 
 
+/*
+ * Counts how many samples in a batch the network gets right
+ * The largest output must line up with the hot output of the sample
+ *
+ * net = Neural network struct
+ * batch = Batch of samples
+ *
+ * Returns number of correct samples
+ */
 int train_correct(network_t *net, batch_t *batch)
 {
-	int i, j, max_index, correct;
-	matrix_t *activations;
-	float max_act;
+	eval_t *e;
+	int correct;
 	
-	// Start correct count at 0
-	correct = 0;
+	e = eval_new(net, 1, EVAL_CORRECT, 1);
+	eval_run(e, batch);
+	correct = (int) e->correct;
+	eval_free(e);
 	
-	// Check each batch
-	for (i = 0; i < batch->count; i++) {
-		max_act = -1.0;
-		max_index = -1;
+	return correct;
+}
+
+/*
+ * Feeds forward every sample of a stream and returns an average cost
+ * The stream is rewound first, and is left at the end
+ *
+ * net = Neural network struct
+ * s = Stream of samples
+ *
+ * Returns average cost
+ */
+float train_cost_stream(network_t *net, stream_t *s)
+{
+	eval_t *e;
+	float cost;
+	
+	// One evaluator covers every window
+	e = eval_new(net, 1, EVAL_COST, 1);
+	eval_stream(e, s);
+	cost = eval_cost(e);
+	eval_free(e);
+	
+	return cost;
+}
+
+/*
+ * Counts how many samples in a stream the network gets right
+ * The stream is rewound first, and is left at the end, so s->record
+ * holds the number of samples checked
+ *
+ * net = Neural network struct
+ * s = Stream of samples
+ *
+ * Returns number of correct samples
+ */
+int train_correct_stream(network_t *net, stream_t *s)
+{
+	eval_t *e;
+	int correct;
+	
+	// One evaluator covers every window
+	e = eval_new(net, 1, EVAL_CORRECT, 1);
+	eval_stream(e, s);
+	correct = (int) e->correct;
+	eval_free(e);
+	
+	return correct;
+}
+
+/*
+ * Allocates all of the private buffers a training worker needs
+ *
+ * w = Worker struct to fill
+ * net = Neural network struct
+ * count = Maximum samples the worker will handle
+ */
+static void train_worker_init(train_worker_t *w, network_t *net, int count)
+{
+	layer_t *l;
+	int i;
+	
+	w->z = (matrix_t **) mem_alloc(sizeof(matrix_t *) * net->depth);
+	w->act = (matrix_t **) mem_alloc(sizeof(matrix_t *) * net->depth);
+	w->delta = (matrix_t **) mem_alloc(sizeof(matrix_t *) * net->depth);
+	w->grad_w = (matrix_t **) mem_alloc(sizeof(matrix_t *) * net->depth);
+	w->grad_b = (matrix_t **) mem_alloc(sizeof(matrix_t *) * net->depth);
+	
+	for (l = net->layer_head, i = 0; l; l = l->next, i++) {
+		w->z[i] = matrix_new(count, l->osize);
+		w->act[i] = matrix_new(count, l->osize);
+		w->delta[i] = matrix_new(count, l->osize);
+		w->grad_w[i] = matrix_new(l->weight->width, l->weight->height);
+		w->grad_b[i] = matrix_new(1, l->bias->height);
+	}
+	
+	w->in = matrix_new(count, net->isize);
+	w->out = matrix_new(count, net->osize);
+}
+
+/*
+ * Frees the private buffers of a training worker
+ *
+ * w = Worker struct
+ * depth = Depth of the network the worker was made for
+ */
+static void train_worker_free(train_worker_t *w, int depth)
+{
+	int i;
+	
+	for (i = 0; i < depth; i++) {
+		matrix_free(w->z[i]);
+		matrix_free(w->act[i]);
+		matrix_free(w->delta[i]);
+		matrix_free(w->grad_w[i]);
+		matrix_free(w->grad_b[i]);
+	}
+	mem_free(w->z);
+	mem_free(w->act);
+	mem_free(w->delta);
+	mem_free(w->grad_w);
+	mem_free(w->grad_b);
+	
+	matrix_free(w->in);
+	matrix_free(w->out);
+}
+
+/*
+ * Creates a new trainer for a network
+ * The trainer owns every buffer needed for training, so once it is set up
+ * training steps do not allocate any memory
+ *
+ * net = Neural network struct
+ * batch = Largest batch size that will be trained on
+ * threads = Number of threads to split each batch between
+ *
+ * Returns pointer to new trainer struct, NULL if the network is read-only
+ */
+trainer_t *train_new(network_t *net, int batch, int threads)
+{
+	trainer_t *new;
+	int i;
+	
+	// Weights in a read-only mapping can't be updated
+	if (net->readonly) {
+		printf("	Network is read-only, it can't be trained!\n");
+		return NULL;
+	}
+	
+	// Forward passes would run on int8 or half width weights that never change
+	if (net->quant || net->half) {
+		printf("	Network is quantized or half width, it can't be trained!\n");
+		return NULL;
+	}
+	
+	if (batch < 1) batch = 1;
+	if (threads < 1) threads = 1;
+	
+	// Alloc and setup new struct
+	new = (trainer_t *) mem_alloc(sizeof(trainer_t));
+	new->net = net;
+	new->batch = batch;
+	new->threads = threads;
+	new->active = 0;
+	new->depth = net->depth;
+	new->isize = net->isize;
+	new->osize = net->osize;
+	new->cur = NULL;
+	new->in = NULL;
+	new->out = NULL;
+	
+	// Plain SGD until told otherwise, which has no state
+	optim_default(&new->opt, OPTIM_SGD);
+	for (i = 0; i < 2; i++) {
+		new->state_w[i] = NULL;
+		new->state_b[i] = NULL;
+	}
+	
+	// Each worker gets an even slice of the largest batch
+	new->workers = (train_worker_t *) mem_alloc(sizeof(train_worker_t) * threads);
+	for (i = 0; i < threads; i++)
+		train_worker_init(&new->workers[i], net, (batch + threads - 1) / threads);
+	
+	// Start up the threads
+	new->pool = pool_new(threads);
+	
+	return new;
+}
+
+/*
+ * Frees the optimizer state of a trainer
+ *
+ * t = Pointer to trainer struct
+ */
+static void train_state_free(trainer_t *t)
+{
+	int i, j;
+	
+	for (j = 0; j < 2; j++) {
+		if (!t->state_w[j]) continue;
 		
-		activations = net_execute(net, batch->samples[i]->input);
+		for (i = 0; i < t->depth; i++) {
+			matrix_free(t->state_w[j][i]);
+			matrix_free(t->state_b[j][i]);
+		}
+		mem_free(t->state_w[j]);
+		mem_free(t->state_b[j]);
+		t->state_w[j] = NULL;
+		t->state_b[j] = NULL;
+	}
+}
+
+/*
+ * Switches a trainer to a different optimizer
+ * Its state is laid out like the weights and bias of every layer and
+ * starts at zero, as does the step count
+ *
+ * t = Pointer to trainer struct
+ * o = Optimizer settings, from optim_default() and then adjusted
+ *
+ * Returns 0 on success, -1 for an unknown optimizer or a changed network
+ */
+int train_optim(trainer_t *t, optim_t *o)
+{
+	layer_t *l;
+	int i, j;
+	
+	if (o->type < OPTIM_SGD || o->type > OPTIM_ADAMW || t->net->depth != t->depth) return -1;
+	
+	train_state_free(t);
+	t->opt = *o;
+	t->opt.t = 0;
+	
+	for (j = 0; j < optim_states(o); j++) {
+		t->state_w[j] = (matrix_t **) mem_alloc(sizeof(matrix_t *) * t->depth);
+		t->state_b[j] = (matrix_t **) mem_alloc(sizeof(matrix_t *) * t->depth);
 		
-		// Search for the output index with the largest
-		for (j = 0; j < activations->height; j++) {
-			if (activations->values[j][0] > max_act) {
-				max_act = activations->values[j][0];
-				max_index = j;
+		for (l = t->net->layer_head, i = 0; l; l = l->next, i++) {
+			t->state_w[j][i] = matrix_new(l->weight->width, l->weight->height);
+			t->state_b[j][i] = matrix_new(1, l->bias->height);
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Frees a trainer and all of its buffers
+ * The network is not freed
+ *
+ * t = Pointer to trainer struct
+ */
+void train_free(trainer_t *t)
+{
+	int i;
+	
+	pool_free(t->pool);
+	train_state_free(t);
+	
+	for (i = 0; i < t->threads; i++)
+		train_worker_free(&t->workers[i], t->depth);
+	mem_free(t->workers);
+	
+	// Free struct
+	mem_free(t);
+}
+
+/*
+ * Training job, each thread runs back propigation on its slice of the batch
+ *
+ * arg = Pointer to trainer struct
+ * id = Thread number
+ * count = Number of threads
+ */
+static void train_job_backprop(void *arg, int id, int count)
+{
+	trainer_t *t;
+	train_worker_t *w;
+	
+	matrix_t in, out;
+	
+	t = (trainer_t *) arg;
+	if (id >= t->active) return;
+	w = &t->workers[id];
+	
+	if (t->in) {
+		// Already gathered, our part is just a run of columns
+		matrix_view(&in, t->in->data + w->start, w->count, t->in->height, t->in->stride);
+		matrix_view(&out, t->out->data + w->start, w->count, t->out->height, t->out->stride);
+		train_backprop_batch(t->net, &in, &out, w);
+		return;
+	}
+	
+	// Gather our part of the batch and run it
+	PROF_BEGIN(span);
+	csv_gather(t->cur, w->start, w->count, w->in, w->out);
+	PROF_END(span, PROF_GATHER, -1, 0, sizeof(float) * w->count * (w->in->height + w->out->height));
+	train_backprop_batch(t->net, w->in, w->out, w);
+}
+
+/*
+ * Update job, each thread sums up the gradients of every worker for its
+ * slice of rows and applies them to the weights and bias
+ * The optimizer updates each row's weights and state in a single pass
+ * Threads never touch the same rows, so no locking is needed
+ *
+ * arg = Pointer to trainer struct
+ * id = Thread number
+ * count = Number of threads
+ */
+static void train_job_update(void *arg, int id, int count)
+{
+	trainer_t *t;
+	layer_t *l;
+	float *g, *s, *sb, *m[2], *mb[2];
+	int i, j, k, x, y, y0, y1, width;
+	
+	t = (trainer_t *) arg;
+	
+	for (l = t->net->layer_head, i = 0; l; l = l->next, i++) {
+		PROF_BEGIN(span);
+		
+		// Figure out which rows belong to us
+		y0 = l->osize * id / count;
+		y1 = l->osize * (id + 1) / count;
+		width = l->weight->width;
+		
+		for (y = y0; y < y1; y++) {
+			// Sum weight gradients into the first worker
+			// Every matrix goes by its own stride, a mapped layer keeps the file's
+			s = t->workers[0].grad_w[i]->data + y * t->workers[0].grad_w[i]->stride;
+			for (j = 1; j < t->active; j++) {
+				g = t->workers[j].grad_w[i]->data + y * t->workers[j].grad_w[i]->stride;
+				for (x = 0; x < width; x++)
+					s[x] += g[x];
+			}
+			
+			// Same thing for the bias
+			sb = t->workers[0].grad_b[i]->data + y * t->workers[0].grad_b[i]->stride;
+			for (j = 1; j < t->active; j++)
+				*sb += t->workers[j].grad_b[i]->data[y * t->workers[j].grad_b[i]->stride];
+			
+			// Optimizer state of the same row
+			for (k = 0; k < 2; k++) {
+				m[k] = t->state_w[k] ? t->state_w[k][i]->data + y * t->state_w[k][i]->stride : NULL;
+				mb[k] = t->state_b[k] ? t->state_b[k][i]->data + y * t->state_b[k][i]->stride : NULL;
 			}
+			
+			// Update weights and bias
+			optim_update(&t->opt, l->weight->data + y * l->weight->stride, s, m[0], m[1], width);
+			optim_update(&t->opt, l->bias->data + y * l->bias->stride, sb, mb[0], mb[1], 1);
 		}
 		
-		// See if it is the correct result from the sample
-		if (batch->samples[i]->output->values[max_index][0] > 0.99) correct++;
+		// Every worker's gradients are read once, the weights read and written
+		PROF_END(span, PROF_UPDATE, l->index, 2.0 * (y1 - y0) * (width + 1) * t->active,
+			sizeof(float) * (y1 - y0) * (width + 1) * (t->active + 2.0));
 	}
+}
+
+/*
+ * Splits the current samples between the workers, then runs
+ * back propigation and the update on all of them
+ *
+ * t = Training context, with the samples to train on set
+ * count = Number of samples
+ * rate = Learning rate
+ */
+static void train_run(trainer_t *t, int count, float rate)
+{
+	int i;
 	
-	return correct;
+	// Buffers are sized per layer, so layers can't come and go
+	if (t->net->depth != t->depth) {
+		printf("	Network has changed since the trainer was made!\n");
+		return;
+	}
+	
+	optim_begin(&t->opt, rate, count);
+	
+	// Don't hand out empty slices
+	t->active = t->threads < count ? t->threads : count;
+	
+	// Give each worker a slice of the batch
+	for (i = 0; i < t->active; i++) {
+		t->workers[i].start = count * i / t->active;
+		t->workers[i].count = count * (i + 1) / t->active - t->workers[i].start;
+	}
+	
+	// Run back propigation on every slice at once
+	pool_run(t->pool, train_job_backprop, t);
+	
+	// Then combine the gradients and update the weights and bias
+	pool_run(t->pool, train_job_update, t);
+}
+
+/*
+ * Updates weights in a network based on a batch of training data
+ * The batch is split between the trainer's threads
+ *
+ * t = Pointer to trainer struct
+ * batch = Pointer to training set, no larger than the trainer was made for
+ * rate = Learning rate
+ */
+void train_step(trainer_t *t, batch_t *batch, float rate)
+{
+	// Nothing to train on
+	if (batch->count <= 0) return;
+	
+	if (batch->count > t->batch) {
+		printf("	Batch of %d samples is too large for trainer! Max=%d\n", batch->count, t->batch);
+		return;
+	}
+	
+	t->cur = batch;
+	train_run(t, batch->count, rate);
+	t->cur = NULL;
 }
 
+/*
+ * Runs a single training step over samples that are already gathered,
+ * like the blocks handed out by a sampler
+ *
+ * t = Training context
+ * in = Input block (isize x samples)
+ * out = Output block (osize x samples)
+ * rate = Learning rate
+ */
+void train_step_block(trainer_t *t, matrix_t *in, matrix_t *out, float rate)
+{
+	// Nothing to train on
+	if (in->width <= 0) return;
+	
+	if (in->width > t->batch) {
+		printf("	Batch of %d samples is too large for trainer! Max=%d\n", in->width, t->batch);
+		return;
+	}
+	
+	t->in = in;
+	t->out = out;
+	train_run(t, in->width, rate);
+	t->in = NULL;
+	t->out = NULL;
+}
 
 /*
  * Updates weights in a network based on a batch of training data
+ * The trainer is the caller's and is kept between calls. It is made on
+ * the first call and only made again for a batch that doesn't fit, so
+ * repeated calls don't allocate. Free it with train_free() when done
  *
  * net = Pointer to neural network struct
+ * t = Pointer to the caller's trainer, NULL before the first call
  * batch = Pointer to training set
  * rate = Learning rate
  */
-void train_batch(network_t *net, batch_t *batch, float rate)
+void train_batch(network_t *net, trainer_t **t, batch_t *batch, float rate)
+{
+	// A new trainer starts its optimizer state over
+	if (*t && ((*t)->net != net || (*t)->depth != net->depth || (*t)->isize != net->isize ||
+		(*t)->osize != net->osize || (*t)->batch < batch->count)) {
+		train_free(*t);
+		*t = NULL;
+	}
+	
+	if (!*t) *t = train_new(net, batch->count, 1);
+	if (!*t) return;
+	
+	train_step(*t, batch, rate);
+}
+
+/*
+ * Multiplies a delta block by the derivative of a layer's activation function
+ *
+ * l = Layer that produced the delta
+ * z = Calculated intermediate of the layer (osize x samples)
+ * delta = Delta block (osize x samples)
+ */
+static void train_delta_der(layer_t *l, matrix_t *z, matrix_t *delta)
+{
+	int y;
+	
+	// One call per row, the kernel is vectorized along the samples
+	for (y = 0; y < delta->height; y++)
+		l->act->der_v(z->data + y * z->stride, delta->data + y * delta->stride, delta->width);
+}
+
+/*
+ * Sums up the columns of a delta block into a bias gradient (BP3)
+ *
+ * delta = Delta block (osize x samples)
+ * grad_b = Bias gradient (osize x 1)
+ */
+static void train_delta_sum(matrix_t *delta, matrix_t *grad_b)
+{
+	int x, y;
+	float *d, sum;
+	
+	for (y = 0; y < delta->height; y++) {
+		d = delta->data + y * delta->stride;
+		sum = 0;
+		for (x = 0; x < delta->width; x++)
+			sum += d[x];
+		grad_b->data[y * grad_b->stride] = sum;
+	}
+}
+
+/*
+ * Runs back propigation on the network over a whole block of samples
+ * Every step is done as a matrix-matrix product over the block
+ * Gradients are summed over the block and written into the worker
+ * The network itself is not modified, so threads can each run their own block
+ *
+ * net = Pointer to neural network struct
+ * in = Input block (isize x samples)
+ * out = Desired output block (osize x samples)
+ * w = Worker with scratch buffers large enough for the block
+ */
+void train_backprop_batch(network_t *net, matrix_t *in, matrix_t *out, train_worker_t *w)
 {
-	int i, x, y;
-	float m;
+	int i, n;
+	matrix_t *prev;
 	layer_t *l;
-	matrix_t **grad_w, **grad_b;
 	
-	/*
-	 * Here are some global registers so we don't have to keep allocating
-	 * and deallocating memory all the time
-	 */
-	matrix_t **delta_w, **delta_b;
+	// Sanity check for training blocks
+	if (in->height != net->isize || out->height != net->osize || in->width != out->width) {
+		printf("	Block mismatch! Input=%dx%d, Output=%dx%d, Network=%d->%d\n", in->width, in->height, out->width, out->height, net->isize, net->osize);
+		return;
+	}
+	
+	// Sanity check
+	if (net->depth <= 0)
+		return;
+	
+	// Feed forward the whole block
+	n = in->width;
+	net_forward(net, in, w->z, w->act);
 	
-	// First order of business is to set up the gradient matricies 
-	grad_w = (matrix_t **) malloc(sizeof(matrix_t *) * net->depth);
-	grad_b = (matrix_t **) malloc(sizeof(matrix_t *) * net->depth);
+	// Start at last layer
+	l = net->layer_tail;
+	i = net->depth - 1;
 	
-	// Lets set up the registers too while we are here
-	delta_w = (matrix_t **) malloc(sizeof(matrix_t *) * net->depth);
-	delta_b = (matrix_t **) malloc(sizeof(matrix_t *) * net->depth);
+	// Calculate BP1
+	PROF_BEGIN(bp1);
+	matrix_resize(w->delta[i], n);
+	train_cost_d(w->act[i], out, w->delta[i]);
+	train_delta_der(l, w->z[i], w->delta[i]);
+	PROF_END(bp1, PROF_BP1, i, 3.0 * l->osize * n, 4.0 * sizeof(float) * l->osize * n);
 	
-	// Create a zeroed matrix for every weight and bias gradient
-	l = net->layer_head;
-	i = 0;
 	while (l) {
+		// Add to bias gradient (BP3)
+		PROF_BEGIN(bp3);
+		train_delta_sum(w->delta[i], w->grad_b[i]);
+		PROF_END(bp3, PROF_BP3, i, (double) l->osize * n, sizeof(float) * (double) l->osize * (n + 1));
 		
-		grad_w[i] = matrix_new(l->weight->width, l->weight->height);
-		grad_b[i] = matrix_new(1, l->bias->height);
+		// Get the activation of the previous layer
+		if (!i)
+			prev = in;
+		else
+			prev = w->act[i-1];
+		
+		// Multiply by the transposed activation to get weight gradient (BP4)
+		// This sums the outer products of every sample in one go
+		PROF_BEGIN(bp4);
+		matrix_mul_nt(w->delta[i], prev, w->grad_w[i]);
+		PROF_END(bp4, PROF_BP4, i, layer_flops(l, n), layer_bytes(l, n));
 		
-		// Lets zero them both out
-		for (y = 0; y < l->weight->height; y++)
-			for (x = 0; x < l->weight->width; x++)
-				grad_w[i]->values[y][x] = 0.0;
+		// Done once we reach the first layer
+		if (!l->prev) break;
 		
-		for (y = 0; y < l->bias->height; y++)
-			grad_b[i]->values[y][0] = 0.0;
+		// Calculate BP2
+		// Multiply by the transposed weights to get delta for the previous layer
+		PROF_BEGIN(bp2);
+		matrix_resize(w->delta[i-1], n);
+		matrix_mul_tn(l->weight, w->delta[i], w->delta[i-1]);
 		
-		// Do the registers too
-		delta_w[i] = matrix_new(l->weight->width, l->weight->height);
-		delta_b[i] = matrix_new(1, l->bias->height);
+		// Mutliply by derivative of activation function 
+		train_delta_der(l->prev, w->z[i-1], w->delta[i-1]);
+		PROF_END(bp2, PROF_BP2, i, layer_flops(l, n), layer_bytes(l, n));
 		
-		// Next layer
-		i++;
-		l = l->next;
+		//Onto the next layer
+		i--;
+		l = l->prev;
 	}
+}
+
+/*
+ * Trains a network over one pass of a stream
+ * Each window is shuffled, then split into mini-batches of the given size
+ * The stream is rewound first, and is left at the end
+ *
+ * t = Training context
+ * s = Stream of samples
+ * size = Samples per mini-batch, at most the trainer's batch size
+ * rate = Learning rate
+ */
+void train_stream(trainer_t *t, stream_t *s, int size, float rate)
+{
+	batch_t *w, sub;
+	sample_t *tmp;
+	int i, j;
 	
-	// Now we can run back propigation on all of the training samples
-	for (i = 0; i < batch->count; i++)
-		train_backprop(net, batch->samples[i], grad_w, grad_b, delta_w, delta_b);
-	
-	// Finally, update the weights and bias
-	m = rate / ((float) batch->count);
+	if (size > t->batch) size = t->batch;
+	if (size < 1) size = 1;
 	
-	// Iterate through the different layers and update
-	l = net->layer_head;
-	i = 0;
-	while (l) {
-		// Update weights
-		for (y = 0; y < l->weight->height; y++)
-			for (x = 0; x < l->weight->width; x++)
-				l->weight->values[y][x] -= m * grad_w[i]->values[y][x];
-			
-		// Update bias
-		for (y = 0; y < l->bias->height; y++)
-			l->bias->values[y][0] -= m * grad_b[i]->values[y][0];
+	stream_rewind(s);
+	while ((w = stream_next(s))) {
+		// Mix up the window so batches aren't just runs of the file
+		for (i = w->count - 1; i > 0; i--) {
+			j = dist_below(dist_rng(), i + 1);
+			tmp = w->samples[i];
+			w->samples[i] = w->samples[j];
+			w->samples[j] = tmp;
+		}
 		
-		// Next layer
-		i++;
-		l = l->next;
-	}
-	
-	// Free gradient and regsiter matricies
-	for (i = 0; i < net->depth; i++) {
-		matrix_free(grad_w[i]);
-		matrix_free(grad_b[i]);
-		matrix_free(delta_w[i]);
-		matrix_free(delta_b[i]);
+		// Mini-batches are just runs of the window's sample pointers
+		memset(&sub, 0, sizeof(sub));
+		for (i = 0; i < w->count; i += size) {
+			sub.samples = w->samples + i;
+			sub.scale = w->scale;
+			sub.count = w->count - i < size ? w->count - i : size;
+			train_step(t, &sub, rate);
+		}
 	}
-	free(grad_w);
-	free(grad_b);
-	free(delta_w);
-	free(delta_b);
-	
-	// All done
 }
 
 /*
@@ -203,11 +743,15 @@ void train_batch(network_t *net, batch_t *batch, float rate)
  */
 void train_backprop(network_t *net, sample_t *sample, matrix_t **grad_w, matrix_t **grad_b, matrix_t **delta_w, matrix_t **delta_b)
 {
-	int i, y, depth;
-	matrix_t *act, *weight_tran;
+	int i, depth;
+	matrix_t *act;
 	layer_t *l;
 	
 	// Sanity check for training sample
+	if (sample->raw) {
+		printf("	Sample record #%d has packed inputs, gather it into a block first!\n", sample->serial);
+		return;
+	}
 	if (sample->input->height != net->isize || sample->input->width != 1) {
 		printf("	Input mismatch of sample record #%d! Sample=%dx%d, Network=%d\n", sample->serial, sample->input->width, sample->input->height, net->isize);
 		return;
@@ -232,8 +776,7 @@ void train_backprop(network_t *net, sample_t *sample, matrix_t **grad_w, matrix_
 	
 	// Calculate BP1
 	train_cost_d(net->layer_tail->result, sample->output, delta_b[i]);
-	for (y = 0; y < net->osize; y++)
-		delta_b[i]->values[y][0] *= net->layer_tail->der(net->layer_tail->z->values[y][0]);
+	train_delta_der(net->layer_tail, net->layer_tail->z, delta_b[i]);
 				
 	// Add to bias gradient (BP3)
 	matrix_add(grad_b[i], delta_b[i], grad_b[i]);
@@ -244,14 +787,8 @@ void train_backprop(network_t *net, sample_t *sample, matrix_t **grad_w, matrix_
 	else
 		act = net->layer_tail->prev->result;
 	
-	// Transpose activation of previous layer
-	act = matrix_ntrans(act);
-	
-	// Now multiply (BP4)
-	matrix_mul(delta_b[i], act, delta_w[i]);
-
-	// Free the newly created matrix
-	matrix_free(act);
+	// Now multiply by the transposed activation (BP4)
+	matrix_mul_nt(delta_b[i], act, delta_w[i]);
 	
 	// Add to weight gradient
 	matrix_add(grad_w[i], delta_w[i], grad_w[i]);
@@ -261,18 +798,11 @@ void train_backprop(network_t *net, sample_t *sample, matrix_t **grad_w, matrix_
 	i--;
 	while (l) {
 		// Calculate BP2
-		// Transpose weights matrix
-		weight_tran = matrix_ntrans(l->next->weight);
-		
-		// Multiply to get delta
-		matrix_mul(weight_tran, delta_b[i+1], delta_b[i]);
+		// Multiply by the transposed weights to get delta
+		matrix_mul_tn(l->next->weight, delta_b[i+1], delta_b[i]);
 		
 		// Mutliply by derivative of activation function 
-		for (y = 0; y < l->result->height; y++)
-			delta_b[i]->values[y][0] *= l->der(l->z->values[y][0]);
-		
-		// Free newly created matrix
-		matrix_free(weight_tran);
+		train_delta_der(l, l->z, delta_b[i]);
 		
 		// Add to bias gradient (BP3)
 		matrix_add(grad_b[i], delta_b[i], grad_b[i]);
@@ -283,14 +813,8 @@ void train_backprop(network_t *net, sample_t *sample, matrix_t **grad_w, matrix_
 		else
 			act = l->prev->result;
 		
-		// Transpose activation of previous layer
-		act = matrix_ntrans(act);
-		
-		// Multiply to get delta for layer (BP4)
-		matrix_mul(delta_b[i], act, delta_w[i]);
-		
-		// Free newly created matrix
-		matrix_free(act);
+		// Multiply by the transposed activation to get delta for layer (BP4)
+		matrix_mul_nt(delta_b[i], act, delta_w[i]);
 		
 		// Add to weight gradient
 		matrix_add(grad_w[i], delta_w[i], grad_w[i]);